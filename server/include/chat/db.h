@@ -112,6 +112,7 @@ typedef struct server_db
     plq_t   queue;
     dbctx_t ctx;
     const server_db_commands_t* cmd;
+    struct server_pool* cmd_pool;   /* dbcmd_ctx_t pool, NULL: malloc() */
 } server_db_t;
 
 bool        server_init_db(server_t* server);
@@ -5,6 +5,8 @@
 #include "server_client.h"
 #include "chat/db.h"
 
+typedef struct server_timer server_timer_t;
+
 enum upload_token_type 
 {
     UT_USER_PFP,
@@ -27,7 +29,7 @@ typedef struct upload_token
         u32 user_id;
         tmp_msg_t msg_state;
     };
-    i32 timerfd;
+    server_timer_t* timer;
     i32 timer_seconds;
 } upload_token_t;
 
@@ -4,6 +4,7 @@
 #include "common.h"
 #include "server_tm.h"
 #include "chat/db_def.h"
+#include "server_http.h"
 
 typedef struct 
 {
@@ -21,9 +22,9 @@ const char*     server_mime_type(server_t* server, const void* data,
                                                         size_t size);
 bool            server_save_file(eworker_t* th, const void* data, 
                         size_t size, const char* name);
+/* Hash and store a complete upload, takes its temp file on success. */
 bool            server_save_file_img(eworker_t* th, 
-                                     const void* data, 
-                                     size_t size, 
+                                     http_upload_t* upload,
                                      dbuser_file_t** file_output,
                                      bool free_file);
 void*           server_get_file(eworker_t* th, dbuser_file_t* file);
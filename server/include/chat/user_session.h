@@ -3,13 +3,16 @@
 
 #include "common.h"
 
+#define SESSION_EXPIRE MINUTES(30) /* Logged out session lifetime */
+
 typedef struct client client_t;
+typedef struct server_timer server_timer_t;
 
 typedef struct session
 {
     u32 session_id;
     u32 user_id;
-    i32 timerfd;
+    server_timer_t* timer;  /* Expire timer while logged out */
 } session_t;
 
 session_t*      server_new_user_session(server_t* server, client_t* client);
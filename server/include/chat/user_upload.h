@@ -6,5 +6,7 @@
 #include "server_client.h"
 
 void server_handle_user_upload(eworker_t* th, client_t* client, const http_t* http);
+/* Checked on the head, before any of the body is stored. */
+bool server_user_upload_allowed(server_t* server, const http_t* http);
 
 #endif // _SERVER_CHAT_USER_UPLOAD_H_
@@ -13,7 +13,11 @@
 #include "server_http.h"
 #include "server_websocket.h"
 #include "server_ht.h"
+#include "server_fdt.h"
 #include "server_signal.h"
+#include "server_handoff.h"
+#include "server_mq.h"
+#include "server_fcache.h"
 #include "chat/user_file.h"
 #include "chat/db.h"
 #include "chat/upload_token.h"
@@ -47,6 +51,17 @@ typedef struct
     enum ip_version addr_version;
     char database[CONFIG_PATH_LEN];
     bool fork;
+    bool reuseport;     /* Per-worker epoll & SO_REUSEPORT listening socket */
+    bool edge_triggered;/* EPOLLET client connections (reuseport only) */
+    bool io_uring;      /* io_uring event backend (reuseport only) */
+    /* Per-client pending outbound bytes, see server_send_adv() */
+    size_t send_queue_low;
+    size_t send_queue_high;
+    size_t send_queue_max;
+    u32  idle_timeout;  /* Seconds before a non-WebSocket client is closed, 0 = off */
+    u32  drain_timeout; /* Seconds to drain clients after a handoff */
+    u32  file_cache_mb; /* Static file cache size, 0 = off */
+    u32  max_upload_mb; /* Bigger request bodies get a 413 */
     i32  thread_pool;
 
     const char* sql_schema;
@@ -67,11 +82,22 @@ typedef struct
     const char* sql_insert_userfiles;
 } server_config_t;
  
+/* Counters, updated with __atomic builtins, printed on SIGUSR1 */
+typedef struct 
+{
+    u64 send_queued;        /* Sends that had to be queued */
+    u64 send_dropped;       /* Droppable sends skipped for slow clients */
+    u64 slow_clients;       /* Times a client went above high watermark */
+    u64 evicted_clients;    /* Clients disconnected for exceeding max */
+    u64 mq_queued;          /* Sends passed to the client's owner worker */
+    u64 send_pending;       /* Not a counter: clients with queued data now */
+} server_stats_t;
+
 typedef struct server
 {
     struct {
         i32 sock;       /* Server socket fd */
-        i32 epfd;       /* epoll fd */
+        i32 epfd;       /* epoll fd (shared by all workers, unless reuseport) */
         i32 eventfd;    /* eventfd (used to wake up threads from epoll_wait()) */
         i32 sigfd;      /* signalfd */
     };
@@ -89,12 +115,17 @@ typedef struct server
     };
     socklen_t addr_len;
 
-    server_ght_t event_ht;
-    server_ght_t client_ht;
+    server_fdt_t fdt;   /* Events & clients by fd */
     server_ght_t user_ht;
     server_ght_t session_ht;
     server_ght_t upload_token_ht;
-    server_ght_t chat_cmd_ht;
+    server_fcache_t fcache;
+    server_stats_t stats;
+    server_handoff_t handoff;
+    char exe_path[PATH_MAX];    /* Binary to exec on handoff */
+    i32 argc;
+    char* const* argv;
+    bool draining;  /* Handed off, not accepting new clients */
     bool running;
 } server_t;
 
@@ -102,7 +133,21 @@ void server_run(server_t* server);
 void server_cleanup(server_t* server);
 i32  server_print_sockerr(i32 fd);
 
+/* Can be dropped if the client is too slow, e.g. presence updates */
+#define SERVER_SEND_DROPPABLE 0x01
+
+#define server_stats_inc(server, x) \
+    __atomic_fetch_add(&(server)->stats.x, 1, __ATOMIC_RELAXED)
+#define server_stats_dec(server, x) \
+    __atomic_fetch_sub(&(server)->stats.x, 1, __ATOMIC_RELAXED)
+
 ssize_t     server_send(client_t* client, const void* buf, size_t len);
+ssize_t     server_send_adv(client_t* client, const void* buf, size_t len, u32 flags);
+/* Send all of `iov` in order, each part without copying if the socket takes it. */
+ssize_t     server_sendv(client_t* client, const struct iovec* iov, u32 n);
+/* Send `size` bytes of file `fd` from `offset` without copying it, closes `fd`. */
+ssize_t     server_send_file(client_t* client, i32 fd, size_t offset, size_t size);
+void        server_print_stats(server_t* server);
 ssize_t     server_recv(client_t* client, void* buf, size_t len);
 
 #endif // _SERVER_H_
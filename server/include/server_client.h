@@ -6,6 +6,8 @@
 #include "chat/user_session.h"
 #include "chat/user.h"
 
+typedef struct server_event server_event_t;
+
 #define USERNAME_MAX 50
 #define DISPLAYNAME_MAX 50
 
@@ -14,6 +16,8 @@
 #define CLIENT_STATE_WEBSOCKET       0x0002
 #define CLIENT_STATE_KEEP_ALIVE      0x0004
 #define CLIENT_STATE_LOGGED_IN       0x0008
+#define CLIENT_STATE_TLS_HANDSHAKE   0x0010 /* SSL handshake not done yet */
+#define CLIENT_STATE_CLOSING         0x0020 /* Close once the send queue is flushed */
 
 #define CLIENT_ERR_NONE  00
 #define CLIENT_ERR_SSL   01
@@ -21,15 +25,78 @@
 #define CLIENT_RECV_PAGE             4096
 #define CLIENT_MAX_ERRORS 3
 
+/* Max connections accepted per listening socket event */
+#define CLIENT_ACCEPT_BATCH          16
+/* Max reads per client event before letting other events run */
+#define CLIENT_READ_BUDGET           16
+/* Default send queue watermarks, config.json overrides them */
+#define CLIENT_SEND_QUEUE_LOW        (256 * KIB)
+#define CLIENT_SEND_QUEUE_HIGH       (1024 * KIB)
+#define CLIENT_SEND_QUEUE_MAX        (4096 * KIB)
+/* Default seconds a connection can stay silent before upgrading to WebSocket */
+#define CLIENT_IDLE_TIMEOUT          60
+/* pread() + SSL_write() size when sending a file without kTLS */
+#define CLIENT_FILE_CHUNK            (64 * KIB)
+
+enum client_hs_status
+{
+    CLIENT_HS_DONE,
+    CLIENT_HS_WANT_READ,
+    CLIENT_HS_WANT_WRITE,
+    CLIENT_HS_ERROR
+};
+
+enum client_flush_status
+{
+    CLIENT_FLUSH_DONE,
+    CLIENT_FLUSH_AGAIN,
+    CLIENT_FLUSH_ERROR
+};
+
 typedef struct 
 {
     u8*     data;
     size_t  data_size;
     size_t  offset;
     bool    busy;
+    bool    in_pool;    /* `data` is a CLIENT_RECV_PAGE from the worker's pool */
     http_t* http;
 } recv_buf_t;
 
+/*
+ * Queued data, or a file (fd != -1): `len` bytes of it, `pos` sent so far.
+ * A file is sent with SSL_sendfile() on kTLS, else read a `chunk` at a
+ * time, and isn't counted in send_queue_t::bytes.
+ * `chunk_len` bytes from `pos` are read and not sent yet, SSL_write()
+ * retries need the same ones.
+ */
+typedef struct client_send_buf
+{
+    struct client_send_buf* next;
+    size_t  len;
+    i32     fd;
+    u8*     chunk;      /* CLIENT_FILE_CHUNK, NULL on kTLS */
+    size_t  chunk_len;
+    size_t  pos;
+    u8      data[];
+} client_send_buf_t;
+
+/*
+ * Data SSL_write() couldn't send without blocking.
+ * `watcher` is a EPOLLOUT event on a dup() of the client socket,
+ * any worker can arm it without touching the client's own event.
+ * It holds a client reference, so it can still take ssl_mutex after
+ * server_free_client() and see ssl is NULL.
+ */
+typedef struct 
+{
+    client_send_buf_t*  head;
+    client_send_buf_t*  tail;
+    size_t              bytes;
+    server_event_t*     watcher;
+    bool                slow;   /* Went above high, until below low */
+} send_queue_t;
+
 typedef struct client
 {
     net_addr_t  addr;
@@ -39,15 +106,37 @@ typedef struct client
     dbuser_t*   dbuser;
     session_t*  session;
     recv_buf_t  recv;
+    send_queue_t send;      /* Protected by ssl_mutex */
+    eworker_t*  ew;         /* Worker that accepted this client */
+    struct server_timer* idle_timer; /* Until upgraded to WebSocket */
+    u64         last_active;/* ew->timers clock, last time it sent anything or a flush made progress */
+    u32         refs;       /* Own event + flush watcher, memory freed at 0 */
     pthread_mutex_t ssl_mutex;
 } client_t;
 
-client_t*   server_accept_client(eworker_t* ew);
-int         server_client_ssl_handsake(server_t* server, client_t* client);
+client_t*   server_accept_client(eworker_t* ew, i32 listen_fd);
+/* Client for socket `fd` accepted by io_uring. */
+client_t*   server_new_client(eworker_t* ew, i32 fd);
+int         server_client_ssl_init(server_t* server, client_t* client);
+enum client_hs_status server_client_ssl_handsake(client_t* client);
 client_t*   server_get_client_fd(server_t* server, i32 fd);
 client_t*   server_get_client_user_id(server_t* server, u64 id);
+/* `clients[i]` for `ids[i]`, NULL if not connected. return: connected count */
+size_t      server_get_clients_user_ids(server_t* server, const u32* ids, size_t n, 
+                                        client_t** clients);
+/* Tears the connection down, memory goes with the last reference. */
 void        server_free_client(eworker_t* ew, client_t* client);
+void        server_client_unref(eworker_t* ew, client_t* client);
 void        server_get_client_info(client_t* client);
 void        server_set_client_err(client_t* client, u16 err);
+void        server_client_free_recv(eworker_t* ew, client_t* client);
+/* Bytes io_uring received for the client's SSL memory BIO. */
+void        server_client_feed(client_t* client, const void* buf, size_t len);
+
+/* All three need client->ssl_mutex. */
+bool        server_client_queue(client_t* client, const void* buf, size_t len);
+/* Send or queue `size` bytes of file `fd` from `offset`, takes ownership of `fd`. */
+bool        server_client_send_file(client_t* client, i32 fd, size_t offset, size_t size);
+enum client_flush_status server_client_flush(client_t* client);
 
 #endif // _SERVER_CLIENT_H_
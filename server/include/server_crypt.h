@@ -13,6 +13,8 @@
 
 void server_sha512(const char* secret, u8* salt, u8* hash);
 void server_sha256_str(const void* data, size_t size, char* output);
+/* Hex digest of an incremental SHA256_Init()/SHA256_Update() hash. */
+void server_sha256_final_str(SHA256_CTX* sha256, char* output);
 char* server_compute_websocket_key(const char* websocket_key);
 
 #endif // _SERVER_CRYPT_H_
@@ -8,47 +8,80 @@
  *  `se` = "Server Event"
  */
 
-#define DEFAULT_EPEV (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+#define DEFAULT_EPEV (EPOLLIN | EPOLLRDHUP)
+#define WRITE_EPEV   (EPOLLOUT | EPOLLRDHUP)
+
+/* 
+ * Trigger mode bits, kept when an event changes what it listens for.
+ * Shared epoll: EPOLLONESHOT, so only one worker handles a fd at a time.
+ * Per-worker epoll (reuseport): none, only the owner worker waits on it.
+ */
+#define SE_MODE_EPEV (EPOLLONESHOT | EPOLLET)
 
 enum se_status 
 {
     SE_OK,
     SE_CLOSE,
     SE_ERROR,
+    SE_AGAIN,   /* Nothing more to read (EAGAIN) */
 };
 
 typedef struct server_event server_event_t;
+typedef struct client client_t;
 
 typedef enum se_status (*se_read_callback_t)(eworker_t* ew, server_event_t* ev);
+typedef enum se_status (*se_write_callback_t)(eworker_t* ew, server_event_t* ev);
 typedef enum se_status (*se_close_callback_t)(eworker_t* ew, server_event_t* ev);
+typedef void (*se_recv_callback_t)(server_event_t* ev, const u8* buf, size_t len);
+
+typedef struct server_uring server_uring_t;
 
 typedef struct server_event
 {
     i32 fd;
+    i32 epfd;   /* epoll instance this event is registered in */
+    server_uring_t* ring;   /* io_uring backend instead of epfd */
+    u32 uring_id;           /* fd table generation, in io_uring user_data */
+    u8  uring_op;           /* enum uring_op, how it's armed in `ring` */
+    bool uring_pollout;     /* POLLOUT poll pending next to a multishot op */
+    i32 uring_res;          /* Multishot accept: the accepted socket */
     i32 err;
     u32 ep_events;
     u32 listen_events;
     void* data;
-    bool  keep_data;
     se_read_callback_t read;
+    se_write_callback_t write; /* Optional, called on EPOLLOUT */
     se_close_callback_t close;
+    se_recv_callback_t recv;   /* io_uring multishot recv: bytes received */
 } server_event_t;
 
-server_event_t* server_new_event(server_t* server, i32 fd, void* data, 
+server_event_t* server_new_event(eworker_t* ew, i32 fd, void* data, 
                                 se_read_callback_t read_callback, 
                                 se_close_callback_t close_callback);
+server_event_t* server_new_accept_event(eworker_t* ew, i32 listen_fd);
+server_event_t* server_new_client_event(eworker_t* ew, client_t* client);
+server_event_t* server_new_flush_event(eworker_t* ew, client_t* client);
+server_event_t* server_new_db_event(eworker_t* ew);
 server_event_t* server_get_event(server_t* server, i32 fd);
 void            server_del_event(eworker_t* ew, server_event_t* se);
 void            server_process_event(eworker_t* ew, server_event_t* se);
 void            server_wait_for_events(eworker_t* ew);
 
-i32 server_event_add(const server_t* server, server_event_t* ev);
-i32 server_event_remove(const server_t* server, const server_event_t* ev);
-i32 server_event_rearm(const server_t* server, const server_event_t* ev);
+i32 server_event_add(server_event_t* ev);
+i32 server_event_remove(const server_event_t* ev);
+i32 server_event_rearm(server_event_t* ev);
+void server_event_listen(server_event_t* ev, u32 events); /* Keeps SE_MODE_EPEV bits */
 
 // Handlers 
 enum se_status se_accept_conn(eworker_t* ew, server_event_t* ev);
 enum se_status se_read_client(eworker_t* ew, server_event_t* ev);
+enum se_status se_write_client(eworker_t* ew, server_event_t* ev);
 enum se_status se_close_client(eworker_t* ew, server_event_t* ev);
+void           se_recv_client(server_event_t* ev, const u8* buf, size_t len);
+enum se_status se_flush_client(eworker_t* ew, server_event_t* ev);
+enum se_status se_close_flush(eworker_t* ew, server_event_t* ev);
+enum se_status se_read_db(eworker_t* ew, server_event_t* ev);
+enum se_status se_write_db(eworker_t* ew, server_event_t* ev);
+enum se_status se_close_db(eworker_t* ew, server_event_t* ev);
 
 #endif // _SERVER_EVENTS_H_
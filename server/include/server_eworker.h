@@ -8,9 +8,13 @@
 #define _SERVER_EVENT_WORKER_H_
 
 #include "chat/db.h"
+#include "server_pool.h"
+#include "server_mq.h"
+#include "server_uring.h"
 
 typedef struct client client_t;
 typedef struct eworker eworker_t;
+typedef struct server_event server_event_t;
 
 #define THREAD_NAME_LEN 32
 #define EWORKER_MAX_EVENTS 16
@@ -21,12 +25,35 @@ typedef struct eworker
 {
     pthread_t   pth;
     pid_t       tid;
+    i32         epfd;       /* Shared server epoll or own epoll (reuseport) */
+    i32         waitfd;     /* Shared epoll only: own epoll with epfd + DB socket */
+    i32         sock;       /* Listening socket this worker accepts on */
+    u32         epev_mode;  /* EPOLLONESHOT for shared epoll, else 0 */
+    u32         epev_client;/* Extra bits for client events (EPOLLET) */
+    server_uring_t* ring;   /* io_uring backend, NULL for epoll */
+    struct server_timer_wheel* timers;
+    server_pools_t pools;
+    server_mq_t mq;         /* Sends to our clients from other workers */
     server_db_t db;
+    server_event_t* db_se;  /* db.fd, wakes us up for results */
     char        name[THREAD_NAME_LEN];
     server_t*   server;
-    struct epoll_event ep_events[EWORKER_MAX_EVENTS];
+    union {
+        struct epoll_event ep_events[EWORKER_MAX_EVENTS];
+        server_uring_cqe_t uring_cqes[EWORKER_MAX_EVENTS];
+    };
 } server_eworker_t, eworker_t;
 
+/* 
+ * Worker run by the calling thread, set by the thread itself before it
+ * touches anything (ew->pth is written by pthread_create() concurrently).
+ */
+extern __thread eworker_t* eworker_self;
+
+/* Pools aren't locked, only the thread running `ew` gets them. */
+#define eworker_pool(ew, name) \
+    (((ew) == eworker_self) ? &(ew)->pools.name : NULL)
+
 bool server_create_eworker(server_t* server, eworker_t* ew, size_t i);
 bool server_eworker_init(eworker_t* ew);
 void server_eworker_async_run(eworker_t* ew);
@@ -0,0 +1,95 @@
+/*
+ * Server File Cache - Static files from conf.root_dir in memory
+ *
+ *  A cached response is one buffer: a prebuilt keep-alive response head
+ *  (Content-Type, Content-Length, Last-Modified, ETag) followed by the
+ *  body, so serving it is one lookup and one send.
+ *  Text files also get gzip (and brotli) responses, compressed once when
+ *  loaded and picked per request from Accept-Encoding.
+ *  Conditional requests matching a response's ETag get a 304.
+ *  Files are refcounted, one can be dropped while a worker still sends it.
+ *  inotify watches the directory of every cached file, any change to a
+ *  cached (or loading) file drops it and the next request reads it again.
+ *  When full, CLOCK picks the files to evict: a hit sets `used`, the hand
+ *  clears it on its way and evicts the first file it finds without.
+ */
+
+#ifndef _SERVER_FCACHE_H_
+#define _SERVER_FCACHE_H_
+
+#include "common.h"
+#include "server_ht.h"
+#include "server_http.h"
+
+#define FCACHE_SIZE_MB      64              /* Default "file_cache_mb" */
+#define FCACHE_MAX_FILE     (1024 * KIB)    /* Bigger files aren't cached */
+#define FCACHE_HEAD_MAX     512
+#define FCACHE_MIN_COMPRESS 256             /* Smaller files aren't compressed */
+
+typedef struct client client_t;
+typedef struct server_fcache server_fcache_t;
+
+/* One encoding of a file. */
+typedef struct fcache_resp
+{
+    char    etag[HTTP_ETAG_LEN];    /* Quoted, as sent */
+    size_t  common_len; /* Head without the Connection lines */
+    size_t  head_len;   /* Keep-alive head, up to and including the empty line */
+    size_t  body_len;
+    u8*     data;       /* head_len + body_len, NULL if not worth it */
+} fcache_resp_t;
+
+typedef struct fcache_file
+{
+    u32     refs;
+    server_fcache_t* fc;
+    struct fcache_file* clock_next; /* Ring of cached files, under fc->mutex */
+    struct fcache_file* clock_prev;
+    bool    used;           /* Hit since the hand last passed */
+    size_t  size;           /* All responses */
+    char*   path;
+    time_t  mtime;
+    const char* cache_control;
+    bool    vary;           /* Has compressed responses */
+    fcache_resp_t resp[HTTP_ENC_COUNT];  /* Identity always there */
+} fcache_file_t;
+
+/* A file being read, an invalidation meanwhile makes it stale. */
+typedef struct fcache_load
+{
+    struct fcache_load* next;
+    const char* path;
+    bool        stale;          /* Don't insert it */
+} fcache_load_t;
+
+typedef struct server_fcache
+{
+    server_ght_t    files;      /* server_ght_hashstr(path) -> fcache_file_t */
+    server_ght_t    dirs;       /* inotify watch descriptor -> directory */
+    pthread_mutex_t mutex;      /* Guards loads, the clock ring and bytes */
+    fcache_load_t*  loads;
+    fcache_file_t*  hand;       /* CLOCK hand, NULL if nothing is cached */
+    size_t          bytes;      /* Of the cached files */
+    size_t          max_bytes;  /* 0: cache disabled */
+    i32             inotify_fd;
+} server_fcache_t;
+
+bool            server_fcache_init(server_t* server);
+void            server_fcache_destroy(server_fcache_t* fc);
+
+/* return: referenced file, NULL if not cached. */
+fcache_file_t*  server_fcache_get(server_fcache_t* fc, const char* path);
+/*
+ * Read `path` into the cache. `st` is the caller's stat() of it, files
+ * the cache can never hold are turned away before any syscall.
+ * return: referenced file, NULL if it can't be cached (too big, disabled...)
+ */
+fcache_file_t*  server_fcache_load(server_t* server, const char* path, 
+                                   const struct stat* st);
+void            server_fcache_unref(fcache_file_t* file);
+
+/* Best encoding `req` accepts, or 304 if the client has it. */
+ssize_t         server_fcache_send(client_t* client, const fcache_file_t* file, 
+                                   const http_t* req);
+
+#endif // _SERVER_FCACHE_H_
@@ -0,0 +1,48 @@
+/*
+ * Server FD Table
+ *
+ *  Events and clients indexed by file descriptor, replaces hash tables
+ *  for fd keys. Lookups are a single atomic load, no lock.
+ *  Every new event on a fd bumps that fd's generation, so a stale
+ *  reference (e.g. a io_uring completion) to a reused fd can be detected.
+ */
+
+#ifndef _SERVER_FDT_H_
+#define _SERVER_FDT_H_
+
+#include "common.h"
+
+#define FDT_MAX_SIZE (1 << 20)
+
+typedef struct server_event server_event_t;
+typedef struct client client_t;
+
+typedef struct 
+{
+    server_event_t* se;
+    client_t*       client;
+    u32             gen;
+} fdt_slot_t;
+
+typedef struct server_fdt
+{
+    fdt_slot_t* slots;
+    size_t      size;   /* RLIMIT_NOFILE, capped to FDT_MAX_SIZE */
+    i32         max_fd; /* Highest fd ever set, bounds FDT_FOREACH */
+} server_fdt_t;
+
+bool    server_fdt_init(server_fdt_t* fdt);
+void    server_fdt_destroy(server_fdt_t* fdt);
+
+/* return: false if `fd` already has a event or is out of range. */
+bool            server_fdt_set_event(server_fdt_t* fdt, i32 fd, server_event_t* se);
+server_event_t* server_fdt_get_event(const server_fdt_t* fdt, i32 fd);
+/* Only if `fd` still maps to `se`. */
+void            server_fdt_del_event(server_fdt_t* fdt, i32 fd, const server_event_t* se);
+u32             server_fdt_gen(const server_fdt_t* fdt, i32 fd);
+
+bool            server_fdt_set_client(server_fdt_t* fdt, i32 fd, client_t* client);
+client_t*       server_fdt_get_client(const server_fdt_t* fdt, i32 fd);
+void            server_fdt_del_client(server_fdt_t* fdt, i32 fd, const client_t* client);
+
+#endif // _SERVER_FDT_H_
@@ -0,0 +1,60 @@
+/*
+ * Server Handoff - Zero-downtime restart
+ *
+ *  On SIGUSR2 the running (old) server forks and execs the server binary
+ *  with --handoff-fd. Over that UNIX socket the old server sends its
+ *  listening sockets (SCM_RIGHTS) and its session table. Once the new
+ *  server is up it acks, the old one stops accepting and drains its
+ *  clients, they reconnect to the new server with their session id.
+ */
+
+#ifndef _SERVER_HANDOFF_H_
+#define _SERVER_HANDOFF_H_
+
+#include "common.h"
+
+#define HANDOFF_MAGIC           0x43484859
+#define HANDOFF_MAX_SOCKS       64
+#define HANDOFF_ACK             'R'
+#define HANDOFF_ACK_TIMEOUT_MS  30000
+#define HANDOFF_DRAIN_TIMEOUT   60
+
+typedef struct
+{
+    u32 magic;
+    u32 n_socks;
+    u32 n_sessions;
+} handoff_hdr_t;
+
+typedef struct
+{
+    u32 session_id;
+    u32 user_id;
+} handoff_session_t;
+
+typedef struct
+{
+    i32     fd;         /* UNIX socket to the other server, -1 if none */
+    pid_t   pid;        /* Old server: pid of the new server */
+    time_t  drain_deadline;
+
+    /* 
+     * New server: what the old server sent. Sockets past the worker
+     * count are accepted on round-robin and sent on the next handoff.
+     */
+    i32     socks[HANDOFF_MAX_SOCKS];
+    u32     n_socks;
+    handoff_session_t* sessions;
+    u32     n_sessions;
+} server_handoff_t;
+
+/* Old server */
+bool server_handoff_start(server_t* server);
+void server_handoff_drain_tick(server_t* server);
+
+/* New server */
+bool server_handoff_recv(server_t* server);
+i32  server_handoff_sock(server_t* server, size_t i);
+bool server_handoff_finish(server_t* server);
+
+#endif // _SERVER_HANDOFF_H_
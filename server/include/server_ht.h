@@ -10,21 +10,36 @@
 
 typedef void (*ght_free_t)(void* data);
 
-typedef struct ght_bucket
+typedef struct ght_slot
 {
     u64     key;
-    void*   data;
-    i8      inheap;
+    void*   data;   /* NULL: empty slot */
+    u32     dist;   /* Probe sequence length, distance from home slot */
+} ght_slot_t;
 
-    struct ght_bucket* next;
-} ght_bucket_t;
+typedef struct ght_table
+{
+    ght_slot_t*     slots;
+    size_t          size;   /* Power of 2, 0: no table */
+    size_t          mask;   /* size - 1 */
+} ght_table_t;
 
 /*
  * Server Generic Hash Table - (GHT; SERVER_GHT)
  *
  * Featurs:
+ *  - Open addressing, Robin Hood linear probing: on insert, an element
+ *    further from its home slot takes the place of a closer one, so
+ *    probe lengths stay short and lookups can stop early.
+ *  - Keys are mixed (splitmix64) and masked, size is always a power of 2.
+ *  - Backward-shift delete, no tombstones and no per-insert allocation.
  *  - Dynamic sizing based on load factor, with adjustable max & min thresholds.
- *  - Thread-Safe.
+ *    Resize is incremental: the old table is kept and every insert/delete
+ *    moves GHT_MIGRATE_SLOTS of its slots, lookups check both tables.
+ *    After a resize load is about max_load / 2, far from both thresholds,
+ *    so a table around one threshold doesn't keep growing and shrinking.
+ *  - Thread-Safe, read-write lock: lookups run concurrently, inserts and
+ *    deletes (writer preferred) wait for them.
  *  - Automatic memory management (if `server_ght_t::free` is provided).
  *  - Generic Types.
  *
@@ -33,14 +48,15 @@ typedef struct ght_bucket
  */
 typedef struct
 {
-    /* Array */
-    ght_bucket_t*   table;
-    size_t          size;
+    ght_table_t     table;
+    ght_table_t     old;            /* Being migrated to `table` */
+    size_t          migrate_pos;    /* Next `old` slot to move */
+    size_t          migrate_left;   /* `old` slots left to move */
     size_t          min_size;
-    size_t          count;
-    bool            ignore_resize;
+    size_t          count;          /* In both tables */
+    bool            ignore_resize;  /* Also stops migration, e.g. for deletes in GHT_FOREACH */
 
-    pthread_mutex_t mutex;
+    pthread_rwlock_t lock;
     ght_free_t      free;
 
     /* Load Factor & min/max thresholds */
@@ -63,6 +79,15 @@ bool    server_ght_insert(server_ght_t* ht, u64 key, void* data);
 /* return: NULL if not found */
 void*   server_ght_get(server_ght_t* ht, u64 key);
 
+/* server_ght_get() for a caller holding the lock, e.g. to ref the element. */
+void*   server_ght_get_locked(server_ght_t* ht, u64 key);
+
+/* 
+ * Lookup `n` keys under one read lock, `out[i]` is NULL if not found.
+ * return: number found.
+ */
+size_t  server_ght_get_batch(server_ght_t* ht, const u32* keys, size_t n, void** out);
+
 /* return: false if not found. */
 bool    server_ght_del(server_ght_t* ht, u64 key);
 
@@ -72,20 +97,36 @@ void    server_ght_clear(server_ght_t* ht);
 /* Delete all elements, mutex and table array. */
 void    server_ght_destroy(server_ght_t* ht);
 
-/* Loop each element in hash table. */
+/* First slot after an empty one, where GHT_FOREACH starts. */
+size_t  server_ght_foreach_start(const ght_table_t* table);
+
+/* 
+ * Loop each element in hash table (both tables while resizing).
+ * `code_block` may delete elements (with `ignore_resize` set): a delete
+ * shifts the next elements back one slot, so a slot is looped again if
+ * its element changed. Starting after an empty slot, no element can be
+ * shifted from the start back to the end.
+ */
 #define GHT_FOREACH(item, ht, code_block)\
-    for (size_t i = 0; i < ht->size; i++)\
+    for (ght_table_t* _tbl = &ht->old; _tbl;\
+         _tbl = (_tbl == &ht->old) ? &ht->table : NULL)\
+    for (size_t _n = 0, _i = server_ght_foreach_start(_tbl);\
+         _n < _tbl->size; _n++, _i = (_i + 1) & _tbl->mask)\
     {\
-        ght_bucket_t* _bucket = ht->table + i;\
-        while (_bucket && _bucket->data)\
+        ght_slot_t* _slot = _tbl->slots + _i;\
+        void* _data;\
+        while ((_data = _slot->data))\
         {\
-            item = _bucket->data;\
+            item = _data;\
             code_block\
-            _bucket = _bucket->next;\
+            if (_slot->data == _data)\
+                break;\
         }\
     }
 
+/* Write lock, only reading (e.g. GHT_FOREACH without deletes): rdlock */
 void server_ght_lock(server_ght_t* ht);
+void server_ght_rdlock(server_ght_t* ht);
 void server_ght_unlock(server_ght_t* ht);
 
 #endif // _SERVER_HT_H_
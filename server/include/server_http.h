@@ -4,6 +4,8 @@
 #include "common.h"
 #include "server_client.h"
 #include "server_tm.h"
+#include "server_crypt.h"
+#include <sys/stat.h>
 
 #define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
@@ -12,27 +14,47 @@
 // #define HTTP_VERSION "HTTP/3"
 #define HTTP_VERSION "HTTP/1.1"
 
-#define HTTP_METHOD_LEN     16
-#define HTTP_VERSION_LEN    16
-#define HTTP_URL_LEN        256
-#define HTTP_HEAD_NAME_LEN  64
-#define HTTP_HEAD_VAL_LEN   256
-#define HTTP_CODE_LEN       6
-#define HTTP_STATUS_MSG_LEN 128
-
 #define HTTP_MAX_HEADERS    20
 #define HTTP_MAX_PARAMS     10
+#define HTTP_SNIFF_LEN      4096    /* Bytes libmagic sees of a streamed file */
+#define HTTP_UPLOAD_CHUNK   (64 * KIB)
+#define HTTP_UPLOAD_MAX_MB  32      /* Default "max_upload_mb" */
+#define HTTP_UPLOAD_TMP_DIR ".tmp"  /* In conf.img_dir, not watched by the file cache */
+#define HTTP_RESP_BUF       4096    /* Stack buffer for a response head */
 
 #define HTTP_CODE_SW_PROTO      101
 #define HTTP_CODE_OK            200
+#define HTTP_CODE_PARTIAL       206
+#define HTTP_CODE_NOT_MODIFIED  304
 #define HTTP_CODE_BAD_REQ       400
 #define HTTP_CODE_NOT_FOUND     404
+#define HTTP_CODE_PAYLOAD_TOO_LARGE 413
+#define HTTP_CODE_RANGE_NOT_SATISFIABLE 416
+#define HTTP_CODE_HEAD_TOO_LARGE 431
 #define HTTP_CODE_INTERAL_ERROR 500
 
 #define HTTP_HEAD_CONTENT_LEN "Content-Length"
 #define HTTP_HEAD_WS_ACCEPT   "Sec-WebSocket-Accept"
 #define HTTP_HEAD_CONN_UPGRADE "Upgrade"
 #define HTTP_HEAD_CONTENT_TYPE "Content-Type"
+#define HTTP_HEAD_ACCEPT_ENC   "Accept-Encoding"
+
+#define HTTP_DATE_FMT       "%a, %d %b %Y %H:%M:%S GMT"
+#define HTTP_ETAG_LEN       80  /* Quoted SHA-256 hex and an encoding suffix */
+/* Uploads are named by content hash, they never change. */
+#define HTTP_CACHE_IMMUTABLE  "public, max-age=31536000, immutable"
+/* Anything else may change, revalidate every time (a 304 is cheap). */
+#define HTTP_CACHE_REVALIDATE "no-cache"
+
+/* Content-Encoding, in order of preference. */
+enum http_encoding
+{
+    HTTP_ENC_IDENTITY,
+    HTTP_ENC_GZIP,
+    HTTP_ENC_BR,
+
+    HTTP_ENC_COUNT
+};
 
 enum http_keep_alive
 {
@@ -47,26 +69,73 @@ enum http_type
     HTTP_RESPOND
 };
 
+/* Validators and caching of a GET response. */
+typedef struct 
+{
+    const char* etag;           /* Quoted */
+    time_t      mtime;
+    const char* cache_control;
+    bool        vary;           /* Vary: Accept-Encoding */
+} http_cache_t;
+
+enum http_range_status
+{
+    HTTP_RANGE_NONE,            /* Whole file: no Range, If-Range mismatch, multi-range... */
+    HTTP_RANGE_OK,
+    HTTP_RANGE_UNSATISFIABLE
+};
+
+typedef struct 
+{
+    size_t start;
+    size_t len;
+} http_range_t;
+
+/*
+ * Parsed requests don't copy anything, all strings point into the
+ * client's receive buffer and are NUL-terminated in place.
+ * Responses point to strings (and the body) that must outlive http_send().
+ */
 typedef struct 
 {
-    char method[HTTP_METHOD_LEN];
-    char url[HTTP_URL_LEN];
-    char version[HTTP_VERSION_LEN];
+    const char* method;
+    const char* url;
+    const char* version;
 } http_req_t;
 
 typedef struct 
 {
-    char version[HTTP_VERSION_LEN];
+    const char* version;
     u16 code;
-    char msg[HTTP_STATUS_MSG_LEN];
+    const char* msg;
 } http_resp_t;
 
 typedef struct 
 {
-    char name[HTTP_HEAD_NAME_LEN];
-    char val[HTTP_HEAD_VAL_LEN];
+    const char* name;
+    const char* val;
+    u32 name_len;
+    u32 val_len;
 } http_header_t;
 
+/*
+ * A request body, streamed to a temp file in conf.img_dir/.tmp (same
+ * file system as the store, so it can be renamed into it, but not a
+ * directory the file cache watches) and hashed on the way. Memory stays
+ * at one chunk whatever the Content-Length.
+ * Only authorized POSTs up to conf.max_upload_mb get one.
+ */
+typedef struct http_upload
+{
+    i32         fd;
+    char*       path;               /* Temp file, NULL once someone took it */
+    SHA256_CTX  sha256;
+    size_t      size;               /* Written so far */
+    size_t      head_len;
+    u8          head[HTTP_SNIFF_LEN];       /* Start of the body, for libmagic */
+    u8          chunk[HTTP_UPLOAD_CHUNK];   /* Receive buffer */
+} http_upload_t;
+
 typedef struct http
 {
     enum http_type type;
@@ -78,9 +147,10 @@ typedef struct http
     size_t n_headers;
     http_header_t params[HTTP_MAX_PARAMS];
     size_t n_params;
-    char* body;
+    const char* body;   /* Responses only, requests have `upload` */
     size_t body_len;
     size_t header_len;
+    http_upload_t* upload;
 
     struct {
         enum http_keep_alive keep_alive;
@@ -94,17 +164,33 @@ typedef struct http
     } buf;
 } http_t;
 
-typedef struct 
-{
-    char* str;
-    size_t len;
-    size_t max;
-} http_to_str_t;
-
+/*
+ * `buf` holds `buf_len` bytes, the first client->recv.offset of them were
+ * already seen by a previous call that found no complete head.
+ */
 enum client_recv_status server_http_parse(eworker_t* ew, client_t* client, u8* buf, 
                                           size_t buf_len);
 enum client_recv_status server_handle_http(eworker_t* ew, client_t* client, http_t* http);
 http_header_t*          http_get_header(const http_t* http, const char* name);
+/* More of `client->recv.http`'s body arrived in its upload chunk. */
+enum client_recv_status server_http_recv_body(eworker_t* ew, client_t* client, size_t len);
+/* Complete upload: close it, `hash` gets the SHA-256 hex of the body. */
+void                    http_upload_finish(http_upload_t* upload, char* hash);
+void                    http_upload_free(http_upload_t* upload);
+/* return: bitmask of (1 << enum http_encoding) the client accepts. */
+u32                     http_accept_encoding(const http_t* http);
+/* return: true if the client's copy is current (If-None-Match/If-Modified-Since). */
+bool                    http_not_modified(const http_t* req, const http_cache_t* cache);
+/* Single "bytes=" Range of a `size` bytes file, honoring If-Range. */
+enum http_range_status  http_get_range(const http_t* req, const http_cache_t* cache, 
+                                       size_t size, http_range_t* range);
+/*
+ * Strong ETag of file `path` into `etag` (HTTP_ETAG_LEN), `suffix` tells
+ * encodings apart. return: its Cache-Control.
+ */
+const char*             server_http_file_etag(server_t* server, const char* path, 
+                                              const struct stat* st, const char* suffix,
+                                              char* etag);
 http_t*                 http_new_resp(u16 code, const char* status_msg, const char* body, 
                                       size_t body_len);
 ssize_t                 http_send(client_t* client, http_t* http);
@@ -115,10 +201,24 @@ void                    server_http_resp_error(client_t* client, u16 error_code,
 void                    server_http_resp_404_not_found(client_t* client);
 void                    server_http_resp_ok(client_t* client, char* content, 
                                             size_t content_len, const char* content_type);
+/* 
+ * Stream `fd` (`size` bytes) as the body, `range` of it with a 206 if
+ * not NULL. Closes `fd`.
+ */
+void                    server_http_resp_file(client_t* client, i32 fd, size_t size,
+                                              const http_range_t* range,
+                                              const char* content_type, 
+                                              const http_cache_t* cache);
+void                    server_http_resp_range_not_satisfiable(client_t* client, 
+                                                               size_t size);
+void                    server_http_resp_not_modified(client_t* client, 
+                                                      const http_cache_t* cache);
 
 enum client_recv_status server_handle_http_get(server_t* server, client_t* client, http_t* http);
 
 void                    server_handle_http_post(eworker_t* ew, client_t* client, 
                                                 const http_t* http);
+/* Head of a POST with a body: may its body be stored? */
+bool                    server_http_post_allowed(server_t* server, const http_t* http);
 
 #endif // _SERVER_HTTP_H_
@@ -3,6 +3,10 @@
 
 #include "common.h"
 
+typedef struct eworker eworker_t;
+
 server_t* server_init(int argc, char* const* argv);
+i32       server_new_listen_sock(const server_t* server);
+bool      server_init_eworker_epoll(server_t* server, eworker_t* ew, size_t i);
 
 #endif // _SERVER_INIT_H_
\ No newline at end of file
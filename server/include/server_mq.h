@@ -0,0 +1,65 @@
+/*
+ * Server Message Queue - Cross-worker sends
+ *
+ *  In reuseport mode a client is only ever handled by the worker that
+ *  accepted it (client->ew). Other workers don't write to it directly,
+ *  they push a message to the owner's queue and the owner sends it.
+ *  The queue is a lock-free MPSC stack: producers CAS-push, the owner
+ *  takes the whole list at once and reverses it back to FIFO.
+ *  An eventfd in the owner's epoll/io_uring wakes it up.
+ *
+ *  Frames are encoded once and refcounted, one broadcast to 1000 members
+ *  is one frame, not 1000 copies.
+ *
+ *  Reuseport mode only. With the shared epoll any worker reads any client,
+ *  so an owner would still share ssl_mutex with whichever worker reads,
+ *  and waking it needs its eventfd in what it sleeps on: workers sleep on
+ *  the shared epoll itself so that one event wakes one worker, not all.
+ *  There broadcasts send directly, one frame for all members still.
+ */
+
+#ifndef _SERVER_MQ_H_
+#define _SERVER_MQ_H_
+
+#include "common.h"
+
+typedef struct eworker eworker_t;
+typedef struct client client_t;
+
+typedef struct server_frame
+{
+    u32     refs;
+    size_t  len;
+    u8      data[];
+} server_frame_t;
+
+typedef struct server_msg
+{
+    struct server_msg* next;
+    client_t*       client;
+    i32             fd;
+    u32             gen;    /* fd table generation, client could be gone */
+    u32             flags;  /* server_send_adv() flags */
+    server_frame_t* frame;
+} server_msg_t;
+
+typedef struct server_mq
+{
+    server_msg_t*   head;   /* Newest first */
+    i32             efd;    /* eventfd, -1 if not in use */
+} server_mq_t;
+
+server_frame_t* server_frame_new(size_t len);
+server_frame_t* server_frame_ref(server_frame_t* frame);
+void            server_frame_unref(server_frame_t* frame);
+
+bool    server_mq_init(eworker_t* ew);
+/*
+ * Send `frame` to `client` from worker `ew`.
+ * Directly if `ew` owns the client (or shared epoll, see above), else 
+ * queued to the owner. Takes its own reference to `frame`.
+ */
+void    server_send_frame(eworker_t* ew, client_t* client,
+                          server_frame_t* frame, u32 flags);
+
+#endif // _SERVER_MQ_H_
@@ -0,0 +1,47 @@
+/*
+ * Server Pool - Per-worker object pools
+ *
+ *  Free-list cache of fixed size objects, owned by one event worker,
+ *  no locking. Blocks are plain malloc() blocks, so an object allocated
+ *  by one worker can be released into another worker's pool.
+ */
+
+#ifndef _SERVER_POOL_H_
+#define _SERVER_POOL_H_
+
+#include "common.h"
+
+#define POOL_MAX_FREE 1024 /* Max cached objects per pool */
+
+typedef struct server_pool
+{
+    const char* name;
+    size_t      obj_size;
+    void*       free_list;
+    size_t      n_free;
+
+    /* Only written by owner, read by server_print_stats() */
+    u64         hits;
+    u64         misses;
+} server_pool_t;
+
+typedef struct 
+{
+    server_pool_t client;
+    server_pool_t event;
+    server_pool_t dbcmd;
+    server_pool_t recv_page;
+} server_pools_t;
+
+void    server_pool_init(server_pool_t* pool, const char* name, size_t obj_size);
+void    server_pool_destroy(server_pool_t* pool);
+
+/* Zeroed like calloc(). If `pool` is NULL: calloc(1, size) */
+void*   server_pool_alloc(server_pool_t* pool, size_t size);
+/* If `pool` is NULL or full: free() */
+void    server_pool_free(server_pool_t* pool, void* obj);
+
+void    server_pools_init(server_pools_t* pools);
+void    server_pools_destroy(server_pools_t* pools);
+
+#endif // _SERVER_POOL_H_
@@ -9,21 +9,46 @@
 
 #define TIMER_ONCE  0x80
 
+/*
+ * Timer Wheel
+ *
+ *  One per event worker, driven by a single timerfd ticking every
+ *  TIMER_WHEEL_TICK seconds. Timers are hashed into a slot by expire tick,
+ *  `rounds` counts full turns left for timers longer than one turn.
+ *  Add and cancel are O(1).
+ *
+ *  Callbacks run without the wheel mutex. An expiring timer belongs to
+ *  the worker running it, canceling it only marks it and waits for its
+ *  callback to return, the worker frees it.
+ */
+#define TIMER_WHEEL_SLOTS 256 /* Must be power of 2 */
+#define TIMER_WHEEL_TICK  1
+
 enum timer_type
 {
     TIMER_CLIENT_SESSION,
-    TIMER_UPLOAD_TOKEN
+    TIMER_UPLOAD_TOKEN,
+    TIMER_CLIENT_IDLE
 };
 
 union timer_data
 {
     session_t* session;
     upload_token_t* ut;
+    client_t* client;
 };
 
-typedef struct 
+typedef struct server_timer_wheel server_timer_wheel_t;
+
+typedef struct server_timer
 {
-    i32 fd;
+    struct server_timer* next;
+    struct server_timer* prev;
+    server_timer_wheel_t* wheel;
+    u32 slot;
+    u32 rounds;
+    bool expiring;  /* Unlinked, on se_timer_read()'s list */
+    bool canceled;  /* While expiring, don't run or relink it */
     i32 seconds;
     i32 flags;
     u64 exp;
@@ -31,11 +56,30 @@ typedef struct
     union timer_data data;
 } server_timer_t;
 
-server_timer_t*     server_addtimer(eworker_t* th, i32 seconds, i32 flags, 
-                                    enum timer_type type, union timer_data* data, 
+typedef struct server_timer_wheel
+{
+    i32 fd;
+    u32 current;    /* Current slot */
+    u64 ticks;      /* Ticks since start, coarse clock for idle checks */
+    size_t count;
+    server_timer_t* slots[TIMER_WHEEL_SLOTS];
+    server_timer_t* running;    /* Its callback is running in `runner` */
+    pthread_t runner;
+    pthread_cond_t done;        /* `running` changed */
+    /* Timers can be added/canceled by any worker */
+    pthread_mutex_t mutex;
+} server_timer_wheel_t;
+
+bool                server_timer_wheel_init(eworker_t* ew);
+void                server_timer_wheel_free(server_timer_wheel_t* wheel);
+u64                 server_timer_wheel_now(const server_timer_wheel_t* wheel);
+
+server_timer_t*     server_addtimer(eworker_t* th, i32 seconds, i32 flags,
+                                    enum timer_type type, union timer_data* data,
                                     size_t size);
-i32                 server_timer_set(server_timer_t* timer, i32 seconds);
-i32                 server_timer_get(server_timer_t* timer);
-void                server_close_timer(eworker_t* th, server_timer_t* timer, bool keep_data);
+/* Reschedule `seconds` from now. */
+void                server_timer_set(server_timer_t* timer, i32 seconds);
+/* Remove and free timer without expiring it, or wait out its callback. */
+void                server_timer_cancel(server_timer_t* timer);
 
 #endif // _SERVER_TIMER_H_
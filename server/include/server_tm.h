@@ -24,6 +24,7 @@ typedef struct
 
 bool    server_init_tm(server_t* server, i32 n_threads);
 void    server_tm_shutdown(server_t* server);
+void    server_tm_free(server_t* server);
 i32     server_tm_system_threads(void);
 
 void tm_lock(server_tm_t* tm);
@@ -0,0 +1,122 @@
+/*
+ * Server io_uring - io_uring event backend
+ *
+ *  Alternative to epoll behind server_event_t, one ring per event worker.
+ *  Arming only queues a SQE which gets submitted together with the next
+ *  wait, so a processed event costs no extra syscall.
+ *
+ *  With kernel 6.0+ listening sockets get a multishot accept and clients a
+ *  multishot recv into a ring of provided buffers: one SQE keeps completing
+ *  with new sockets or received bytes, there is no readiness poll followed
+ *  by accept4()/read() and a re-arm. Received bytes are handed to se->recv
+ *  (the client's SSL memory BIO) and the buffer goes straight back to the
+ *  kernel. Everything else, and waiting for POLLOUT, is a one-shot
+ *  IORING_OP_POLL_ADD, as is every event on older kernels.
+ */
+
+#ifndef _SERVER_URING_H_
+#define _SERVER_URING_H_
+
+#include "common.h"
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+/* Provided buffers for multishot recv, one TLS record each */
+#define URING_RECV_BUFS     256
+#define URING_RECV_BUF_SIZE (16 * KIB)
+
+typedef struct server_event server_event_t;
+
+/* How an event is armed, in the top bits of user_data. */
+enum uring_op
+{
+    URING_OP_POLL,      /* One-shot POLL_ADD, also POLLOUT of the others */
+    URING_OP_ACCEPT,    /* Multishot accept, completions are new sockets */
+    URING_OP_RECV,      /* Multishot recv, completions are received bytes */
+    URING_OP_READY,     /* NOP, more to read than one event's budget */
+};
+
+/* Completion copied out of the CQ ring. */
+typedef struct server_uring_cqe
+{
+    u64 user_data;
+    i32 res;
+    u32 flags;
+} server_uring_cqe_t;
+
+typedef struct server_uring
+{
+    i32         fd;
+    pthread_t   owner;      /* Worker thread waiting on this ring */
+    u32         to_submit;  /* Queued SQEs not yet submitted */
+    bool        multishot;  /* Multishot accept/recv work */
+
+    /* Submission Queue */
+    struct {
+        u32*    head;
+        u32*    tail;
+        u32*    mask;
+        u32*    entries;
+        u32*    array;
+        struct io_uring_sqe* sqes;
+        void*   ptr;
+        size_t  size;
+        size_t  sqes_size;
+    } sq;
+
+    /* Completion Queue */
+    struct {
+        u32*    head;
+        u32*    tail;
+        u32*    mask;
+        struct io_uring_cqe* cqes;
+        void*   ptr;
+        size_t  size;
+    } cq;
+
+    /* Provided buffer ring, only the owner takes and recycles buffers. */
+    struct {
+        struct io_uring_buf_ring* ring;
+        u8*     data;       /* URING_RECV_BUFS * URING_RECV_BUF_SIZE */
+        size_t  size;       /* Of the whole mapping */
+        u16     tail;
+    } bufs;
+
+    /* Other workers can add/remove events in this ring */
+    pthread_mutex_t mutex;
+} server_uring_t;
+
+/* return: NULL if io_uring is not available */
+server_uring_t* server_uring_new(void);
+void            server_uring_free(server_uring_t* ring);
+/* Calling thread becomes the one waiting on `ring`. */
+void            server_uring_set_owner(server_uring_t* ring);
+/* `op` if `ring` can do it, else URING_OP_POLL. */
+enum uring_op   server_uring_op(const server_uring_t* ring, enum uring_op op);
+
+/* Arm `se` the way se->uring_op says. */
+i32  server_uring_add(server_uring_t* ring, server_event_t* se);
+/* After processing: a new poll, or POLLOUT next to a multishot op. */
+i32  server_uring_rearm(server_uring_t* ring, server_event_t* se);
+i32  server_uring_remove(server_uring_t* ring, const server_event_t* se);
+/* Process `se` again after the next wait, without waiting for the socket. */
+i32  server_uring_ready(server_uring_t* ring, const server_event_t* se);
+
+/* 
+ * Submit queued SQEs and wait for completions, like epoll_wait().
+ * return: Number of completions written to `cqes`, -1 on error.
+ */
+i32  server_uring_wait(server_uring_t* ring, server_uring_cqe_t* cqes, 
+                       i32 max_cqes, bool block);
+/*
+ * Event `cqe` is for, with ep_events set. Looked up right before processing
+ * it, an earlier completion may have removed it. Received bytes are passed
+ * to se->recv and the buffer recycled. Owner only.
+ * return: NULL if the event is gone or there is nothing to process.
+ */
+server_event_t* server_uring_event(server_uring_t* ring, server_t* server, 
+                                   const server_uring_cqe_t* cqe);
+
+#endif // _SERVER_URING_H_
@@ -5,6 +5,7 @@
 #include "server_eworker.h"
 #include "server_tm.h"
 #include "server_client.h"
+#include "server_mq.h"
                                     //      Opcode
                                     //      |ONLY|
 #define WS_CONTINUE_FRAME   0x00    // 0b000|0000|
@@ -100,5 +101,8 @@ enum client_recv_status server_ws_parse(eworker_t* ew, client_t* client, u8* buf
 ssize_t ws_send(client_t* client, const char* buf, size_t len);
 ssize_t ws_send_adv(client_t* client, u8 opcode, const char* buf, size_t len, const u8* maskkey);
 ssize_t ws_json_send(client_t* client, json_object* json);
+/* Encoded once for broadcasts, see server_send_frame(). */
+server_frame_t* ws_frame_new(u8 opcode, const char* buf, size_t len);
+server_frame_t* ws_json_frame(json_object* json);
 
 #endif // _SERVER_WEBSOCKET_H_
@@ -2,159 +2,75 @@
 #include "chat/group.h"
 #include "chat/user.h"
 #include "chat/user_login.h"
-#include "server_ht.h"
 #include "server.h"
 
-#define CMD_HT_SIZE 30
-
-bool 
-server_init_chatcmd_logged_in(server_t* server)
-{
-    if (!server_new_chatcmd(server, "client_user_info",
-                            server_client_user_info, 
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "client_groups",
-                            server_client_groups,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "get_member_ids",
-                            server_get_group_member_ids,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "group_create",
-                            server_group_create,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "get_user",
-                            server_get_user,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "get_all_groups",
-                            server_get_all_groups,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "join_group",
-                            server_join_group,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "group_msg",
-                            server_group_msg,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "get_group_msgs",
-                            server_get_group_msgs,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "edit_account",
-                            server_user_edit_account,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "create_group_code",
-                            server_create_group_code,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "join_group_code",
-                            server_join_group_code,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "get_group_codes",
-                            server_get_group_codes,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "delete_group_code",
-                            server_delete_group_code,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "delete_msg",
-                            server_delete_group_msg,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    if (!server_new_chatcmd(server, "delete_group",
-                            server_delete_group,
-                            CHATCMD_PERM_LOGGED_IN))
-        return false;
-
-    return true;
-}
-
-bool 
-server_init_chatcmd_not_logged_in(server_t* server)
-{
-    if (!server_new_chatcmd(server, "register",
-                            server_client_register,
-                            CHATCMD_PERM_NONE)) 
-        return false;
-
-    if (!server_new_chatcmd(server, "login",
-                            server_client_login,
-                            CHATCMD_PERM_NONE)) 
-        return false;
-
-    if (!server_new_chatcmd(server, "session",
-                            server_client_login_session,
-                            CHATCMD_PERM_NONE)) 
-        return false;
-
-    return true;
-}
+#define CHATCMD(name, cb, perm) { name, cb, CHATCMD_PERM_##perm }
+#define CHATCMD_COUNT (sizeof(chatcmd_table) / sizeof(server_chatcmd_t))
+
+/*
+ * Sorted by name (strcmp order), looked up with binary search.
+ * server_init_chatcmd() refuses to start if it's out of order.
+ */
+static const server_chatcmd_t chatcmd_table[] = {
+    CHATCMD("client_groups",     server_client_groups,        LOGGED_IN),
+    CHATCMD("client_user_info",  server_client_user_info,     LOGGED_IN),
+    CHATCMD("create_group_code", server_create_group_code,    LOGGED_IN),
+    CHATCMD("delete_group",      server_delete_group,         LOGGED_IN),
+    CHATCMD("delete_group_code", server_delete_group_code,    LOGGED_IN),
+    CHATCMD("delete_msg",        server_delete_group_msg,     LOGGED_IN),
+    CHATCMD("edit_account",      server_user_edit_account,    LOGGED_IN),
+    CHATCMD("get_all_groups",    server_get_all_groups,       LOGGED_IN),
+    CHATCMD("get_group_codes",   server_get_group_codes,      LOGGED_IN),
+    CHATCMD("get_group_msgs",    server_get_group_msgs,       LOGGED_IN),
+    CHATCMD("get_member_ids",    server_get_group_member_ids, LOGGED_IN),
+    CHATCMD("get_user",          server_get_user,             LOGGED_IN),
+    CHATCMD("group_create",      server_group_create,         LOGGED_IN),
+    CHATCMD("group_msg",         server_group_msg,            LOGGED_IN),
+    CHATCMD("join_group",        server_join_group,           LOGGED_IN),
+    CHATCMD("join_group_code",   server_join_group_code,      LOGGED_IN),
+    CHATCMD("login",             server_client_login,         NONE),
+    CHATCMD("register",          server_client_register,      NONE),
+    CHATCMD("session",           server_client_login_session, NONE),
+};
+
+/* Calls per chatcmd_table entry, printed with server_print_stats(). */
+static u64 chatcmd_calls[CHATCMD_COUNT];
 
 bool    
-server_init_chatcmd(server_t* server)
+server_init_chatcmd(UNUSED server_t* server)
 {
-    if (server_ght_init(&server->chat_cmd_ht, CMD_HT_SIZE, 
-                        free /* libc free() */) == false) 
-        return false;
-
-    if (server_init_chatcmd_logged_in(server) == false)
-        return false;
-
-    if (server_init_chatcmd_not_logged_in(server) == false)
-        return false;
-
+    for (size_t i = 1; i < CHATCMD_COUNT; i++)
+    {
+        if (strcmp(chatcmd_table[i - 1].cmd, chatcmd_table[i].cmd) >= 0)
+        {
+            fatal("Chat command table: '%s' not sorted before '%s'.\n",
+                  chatcmd_table[i - 1].cmd, chatcmd_table[i].cmd);
+            return false;
+        }
+    }
     return true;
 }
 
-bool    
-server_new_chatcmd(server_t* server, 
-                   const char* cmd, 
-                   chatcmd_callback_t callback,
-                   i32 perms)
+static const server_chatcmd_t*
+chatcmd_find(const char* cmd)
 {
-    server_chatcmd_t* chatcmd;
-    server_ght_t* ht = &server->chat_cmd_ht;
-
-    if (!server || !cmd || !callback)
-        return false;
+    size_t low = 0;
+    size_t high = CHATCMD_COUNT;
+    size_t mid;
+    i32 cmp;
 
-    chatcmd = calloc(1, sizeof(server_chatcmd_t));
-    if (!chatcmd)
+    while (low < high)
     {
-        fatal("calloc() returned NULL!\n");
-        return false;
+        mid = low + (high - low) / 2;
+        cmp = strcmp(cmd, chatcmd_table[mid].cmd);
+        if (cmp == 0)
+            return chatcmd_table + mid;
+        else if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
     }
-
-    strncpy(chatcmd->cmd, cmd, CMD_STR_MAX);
-    chatcmd->cmd_hash = server_ght_hashstr(chatcmd->cmd);
-    chatcmd->callback = callback;
-    chatcmd->perms = perms;
-
-    return server_ght_insert(ht, chatcmd->cmd_hash, chatcmd);
+    return NULL;
 }
 
 const char* 
@@ -164,23 +80,28 @@ server_exec_chatcmd(const char* cmd,
                     json_object* payload, 
                     json_object* resp)
 {
-    u64 hash_key;
-    const char* ret;
-    server_chatcmd_t* chatcmd;
-    server_ght_t* ht = &ew->server->chat_cmd_ht;
-
-    hash_key = server_ght_hashstr(cmd);
+    const server_chatcmd_t* chatcmd;
 
-    chatcmd = server_ght_get(ht, hash_key);
+    chatcmd = chatcmd_find(cmd);
     if (chatcmd == NULL)
         return "Command not found.";
     else if (!(chatcmd->perms & client->state))
         return "Require permission";
 
-    verbose("Executing '%s' (hash: %zu)...\n", 
-            chatcmd->cmd, chatcmd->cmd_hash);
+    __atomic_fetch_add(&chatcmd_calls[chatcmd - chatcmd_table], 1, __ATOMIC_RELAXED);
+    verbose("Executing '%s'...\n", chatcmd->cmd);
 
-    ret = chatcmd->callback(ew, client, payload, resp);
+    return chatcmd->callback(ew, client, payload, resp);
+}
+
+void
+server_print_chatcmd_stats(void)
+{
+    u64 calls;
 
-    return ret;
+    for (size_t i = 0; i < CHATCMD_COUNT; i++)
+    {
+        if ((calls = __atomic_load_n(&chatcmd_calls[i], __ATOMIC_RELAXED)))
+            info("\tcmd %s: %lu\n", chatcmd_table[i].cmd, calls);
+    }
 }
@@ -123,7 +123,7 @@ db_exec_cmd(eworker_t* ew, dbcmd_ctx_t* cmd)
 }
 
 static void
-db_cmd_free(dbcmd_ctx_t* cmd)
+db_cmd_free(server_db_t* db, dbcmd_ctx_t* cmd)
 {
     if (cmd == NULL)
         return;
@@ -135,7 +135,7 @@ db_cmd_free(dbcmd_ctx_t* cmd)
         next = cmd->next;
         if ((cmd->flags & DB_CTX_DONT_FREE) == 0)
             free(cmd->data);
-        free(cmd);
+        server_pool_free(db->cmd_pool, cmd);
         cmd = next;
     }
 }
@@ -150,7 +150,7 @@ db_exec_cmd_chain(eworker_t* ew, dbcmd_ctx_t* cmd)
             db_exec_cmd(ew, cmd);
         cmd = cmd->next;
     }
-    db_cmd_free(base);
+    db_cmd_free(&ew->db, base);
 }
 
 void 
@@ -162,9 +162,22 @@ db_process_results(eworker_t* ew)
     ExecStatusType status;
     dbcmd_ctx_t* ctx_peek;
     dbcmd_ctx_t* cmd;
+    bool end_of_query = false;
 
-    while ((res = PQgetResult(db->conn)))
+    /* 
+     * Only what libpq already has, PQgetResult() would block if busy.
+     * NULL ends one query's results, two in a row: pipeline is idle.
+     */
+    while (PQisBusy(db->conn) == 0)
     {
+        if ((res = PQgetResult(db->conn)) == NULL)
+        {
+            if (end_of_query)
+                break;
+            end_of_query = true;
+            continue;
+        }
+        end_of_query = false;
         status = PQresultStatus(res);
         // debug("> %zu: %s\n", count, pgres_status_str[status]);
         if (status == PGRES_PIPELINE_SYNC)
@@ -182,7 +195,7 @@ db_process_results(eworker_t* ew)
 
         if (ctx_peek->next == NULL)
         {
-            cmd = malloc(sizeof(dbcmd_ctx_t));
+            cmd = server_pool_alloc(db->cmd_pool, sizeof(dbcmd_ctx_t));
             db_pipeline_dequeue(db, cmd);
             db_exec_cmd_chain(ew, cmd);
         }
@@ -214,7 +227,7 @@ db_pipeline_enqueue_current(server_db_t* db, const dbcmd_ctx_t* cmd)
         return -1;
     }
 
-    dbcmd_ctx_t* next_cmd = malloc(sizeof(dbcmd_ctx_t));
+    dbcmd_ctx_t* next_cmd = server_pool_alloc(db->cmd_pool, sizeof(dbcmd_ctx_t));
     memcpy(next_cmd, cmd, sizeof(dbcmd_ctx_t));
     next_cmd->next = NULL;
     if (next_cmd->client == NULL)
@@ -267,7 +280,7 @@ db_pipeline_current_done(server_db_t* db)
     if (db->ctx.head == NULL)
         return;
     db_pipeline_enqueue(db, db->ctx.head);
-    free(db->ctx.head);
+    server_pool_free(db->cmd_pool, db->ctx.head);
     db_pipeline_reset_current(db);
 }
 
@@ -10,17 +10,18 @@ static const char*
 do_group_broadcast(eworker_t* ew, dbcmd_ctx_t* ctx)
 {
     json_object* json = ctx->param.json;
-    const i32* member_ids = ctx->data;
-    client_t* member_client;
+    const u32* member_ids = ctx->data;
     size_t n_members = ctx->data_size;
+    client_t** member_clients = calloc(n_members + 1, sizeof(client_t*));
+    server_frame_t* frame = ws_json_frame(json);
 
+    server_get_clients_user_ids(ew->server, member_ids, n_members, member_clients);
     for (size_t i = 0; i < n_members; i++)
-    {
-        member_client = server_get_client_user_id(ew->server, member_ids[i]);
-        if (member_client)
-            ws_json_send(member_client, json);
-    }
+        if (member_clients[i])
+            server_send_frame(ew, member_clients[i], frame, 0);
 
+    free(member_clients);
+    server_frame_unref(frame);
     json_object_put(json);
 
     return NULL;
@@ -762,6 +763,8 @@ delete_group_result(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
     size_t        attach_array_len;
     u32*        member_ids;
     size_t      n_members;
+    client_t**  member_clients;
+    server_frame_t* frame;
     u32 group_id;
     group_id = ctx->param.group_id;
 
@@ -797,13 +800,15 @@ delete_group_result(UNUSED eworker_t* ew, dbcmd_ctx_t* ctx)
     json_object_object_add(resp, "group_id",
                            json_object_new_int(group_id));
 
+    member_clients = calloc(n_members + 1, sizeof(client_t*));
+    server_get_clients_user_ids(ew->server, member_ids, n_members, member_clients);
+    frame = ws_json_frame(resp);
     for (size_t i = 0; i < n_members; i++)
-    {
-        client_t* member_client = server_get_client_user_id(ew->server, member_ids[i]);
-        if (member_client)
-            ws_json_send(member_client, resp);
-    }
+        if (member_clients[i])
+            server_send_frame(ew, member_clients[i], frame, 0);
 
+    server_frame_unref(frame);
+    free(member_clients);
     json_object_put(resp);
     return NULL;
 }
@@ -4,6 +4,7 @@
 #include "chat/db_user.h"
 #include "chat/db.h"
 #include "server_websocket.h"
+#include "server.h"
 
 const char* const rtusm_status_str[RTUSM_STATUS_LEN] = {
     "offline",
@@ -21,6 +22,8 @@ do_rtusm_broadcast(eworker_t* ew, dbcmd_ctx_t* ctx)
     rtusm_t* status;
     rtusm_new_t new;
     json_object* json;
+    server_frame_t* frame;
+    client_t** clients;
     const char* status_str;
     const char* pfp_hash = ctx->param.rtusm.pfp_hash;
 
@@ -62,13 +65,15 @@ do_rtusm_broadcast(eworker_t* ew, dbcmd_ctx_t* ctx)
                                json_object_new_string(pfp_hash));
     }
 
+    clients = calloc(size + 1, sizeof(client_t*));
+    server_get_clients_user_ids(ew->server, user_ids, size, clients);
+    frame = ws_json_frame(json);
     for (size_t i = 0; i < size; i++)
-    {
-        client_t* connected_client = server_get_client_user_id(ew->server, user_ids[i]);
-        if (connected_client)
-            ws_json_send(connected_client, json);
-    }
+        if (clients[i])
+            server_send_frame(ew, clients[i], frame, SERVER_SEND_DROPPABLE);
 
+    free(clients);
+    server_frame_unref(frame);
     json_object_put(json);
     free((void*)pfp_hash);
     return NULL;
@@ -23,7 +23,7 @@ server_new_upload_token(eworker_t* ew, u32 user_id)
                             &timer_data, sizeof(void*));
     if (timer)
     {
-        ut->timerfd = timer->fd;
+        ut->timer = timer;
         ut->timer_seconds = timer->seconds;
     }
 
@@ -71,7 +71,6 @@ void
 server_del_upload_token(eworker_t* ew, upload_token_t* upload_token)
 {
     server_t* server = ew->server;
-    server_event_t* se_timer;
     dbmsg_t* msg;
 
     if (!server || !upload_token)
@@ -80,11 +79,7 @@ server_del_upload_token(eworker_t* ew, upload_token_t* upload_token)
         return;
     }
 
-    if (upload_token->timerfd)
-    {
-        se_timer = server_get_event(server, upload_token->timerfd);
-        server_del_event(ew, se_timer);
-    }
+    server_timer_cancel(upload_token->timer);
 
     if (upload_token->type == UT_MSG_ATTACHMENT)
     {
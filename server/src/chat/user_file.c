@@ -61,7 +61,7 @@ server_read_file(void* data, size_t size,
 
     snprintf(paew, PATH_MAX, "%s/%s", dir, name);
 
-    fd = open(paew, O_RDONLY);
+    fd = open(paew, O_RDONLY | O_CLOEXEC);
     if (fd == -1) 
     {
         error("open file %s failed: %s\n",
@@ -82,42 +82,24 @@ cleanup:
     return bytes_read;
 }
 
+/* Atomically move a finished upload to `dir`/`name`. */
 static bool
-server_write_file(const void* data, 
-                  size_t size, 
-                  const char* dir, 
-                  const char* name)
+server_store_file(const char* tmp_path, const char* dir, const char* name)
 {
-    i32 fd = -1;
-    char* path = calloc(1, PATH_MAX);
-    bool ret = false;
+    char path[PATH_MAX];
 
     snprintf(path, PATH_MAX, "%s/%s", dir, name);
 
-    debug("Writing file to: %s\n", path);
-
-    fd = open(path, O_WRONLY | O_CREAT, 
-                    S_IRUSR | S_IWUSR);
-    if (fd == -1)
-    {
-        error("Failed to open/create file at %s: %s\n",
-              path, ERRSTR);
-        goto cleanup;
-    }
+    debug("Storing file to: %s\n", path);
 
-    if (write(fd, data, size) == -1)
+    if (rename(tmp_path, path) == -1)
     {
-        error("Failed to write to %s: %s\n", 
-              path, ERRSTR);
-        goto cleanup;
+        error("Failed to rename %s to %s: %s\n", 
+              tmp_path, path, ERRSTR);
+        unlink(tmp_path);
+        return false;
     }
-
-    ret = true;
-cleanup:
-    free(path);
-    if (fd != -1)
-        close(fd);
-    return ret;
+    return true;
 }
 
 bool 
@@ -133,59 +115,62 @@ server_save_file(UNUSED eworker_t* ew, UNUSED const void* data,
 static const char* 
 do_save_file_img(eworker_t* ew, dbcmd_ctx_t* ctx)
 {
-    const void* data = ctx->param.str;
+    char* tmp_path = (char*)ctx->param.str;
     dbuser_file_t* file;
     dbcmd_ctx_t* refcount_ctx = ctx->next;
     i32 ref_count;
 
+    /* Queuing the refcount failed, the upload still owns `tmp_path`. */
     if (refcount_ctx == NULL)
     {
         warn("do_save_file_img() ctx->next is NULL!\n");
         return "Internal error";
     }
     if (ctx->ret == DB_ASYNC_ERROR)
+    {
+        unlink(tmp_path);
+        free(tmp_path);
         return "Failed to save image";
+    }
 
     file = ctx->data;
     ref_count = refcount_ctx->data_size;
 
+    /* Same hash, same content: an existing file is already right. */
     if (ref_count == 1)
-    {
-        server_write_file(data, file->size,
-                          ew->server->conf.img_dir, 
-                          file->hash);
-    }
+        server_store_file(tmp_path, ew->server->conf.img_dir, file->hash);
+    else
+        unlink(tmp_path);
 
-    free((void*)data);
+    free(tmp_path);
 
     return NULL;
 }
 
 bool 
-server_save_file_img(eworker_t* ew, const void* data, size_t size, 
+server_save_file_img(eworker_t* ew, http_upload_t* upload, 
                      dbuser_file_t** file_output, bool free_file)
 {
     dbuser_file_t* file;
     const char* mime_type;
     bool ret = true;
 
-    mime_type = server_mime_type(ew->server, data, size);
+    mime_type = server_mime_type(ew->server, upload->head, upload->head_len);
     if (mime_type == NULL || strstr(mime_type, "image/") == NULL)
     {
         warn("save img mime_type failed: %s\n", mime_type);
-        info("data: %s\n", (const char*)data);
-        print_hex(data, 20);
+        print_hex((const char*)upload->head, (upload->head_len < 20) ? upload->head_len : 20);
         return false;
     }
     file = calloc(1, sizeof(dbuser_file_t));
     strncpy(file->mime_type, mime_type, DB_MIME_TYPE_LEN);
 
-    server_sha256_str(data, size, file->hash);
-    file->size = size;
+    http_upload_finish(upload, file->hash);
+    file->size = upload->size;
 
     dbcmd_ctx_t ctx = {
         .exec = do_save_file_img,
-        .param.str = data,
+        .param.str = upload->path,
         .data = file,
         .flags = (free_file) ? 0 : DB_CTX_DONT_FREE 
     };
@@ -197,6 +182,9 @@ server_save_file_img(eworker_t* ew, const void* data, size_t size,
         ret = db_async_userfile_refcount(&ew->db, file->hash, &ctx);
     }
 
+    /* do_save_file_img() moves or removes it now. */
+    if (ret)
+        upload->path = NULL;
     if (ret && file_output)
         *file_output = file;
 
@@ -16,7 +16,6 @@ server_set_client_logged_in(eworker_t* ew,
                             session_t* session, 
                             json_object* respond_json)
 {
-    server_event_t* session_timer_ev = NULL;
     const client_t* client_already_logged_in;
     const u64 session_id = (session) ? session->session_id : 0;
 
@@ -42,15 +41,10 @@ server_set_client_logged_in(eworker_t* ew,
             user->user_id, user->username, user->displayname);
     }
 
-    if (session && session->timerfd)
+    if (session && session->timer)
     {
-        session_timer_ev = server_get_event(ew->server, session->timerfd);
-        if (session_timer_ev)
-        {
-            session_timer_ev->keep_data = true;
-            server_del_event(ew, session_timer_ev);
-        }
-        session->timerfd = 0;
+        server_timer_cancel(session->timer);
+        session->timer = NULL;
     }
 
     return NULL;
@@ -33,7 +33,7 @@ server_get_client_session_uid(server_t* server, u32 user_id)
 {
     server_ght_t* ht = &server->session_ht;
 
-    server_ght_lock(ht);
+    server_ght_rdlock(ht);
     GHT_FOREACH(session_t* session, ht, {
         if (session->user_id == user_id)
         {
@@ -56,6 +56,8 @@ server_del_user_session(server_t* server, session_t* session)
 
     verbose("Deleting session: %u for user %u\n", session->session_id, session->user_id);
 
+    server_timer_cancel(session->timer);
+
     server_ght_del(&server->session_ht, session->session_id);
 
     free(session);
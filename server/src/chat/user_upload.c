@@ -14,7 +14,7 @@ server_check_upload_token(server_t* server, const http_t* http, u32* user_id)
 {
     char* endptr;
     const http_header_t* upload_token_header = http_get_header(http, "Upload-Token");
-    const char* token_str = upload_token_header->val;
+    const char* token_str = (upload_token_header) ? upload_token_header->val : NULL;
     if (!token_str)
     {
         error("No Upload-Token in POST request!\n");
@@ -133,7 +133,7 @@ server_handle_user_pfp_update(eworker_t* ew, client_t* client, const http_t* htt
 
     dbuser_file_t* file;
 
-    if (server_save_file_img(ew, http->body, http->body_len, &file, false))
+    if (http->upload && server_save_file_img(ew, http->upload, &file, false))
         failed = update_user_pfp(ew, user, file);
     else
     {
@@ -145,10 +145,7 @@ respond:
         if (failed)
             resp = http_new_resp(HTTP_CODE_INTERAL_ERROR, "Interal server error", NULL, 0);
         else
-        {
             resp = http_new_resp(HTTP_CODE_OK, "OK", NULL, 0);
-            ((http_t*)http)->body_inheap = false;
-        }
     }
 
     http_send(client, resp);
@@ -158,7 +155,6 @@ respond:
 static const char*
 do_insert_msg_after(eworker_t* ew, dbcmd_ctx_t* ctx)
 {
-    server_event_t* se;
     dbmsg_t* msg;
     upload_token_t* ut = ctx->param.ptr;
     if (ctx->ret == DB_ASYNC_ERROR)
@@ -167,10 +163,7 @@ do_insert_msg_after(eworker_t* ew, dbcmd_ctx_t* ctx)
     msg = ctx->data;
     server_get_send_group_msg(ew, msg);
 clear:
-    if ((se = server_get_event(ew->server, ut->timerfd)))
-        server_del_event(ew, se);
-    else
-        server_del_upload_token(ew, ut);
+    server_del_upload_token(ew, ut);
     ctx->data = NULL;
     return NULL; 
 }
@@ -211,7 +204,7 @@ server_handle_msg_attach(eworker_t* ew, client_t* client,
     if (attach_json)
     {
         dbuser_file_t* file = NULL;
-        if (server_save_file_img(ew, http->body, http->body_len, &file, true))
+        if (http->upload && server_save_file_img(ew, http->upload, &file, true))
         {
             json_object_object_add(attach_json, "hash",
                                    json_object_new_string(file->hash));
@@ -227,12 +220,6 @@ server_handle_msg_attach(eworker_t* ew, client_t* client,
                 };
                 db_async_insert_group_msg(&ew->db, msg, &ctx);
             }
-
-            /*
-             * Hacky set http->body_inheap to false so the body wont be freed.
-             * Why? server_save_file_img() will free it in do_save_file_img()
-             */
-            ((http_t*)http)->body_inheap = false;
         }
     }
     else
@@ -246,6 +233,12 @@ respond:
     }
 }
 
+bool
+server_user_upload_allowed(server_t* server, const http_t* http)
+{
+    return server_check_upload_token(server, http, NULL) != NULL;
+}
+
 void 
 server_handle_user_upload(eworker_t* ew, client_t* client, const http_t* http)
 {
@@ -253,7 +246,6 @@ server_handle_user_upload(eworker_t* ew, client_t* client, const http_t* http)
     http_t* resp = NULL;
     u32 user_id;
     upload_token_t* ut = NULL;
-    server_event_t* se;
 
     ut = server_check_upload_token(server, http, &user_id);
 
@@ -266,11 +258,7 @@ server_handle_user_upload(eworker_t* ew, client_t* client, const http_t* http)
     if (ut->type == UT_USER_PFP)
     {
         server_handle_user_pfp_update(ew, client, http, user_id);
-        se = server_get_event(ew->server, ut->timerfd);
-        if (se)
-            server_del_event(ew, se);
-        else
-            server_del_upload_token(ew, ut);
+        server_del_upload_token(ew, ut);
     }
     else if (ut->type == UT_MSG_ATTACHMENT)
     {
@@ -1,5 +1,6 @@
 #include "server.h"
 #include "server_client.h"
+#include "chat/cmd.h"
 
 i32
 server_print_sockerr(i32 fd)
@@ -25,13 +26,11 @@ server_run(server_t* server)
 static void 
 server_del_all_clients(server_t* server)
 {
-    server_ght_t* ht = &server->client_ht;
-    ht->ignore_resize = true;
+    client_t* client;
 
-    GHT_FOREACH(client_t* client, ht, {
-        server_free_client(&server->main_ew, client);
-    });
-    server_ght_destroy(ht);
+    for (i32 fd = 0; fd <= server->fdt.max_fd; fd++)
+        if ((client = server_fdt_get_client(&server->fdt, fd)))
+            server_free_client(&server->main_ew, client);
     server_ght_destroy(&server->user_ht);
 }
 
@@ -62,13 +61,11 @@ server_del_all_upload_tokens(server_t* server)
 void
 server_del_all_events(server_t* server)
 {
-    server_ght_t* ht = &server->event_ht;
-    ht->ignore_resize = true;
+    server_event_t* ev;
 
-    GHT_FOREACH(server_event_t* ev, ht, {
-        server_del_event(&server->main_ew, ev);
-    });
-    server_ght_destroy(&server->event_ht);
+    for (i32 fd = 0; fd <= server->fdt.max_fd; fd++)
+        if ((ev = server_fdt_get_event(&server->fdt, fd)))
+            server_del_event(&server->main_ew, ev);
 }
 
 void 
@@ -78,13 +75,15 @@ server_cleanup(server_t* server)
         return;
 
     server_tm_shutdown(server);
-    server_ght_destroy(&server->chat_cmd_ht);
     server_del_all_events(server);
+    server_fcache_destroy(&server->fcache);
     server_del_all_clients(server);
     server_del_all_sessions(server);
     server_del_all_upload_tokens(server);
     server_db_free(server);
     server_close_magic(server);
+    server_tm_free(server);
+    server_fdt_destroy(&server->fdt);
 
     SSL_CTX_free(server->ssl_ctx);
 
@@ -112,18 +111,100 @@ server_print_ssl_error(client_t* client, i32 ret, const char* from)
 ssize_t 
 server_send(client_t* client, const void* buf, size_t len)
 {
-    ssize_t bytes_sent = -1;
+    return server_send_adv(client, buf, len, 0);
+}
 
-    pthread_mutex_lock(&client->ssl_mutex);
-    if (client->err != CLIENT_ERR_SSL)
+/* Needs client->ssl_mutex. */
+static ssize_t
+server_send_locked(client_t* client, const void* buf, size_t len)
+{
+    ssize_t bytes_sent;
+    i32 err;
+
+    /* 
+     * Write directly only if nothing is queued, to keep the order.
+     * If the socket is full, queue it and let the flush event send it,
+     * never block the worker on a slow client.
+     */
+    if (client->send.head == NULL)
     {
         bytes_sent = SSL_write(client->ssl, buf, len);
-        if (bytes_sent <= 0)
+        if (bytes_sent > 0)
+            return bytes_sent;
+
+        err = SSL_get_error(client->ssl, bytes_sent);
+        if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ)
         {
             server_print_ssl_error(client, bytes_sent, "write");
             server_set_client_err(client, CLIENT_ERR_SSL);
+            return -1;
         }
     }
+
+    return (server_client_queue(client, buf, len)) ? (ssize_t)len : -1;
+}
+
+ssize_t 
+server_send_adv(client_t* client, const void* buf, size_t len, u32 flags)
+{
+    ssize_t bytes_sent = -1;
+
+    pthread_mutex_lock(&client->ssl_mutex);
+    if (client->err == CLIENT_ERR_SSL || client->ssl == NULL)
+        goto out;
+
+    /* Slow client, skip what it can live without. */
+    if (client->send.slow && flags & SERVER_SEND_DROPPABLE)
+    {
+        server_stats_inc(client->ew->server, send_dropped);
+        bytes_sent = 0;
+        goto out;
+    }
+
+    bytes_sent = server_send_locked(client, buf, len);
+out:
+    pthread_mutex_unlock(&client->ssl_mutex);
+    return bytes_sent;
+}
+
+ssize_t 
+server_sendv(client_t* client, const struct iovec* iov, u32 n)
+{
+    ssize_t bytes_sent = 0;
+    ssize_t ret;
+
+    /* One lock, nothing else can go between the parts. */
+    pthread_mutex_lock(&client->ssl_mutex);
+    for (u32 i = 0; i < n && bytes_sent != -1; i++)
+    {
+        if (client->err == CLIENT_ERR_SSL || client->ssl == NULL)
+            bytes_sent = -1;
+        else if (iov[i].iov_len == 0)
+            continue;
+        else if ((ret = server_send_locked(client, iov[i].iov_base, iov[i].iov_len)) == -1)
+            bytes_sent = -1;
+        else
+            bytes_sent += ret;
+    }
+    pthread_mutex_unlock(&client->ssl_mutex);
+    return bytes_sent;
+}
+
+ssize_t 
+server_send_file(client_t* client, i32 fd, size_t offset, size_t size)
+{
+    ssize_t bytes_sent = -1;
+
+    pthread_mutex_lock(&client->ssl_mutex);
+    if (client->err == CLIENT_ERR_SSL || client->ssl == NULL)
+    {
+        close(fd);
+        goto out;
+    }
+
+    if (server_client_send_file(client, fd, offset, size))
+        bytes_sent = size;
+out:
     pthread_mutex_unlock(&client->ssl_mutex);
     return bytes_sent;
 }
@@ -132,13 +213,22 @@ ssize_t
 server_recv(client_t* client, void* buf, size_t len)
 {
     ssize_t bytes_recv = -1;
+    i32 err;
 
     pthread_mutex_lock(&client->ssl_mutex);
-    if (client->err != CLIENT_ERR_SSL)
+    if (client->err != CLIENT_ERR_SSL && client->ssl)
     {
         bytes_recv = SSL_read(client->ssl, buf, len);
         if (bytes_recv <= 0)
         {
+            err = SSL_get_error(client->ssl, bytes_recv);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            {
+                /* Nothing to read (yet), not an error. */
+                pthread_mutex_unlock(&client->ssl_mutex);
+                errno = EAGAIN;
+                return -1;
+            }
             server_print_ssl_error(client, bytes_recv, "read");
             server_set_client_err(client, CLIENT_ERR_SSL);
         }
@@ -146,3 +236,39 @@ server_recv(client_t* client, void* buf, size_t len)
     pthread_mutex_unlock(&client->ssl_mutex);
     return bytes_recv;
 }
+
+void
+server_print_stats(server_t* server)
+{
+    const server_stats_t* stats = &server->stats;
+
+    info("Stats:\n\tsend_queued: %lu\n\tsend_dropped: %lu\n"
+         "\tslow_clients: %lu\n\tevicted_clients: %lu\n\tmq_queued: %lu\n"
+         "\tsend_pending: %lu\n",
+         __atomic_load_n(&stats->send_queued, __ATOMIC_RELAXED),
+         __atomic_load_n(&stats->send_dropped, __ATOMIC_RELAXED),
+         __atomic_load_n(&stats->slow_clients, __ATOMIC_RELAXED),
+         __atomic_load_n(&stats->evicted_clients, __ATOMIC_RELAXED),
+         __atomic_load_n(&stats->mq_queued, __ATOMIC_RELAXED),
+         __atomic_load_n(&stats->send_pending, __ATOMIC_RELAXED));
+
+    for (size_t i = 0; i < server->tm.n_workers; i++)
+    {
+        const server_pools_t* pools = &server->tm.workers[i].pools;
+        const server_pool_t* pool_array[] = {
+            &pools->client, &pools->event, &pools->dbcmd, &pools->recv_page
+        };
+
+        for (size_t p = 0; p < sizeof(pool_array) / sizeof(void*); p++)
+        {
+            const server_pool_t* pool = pool_array[p];
+            info("\tew:%zu pool %s: hits: %lu, misses: %lu, free: %zu\n",
+                 i, pool->name, 
+                 __atomic_load_n(&pool->hits, __ATOMIC_RELAXED),
+                 __atomic_load_n(&pool->misses, __ATOMIC_RELAXED),
+                 pool->n_free);
+        }
+    }
+
+    server_print_chatcmd_stats();
+}
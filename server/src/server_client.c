@@ -1,10 +1,11 @@
 #include "server_client.h"
 #include "server.h"
+#include "server_uring.h"
 
 client_t*   
 server_get_client_fd(server_t* server, i32 fd)
 {
-    return server_ght_get(&server->client_ht, fd);
+    return server_fdt_get_client(&server->fdt, fd);
 }
 
 client_t*   
@@ -13,29 +14,57 @@ server_get_client_user_id(server_t* server, u64 id)
     return server_ght_get(&server->user_ht, id);
 }
 
-client_t*
-server_accept_client(eworker_t* th)
+size_t
+server_get_clients_user_ids(server_t* server, const u32* ids, size_t n, 
+                            client_t** clients)
+{
+    return server_ght_get_batch(&server->user_ht, ids, n, (void**)clients);
+}
+
+static client_t*
+client_alloc(eworker_t* th)
 {
     client_t* client;
     server_t* server = th->server;
 
-    client = calloc(1, sizeof(client_t));
+    client = server_pool_alloc(eworker_pool(th, client), sizeof(client_t));
     client->addr.len = server->addr_len;
     client->addr.version = server->conf.addr_version;
     client->addr.addr_ptr = (struct sockaddr*)&client->addr.ipv4;
-    client->addr.sock = accept(server->sock, client->addr.addr_ptr, &client->addr.len);
-    if (client->addr.sock == -1)
-    {
-        error("accept: %s", ERRSTR);
-        goto err;
-    }
-    if (server_client_ssl_handsake(server, client) == -1)
+    client->ew = th;
+    client->refs = 1;
+    return client;
+}
+
+/* Accepted socket in client->addr.sock */
+static client_t*
+client_init(eworker_t* th, client_t* client)
+{
+    server_t* server = th->server;
+
+    pthread_mutex_init(&client->ssl_mutex, NULL);
+    if (server_client_ssl_init(server, client) == -1)
         goto err;
     server_get_client_info(client);
-    pthread_mutex_init(&client->ssl_mutex, NULL);
-    server_ght_insert(&server->client_ht, client->addr.sock, client);
-    if (server_new_event(server, client->addr.sock, client, 
-                         se_read_client, se_close_client) == NULL)
+    server_fdt_set_client(&server->fdt, client->addr.sock, client);
+
+    if (server->conf.idle_timeout && th->timers)
+    {
+        union timer_data data = {
+            .client = client
+        };
+        client->last_active = server_timer_wheel_now(th->timers);
+        client->idle_timer = server_addtimer(th, server->conf.idle_timeout, 0,
+                                             TIMER_CLIENT_IDLE, 
+                                             &data, sizeof(void*));
+    }
+
+    /*
+     * SSL handshake is done in the client's event callbacks,
+     * so a slow client won't block this worker.
+     * In reuseport mode the client stays in this worker's epoll.
+     */
+    if (server_new_client_event(th, client) == NULL)
         goto err;
 
     return client;
@@ -44,6 +73,47 @@ err:
     return NULL;
 }
 
+client_t*
+server_accept_client(eworker_t* th, i32 listen_fd)
+{
+    client_t* client;
+
+    client = client_alloc(th);
+    client->addr.sock = accept4(listen_fd, client->addr.addr_ptr, &client->addr.len, 
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client->addr.sock == -1)
+    {
+        /* Another worker already took it, or backlog is empty */
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            error("accept: %s\n", ERRSTR);
+        server_pool_free(eworker_pool(th, client), client);
+        return NULL;
+    }
+    return client_init(th, client);
+}
+
+client_t*
+server_new_client(eworker_t* th, i32 fd)
+{
+    client_t* client;
+
+    client = client_alloc(th);
+    client->addr.sock = fd;
+    /* io_uring accepted it without the address. */
+    if (getpeername(fd, client->addr.addr_ptr, &client->addr.len) == -1)
+        error("getpeername fd:%d: %s\n", fd, ERRSTR);
+    return client_init(th, client);
+}
+
+static void
+client_send_buf_free(client_send_buf_t* sbuf)
+{
+    free(sbuf->chunk);
+    if (sbuf->fd != -1)
+        close(sbuf->fd);
+    free(sbuf);
+}
+
 void 
 server_free_client(eworker_t* ew, client_t* client)
 {
@@ -51,7 +121,7 @@ server_free_client(eworker_t* ew, client_t* client)
 
     if (!client)
         return;
-    server_ght_del(&server->client_ht, client->addr.sock);
+    server_fdt_del_client(&server->fdt, client->addr.sock, client);
 
     info("Client (fd:%d, IP: %s:%s, host: %s) disconnected.\n", 
             client->addr.sock, client->addr.ip_str, client->addr.serv, client->addr.host);
@@ -60,59 +130,146 @@ server_free_client(eworker_t* ew, client_t* client)
         if (client->dbuser->user_id)
             debug("\tUser:%u %s '%s' logged out.\n", 
                 client->dbuser->user_id, client->dbuser->username, client->dbuser->displayname);
+        server_ght_del(&ew->server->user_ht, client->dbuser->user_id);
     }
 
+    /* 
+     * A flush watcher may be running in another worker right now,
+     * it finds ssl NULL under the lock and lets go of the client.
+     */
+    pthread_mutex_lock(&client->ssl_mutex);
     if (client->ssl)
     {
         if (client->err == CLIENT_ERR_NONE)
             SSL_shutdown(client->ssl);
         SSL_free(client->ssl);
+        client->ssl = NULL;
+    }
+    while (client->send.head)
+    {
+        client_send_buf_t* next = client->send.head->next;
+        client_send_buf_free(client->send.head);
+        client->send.head = next;
     }
+    if (client->send.tail)
+        server_stats_dec(server, send_pending);
+    client->send.tail = NULL;
+    client->send.watcher = NULL;
+    pthread_mutex_unlock(&client->ssl_mutex);
+
+    /* Hangs up the watcher's dup() of the socket too, if it's waiting. */
+    shutdown(client->addr.sock, SHUT_RDWR);
+
+    server_timer_cancel(client->idle_timer);
 
-    if (client->session && client->session->timerfd == 0 && ew->server->running)
+    if (client->session && client->session->timer == NULL && ew->server->running)
     {
         union timer_data data = {
             .session = client->session
         };
         // TODO: Make client session timer configurable
-        server_timer_t* timer = server_addtimer(ew, MINUTES(30), 
-                                                TIMER_ONCE, TIMER_CLIENT_SESSION, 
-                                                &data, sizeof(void*));
-        if (timer)
-            client->session->timerfd = timer->fd;
+        client->session->timer = server_addtimer(ew, SESSION_EXPIRE, 
+                                                 TIMER_ONCE, TIMER_CLIENT_SESSION, 
+                                                 &data, sizeof(void*));
     }
 
-    if (client->recv.data)
-        free(client->recv.data);
-    if (client->dbuser)
-    {
-        server_ght_del(&ew->server->user_ht, client->dbuser->user_id);
-        free(client->dbuser);
-    }
+    http_free(client->recv.http);
+    server_client_free_recv(ew, client);
+    free(client->dbuser);
+    client->dbuser = NULL;
     close(client->addr.sock);
 
+    server_client_unref(ew, client);
+}
+
+void
+server_client_unref(eworker_t* ew, client_t* client)
+{
+    if (__atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
     pthread_mutex_destroy(&client->ssl_mutex);
-    free(client);
+    server_pool_free(eworker_pool(ew, client), client);
+}
+
+void
+server_client_free_recv(eworker_t* ew, client_t* client)
+{
+    if (client->recv.in_pool)
+        server_pool_free(eworker_pool(ew, recv_page), client->recv.data);
+    else
+        free(client->recv.data);
+    client->recv.data = NULL;
+    client->recv.in_pool = false;
 }
 
 int 
-server_client_ssl_handsake(server_t* server, client_t* client)
+server_client_ssl_init(server_t* server, client_t* client)
 {
-    i32 ret;
+    BIO* rbio;
+    BIO* wbio;
+
     client->ssl = SSL_new(server->ssl_ctx);
     if (!client->ssl)
     {
         error("SSL_new() failed.\n");
         return -1;
     }
-    SSL_set_fd(client->ssl, client->addr.sock);
-    ret = SSL_accept(client->ssl);
-    if (ret == 1)
-        return 0;
-    server_set_client_err(client, CLIENT_ERR_SSL);
+
+    if (server_uring_op(client->ew->ring, URING_OP_RECV) == URING_OP_RECV)
+    {
+        /* 
+         * io_uring receives for us, server_client_feed() fills rbio.
+         * Writes still go to the socket, kTLS send works as usual.
+         */
+        rbio = BIO_new(BIO_s_mem());
+        wbio = BIO_new_socket(client->addr.sock, BIO_NOCLOSE);
+        if (!rbio || !wbio)
+        {
+            error("BIO_new() failed.\n");
+            BIO_free(rbio);
+            BIO_free(wbio);
+            return -1;
+        }
+        /* Empty is "try again", not EOF. */
+        BIO_set_mem_eof_return(rbio, -1);
+        SSL_set_bio(client->ssl, rbio, wbio);
+    }
+    else
+        SSL_set_fd(client->ssl, client->addr.sock);
+    SSL_set_accept_state(client->ssl);
+    client->state |= CLIENT_STATE_TLS_HANDSHAKE;
     return 0;
 }
 
+enum client_hs_status
+server_client_ssl_handsake(client_t* client)
+{
+    i32 ret;
+    i32 err;
+
+    ret = SSL_do_handshake(client->ssl);
+    if (ret == 1)
+    {
+        client->state &= ~CLIENT_STATE_TLS_HANDSHAKE;
+        return CLIENT_HS_DONE;
+    }
+
+    err = SSL_get_error(client->ssl, ret);
+    switch (err)
+    {
+        case SSL_ERROR_WANT_READ:
+            return CLIENT_HS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return CLIENT_HS_WANT_WRITE;
+        default:
+            verbose("SSL handshake fd:%d failed: %s\n", 
+                    client->addr.sock, ERR_error_string(ERR_get_error(), NULL));
+            server_set_client_err(client, CLIENT_ERR_SSL);
+            return CLIENT_HS_ERROR;
+    }
+}
+
 void 
 server_get_client_info(client_t* client)
 {
@@ -142,3 +299,282 @@ server_set_client_err(client_t* client, u16 err)
 {
     client->err = err;
 }
+
+static void
+server_client_send_failed(client_t* client)
+{
+    server_set_client_err(client, CLIENT_ERR_SSL);
+    /* Client's own event gets a hang up and frees it. */
+    shutdown(client->addr.sock, SHUT_RDWR);
+}
+
+void
+server_client_feed(client_t* client, const void* buf, size_t len)
+{
+    pthread_mutex_lock(&client->ssl_mutex);
+    if (client->ssl && BIO_write(SSL_get_rbio(client->ssl), buf, len) != (i32)len)
+    {
+        error("Client fd:%d BIO_write(%zu) failed.\n", client->addr.sock, len);
+        server_client_send_failed(client);
+    }
+    pthread_mutex_unlock(&client->ssl_mutex);
+}
+
+static void
+client_send_buf_append(client_t* client, client_send_buf_t* sbuf)
+{
+    if (client->send.tail)
+        client->send.tail->next = sbuf;
+    else
+    {
+        client->send.head = sbuf;
+        server_stats_inc(client->ew->server, send_pending);
+    }
+    client->send.tail = sbuf;
+    server_stats_inc(client->ew->server, send_queued);
+}
+
+static bool
+client_send_watch(client_t* client)
+{
+    if (client->send.watcher == NULL)
+    {
+        /* Dropped by se_close_flush(), client outlives its watcher. */
+        __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+        client->send.watcher = server_new_flush_event(client->ew, client);
+        if (client->send.watcher == NULL)
+        {
+            __atomic_sub_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+            server_client_send_failed(client);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+server_client_queue(client_t* client, const void* buf, size_t len)
+{
+    client_send_buf_t* sbuf;
+    server_t* server = client->ew->server;
+
+    /* 
+     * First buffer is always taken, so a single large response 
+     * (e.g. a file) can still go out to a slow client.
+     */
+    if (client->send.head && 
+        client->send.bytes + len > server->conf.send_queue_max)
+    {
+        warn("Client fd:%d send queue full (%zu bytes), disconnecting.\n",
+             client->addr.sock, client->send.bytes);
+        server_stats_inc(server, evicted_clients);
+        server_client_send_failed(client);
+        return false;
+    }
+
+    sbuf = malloc(sizeof(client_send_buf_t) + len);
+    if (!sbuf)
+    {
+        error("Client fd:%d send queue malloc(%zu) failed.\n", 
+              client->addr.sock, len);
+        return false;
+    }
+    sbuf->next = NULL;
+    sbuf->len = len;
+    sbuf->fd = -1;
+    sbuf->chunk = NULL;
+    sbuf->chunk_len = 0;
+    sbuf->pos = 0;
+    memcpy(sbuf->data, buf, len);
+
+    client_send_buf_append(client, sbuf);
+    client->send.bytes += len;
+
+    if (!client->send.slow && client->send.bytes >= server->conf.send_queue_high)
+    {
+        verbose("Client fd:%d is slow, %zu bytes pending.\n",
+                client->addr.sock, client->send.bytes);
+        client->send.slow = true;
+        server_stats_inc(server, slow_clients);
+    }
+
+    return client_send_watch(client);
+}
+
+/* 
+ * Sending counts as activity, a long download to a slow client only
+ * reads once. May run on another worker (flush watcher).
+ */
+static void
+client_sent(client_t* client)
+{
+    if (client->idle_timer)
+        __atomic_store_n(&client->last_active, 
+                         server_timer_wheel_now(client->ew->timers), __ATOMIC_RELAXED);
+}
+
+/* 
+ * Next chunk of a file from `pos`. Read, not mmap(): a file truncated
+ * meanwhile is an error here instead of a SIGBUS.
+ */
+static bool
+client_read_chunk(client_t* client, client_send_buf_t* sbuf)
+{
+    size_t size = sbuf->len - sbuf->pos;
+    ssize_t ret;
+
+    if (size > CLIENT_FILE_CHUNK)
+        size = CLIENT_FILE_CHUNK;
+
+    do
+        ret = pread(sbuf->fd, sbuf->chunk, size, sbuf->pos);
+    while (ret == -1 && errno == EINTR);
+
+    if (ret <= 0)
+    {
+        error("Send file fd:%d read: %s\n", client->addr.sock, 
+              (ret == -1) ? ERRSTR : "file truncated");
+        return false;
+    }
+    sbuf->chunk_len = ret;
+    return true;
+}
+
+/* Send what the socket takes of a file buffer. */
+static enum client_flush_status
+client_write_file(client_t* client, client_send_buf_t* sbuf)
+{
+    ossl_ssize_t ret;
+    i32 err;
+
+    while (sbuf->pos < sbuf->len)
+    {
+#ifdef SSL_OP_ENABLE_KTLS
+        if (sbuf->chunk == NULL)
+            ret = SSL_sendfile(client->ssl, sbuf->fd, sbuf->pos, sbuf->len - sbuf->pos, 0);
+        else
+#endif
+        {
+            /* Same chunk on retry, `pos` only moves on success. */
+            if (sbuf->chunk_len == 0 && client_read_chunk(client, sbuf) == false)
+                return CLIENT_FLUSH_ERROR;
+            ret = SSL_write(client->ssl, sbuf->chunk, sbuf->chunk_len);
+        }
+
+        if (ret <= 0)
+        {
+            err = SSL_get_error(client->ssl, ret);
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+                return CLIENT_FLUSH_AGAIN;
+
+            error("SSL send file fd:%d failed: %s\n", 
+                  client->addr.sock, ERR_error_string(ERR_get_error(), NULL));
+            return CLIENT_FLUSH_ERROR;
+        }
+        sbuf->pos += ret;
+        sbuf->chunk_len = 0;
+        client_sent(client);
+    }
+    return CLIENT_FLUSH_DONE;
+}
+
+bool
+server_client_send_file(client_t* client, i32 fd, size_t offset, size_t size)
+{
+    client_send_buf_t* sbuf;
+    enum client_flush_status ret = CLIENT_FLUSH_AGAIN;
+
+    sbuf = calloc(1, sizeof(client_send_buf_t));
+    sbuf->fd = fd;
+    sbuf->pos = offset;
+    sbuf->len = offset + size;
+
+    /* Without kTLS, a chunk at a time through SSL_write(). */
+    if (!BIO_get_ktls_send(SSL_get_wbio(client->ssl)) && size)
+    {
+        sbuf->chunk = malloc((size < CLIENT_FILE_CHUNK) ? size : CLIENT_FILE_CHUNK);
+        if (sbuf->chunk == NULL)
+        {
+            error("Send file fd:%d malloc failed.\n", client->addr.sock);
+            client_send_buf_free(sbuf);
+            return false;
+        }
+        posix_fadvise(fd, offset, size, POSIX_FADV_SEQUENTIAL);
+    }
+
+    /* Directly only if nothing is queued, to keep the order. */
+    if (client->send.head == NULL)
+        ret = client_write_file(client, sbuf);
+
+    if (ret == CLIENT_FLUSH_DONE)
+    {
+        client_send_buf_free(sbuf);
+        return true;
+    }
+    else if (ret == CLIENT_FLUSH_ERROR)
+    {
+        client_send_buf_free(sbuf);
+        server_client_send_failed(client);
+        return false;
+    }
+
+    client_send_buf_append(client, sbuf);
+    return client_send_watch(client);
+}
+
+enum client_flush_status
+server_client_flush(client_t* client)
+{
+    client_send_buf_t* sbuf;
+    i32 ret;
+    i32 err;
+
+    if (client->err == CLIENT_ERR_SSL)
+        return CLIENT_FLUSH_ERROR;
+
+    while ((sbuf = client->send.head))
+    {
+        if (sbuf->fd != -1)
+        {
+            ret = client_write_file(client, sbuf);
+            if (ret == CLIENT_FLUSH_AGAIN)
+                return CLIENT_FLUSH_AGAIN;
+            else if (ret == CLIENT_FLUSH_ERROR)
+            {
+                server_client_send_failed(client);
+                return CLIENT_FLUSH_ERROR;
+            }
+            client->send.head = sbuf->next;
+            client_send_buf_free(sbuf);
+            continue;
+        }
+
+        /* Retry with the same length, as SSL_write() requires. */
+        ret = SSL_write(client->ssl, sbuf->data, sbuf->len);
+        if (ret <= 0)
+        {
+            err = SSL_get_error(client->ssl, ret);
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+                return CLIENT_FLUSH_AGAIN;
+
+            error("SSL flush fd:%d failed: %s\n", 
+                  client->addr.sock, ERR_error_string(ERR_get_error(), NULL));
+            server_client_send_failed(client);
+            return CLIENT_FLUSH_ERROR;
+        }
+
+        client->send.head = sbuf->next;
+        client->send.bytes -= sbuf->len;
+        free(sbuf);
+        client_sent(client);
+
+        if (client->send.slow && 
+            client->send.bytes <= client->ew->server->conf.send_queue_low)
+            client->send.slow = false;
+    }
+    if (client->send.tail)
+        server_stats_dec(client->ew->server, send_pending);
+    client->send.tail = NULL;
+
+    return CLIENT_FLUSH_DONE;
+}
@@ -5,32 +5,39 @@
 #include "server_eworker.h"
 #include "chat/db_pipeline.h"
 #include "server_tm.h"
+#include "server_uring.h"
 
 i32
-server_event_add(const server_t* server, server_event_t* se)
+server_event_add(server_event_t* se)
 {
     i32 ret;
 
     if (se->listen_events == 0)
         se->listen_events = DEFAULT_EPEV;
 
+    if (se->ring)
+        return server_uring_add(se->ring, se);
+
     struct epoll_event ev = {
         .data.ptr = se,
         .events = se->listen_events
     };
 
-    ret = epoll_ctl(server->epfd, EPOLL_CTL_ADD, se->fd, &ev);
+    ret = epoll_ctl(se->epfd, EPOLL_CTL_ADD, se->fd, &ev);
     if (ret == -1)
         error("server_event_add on fd: %d\n", se->fd);
     return ret;
 }
 
 i32
-server_event_remove(const server_t* server, const server_event_t* se)
+server_event_remove(const server_event_t* se)
 {
     i32 ret;
 
-    ret = epoll_ctl(server->epfd, EPOLL_CTL_DEL, se->fd, NULL);
+    if (se->ring)
+        return server_uring_remove(se->ring, se);
+
+    ret = epoll_ctl(se->epfd, EPOLL_CTL_DEL, se->fd, NULL);
     if (ret == -1)
         error("server_event_remove on fd: %d\n", se->fd);
 
@@ -38,63 +45,152 @@ server_event_remove(const server_t* server, const server_event_t* se)
 }
 
 i32 
-server_event_rearm(const server_t* server, const server_event_t* se)
+server_event_rearm(server_event_t* se)
 {
     i32 ret;
 
+    /* io_uring polls are one-shot, re-arm is a new poll. */
+    if (se->ring)
+        return server_uring_rearm(se->ring, se);
+
     struct epoll_event ev = {
         .data.ptr = (void*)se,
         .events = se->listen_events
     };
 
-    ret = epoll_ctl(server->epfd, EPOLL_CTL_MOD, se->fd, &ev);
+    ret = epoll_ctl(se->epfd, EPOLL_CTL_MOD, se->fd, &ev);
     if (ret == -1)
         error("server_event_rearm() on fd: %d\n", se->fd);
 
     return ret;
 }
 
+void
+server_event_listen(server_event_t* se, u32 events)
+{
+    se->listen_events = (se->listen_events & SE_MODE_EPEV) | events;
+}
+
 enum se_status
-se_accept_conn(eworker_t* th, UNUSED server_event_t* ev)
+se_read_db(eworker_t* ew, UNUSED server_event_t* ev)
 {
-    client_t* client;
+    server_db_t* db = &ew->db;
 
-    if ((client = server_accept_client(th)) == NULL)
+    if (PQconsumeInput(db->conn) == 0)
+    {
+        fatal("%s: database connection: %s", ew->name, PQerrorMessage(db->conn));
         return SE_ERROR;
+    }
+    db_process_results(ew);
+    return SE_OK;
+}
 
-    info("Client (fd:%d, IP: %s:%s) connected.\n", 
-        client->addr.sock, client->addr.ip_str, client->addr.serv);
+enum se_status
+se_write_db(eworker_t* ew, UNUSED server_event_t* ev)
+{
+    /* Worker loop drops EPOLLOUT once everything is flushed. */
+    if (PQflush(ew->db.conn) == -1)
+    {
+        fatal("%s: database flush: %s", ew->name, PQerrorMessage(ew->db.conn));
+        return SE_ERROR;
+    }
+    return SE_OK;
+}
 
+enum se_status
+se_close_db(eworker_t* ew, UNUSED server_event_t* ev)
+{
+    /* Socket belongs to libpq, closed by PQfinish(). */
+    ew->db_se = NULL;
     return SE_OK;
 }
 
 enum se_status
-se_read_client(eworker_t* th, server_event_t* ev)
+se_accept_conn(eworker_t* th, server_event_t* ev)
+{
+    client_t* client;
+
+    /* io_uring multishot accept, the socket is already accepted. */
+    if (ev->uring_op == URING_OP_ACCEPT)
+    {
+        if ((client = server_new_client(th, ev->uring_res)))
+            info("Client (fd:%d, IP: %s:%s) connected.\n", 
+                client->addr.sock, client->addr.ip_str, client->addr.serv);
+        return (th->server->draining) ? SE_CLOSE : SE_OK;
+    }
+
+    /* New server owns the listening socket now, drop our event. */
+    if (th->server->draining)
+        return SE_CLOSE;
+
+    /* 
+     * Listening socket is non-blocking, accept until the backlog is
+     * empty (or batch limit) instead of one connection per event.
+     */
+    for (i32 i = 0; i < CLIENT_ACCEPT_BATCH; i++)
+    {
+        if ((client = server_accept_client(th, ev->fd)) == NULL)
+            break;
+
+        info("Client (fd:%d, IP: %s:%s) connected.\n", 
+            client->addr.sock, client->addr.ip_str, client->addr.serv);
+    }
+
+    /* Never close the listening socket because of a failed accept. */
+    return SE_OK;
+}
+
+static enum se_status
+se_client_handshake(server_event_t* ev)
+{
+    client_t* client = ev->data;
+
+    switch (server_client_ssl_handsake(client))
+    {
+        case CLIENT_HS_DONE:
+            verbose("Client fd:%d SSL handshake done.\n", client->addr.sock);
+            server_event_listen(ev, DEFAULT_EPEV);
+            return SE_OK;
+        case CLIENT_HS_WANT_READ:
+            server_event_listen(ev, DEFAULT_EPEV);
+            return SE_OK;
+        case CLIENT_HS_WANT_WRITE:
+            server_event_listen(ev, WRITE_EPEV);
+            return SE_OK;
+        case CLIENT_HS_ERROR:
+        default:
+            return SE_CLOSE;
+    }
+}
+
+static enum se_status
+se_client_recv(eworker_t* th, client_t* client)
 {
     ssize_t bytes_recv;
     u8* buf;
     size_t buf_size;
     size_t offset = 0;
     http_t* http;
-    client_t* client;
     enum client_recv_status recv_status = RECV_OK;
 
-    client = ev->data;
     http = client->recv.http;
 
-    db_pipeline_set_ctx(&th->db, client);
-
     if (http)
     {
-        buf = (u8*)http->body + http->buf.total_recv;
+        /* Upload chunk at a time, written out before the next read. */
+        buf = http->upload->chunk;
         buf_size = http->body_len - http->buf.total_recv;
+        if (buf_size > HTTP_UPLOAD_CHUNK)
+            buf_size = HTTP_UPLOAD_CHUNK;
     }
     else
     {
         if (!client->recv.data)
         {
-            client->recv.data = calloc(1, CLIENT_RECV_PAGE);
+            client->recv.data = server_pool_alloc(eworker_pool(th, recv_page), 
+                                                  CLIENT_RECV_PAGE);
             client->recv.data_size = CLIENT_RECV_PAGE - 1;
+            client->recv.in_pool = true;
         }
         else
             offset = client->recv.offset;
@@ -103,30 +199,23 @@ se_read_client(eworker_t* th, server_event_t* ev)
     }
 
     bytes_recv = server_recv(client, buf + offset, buf_size - offset);
-    if (bytes_recv <= 0)
+    if (bytes_recv == -1 && errno == EAGAIN)
+        return SE_AGAIN;
+    else if (bytes_recv <= 0)
         return SE_CLOSE;
     else if (http)
-    {
-        http->buf.total_recv += bytes_recv;
-        verbose("HTTP recv: %zu/%zu\n", http->buf.total_recv, http->body_len);
-        if ((size_t)bytes_recv >= buf_size)
-        {
-            server_handle_http(th, client, client->recv.http);
-            client->recv.http = NULL;
-        }
-    }
+        recv_status = server_http_recv_body(th, client, bytes_recv);
     else
     {
         if (client->state & CLIENT_STATE_WEBSOCKET) 
             recv_status = server_ws_parse(th, client, buf, bytes_recv + offset); 
         else
-            recv_status = server_http_parse(th, client, buf, bytes_recv);
+            recv_status = server_http_parse(th, client, buf, bytes_recv + offset);
     }
 
     if (recv_status != RECV_DISCONNECT && !client->recv.busy)
     {
-        free(client->recv.data);
-        client->recv.data = NULL;
+        server_client_free_recv(th, client);
         client->recv.data_size = 0;
         client->recv.offset = 0;
     }
@@ -137,6 +226,66 @@ se_read_client(eworker_t* th, server_event_t* ev)
     return SE_OK;
 }
 
+enum se_status
+se_read_client(eworker_t* th, server_event_t* ev)
+{
+    enum se_status ret;
+    client_t* client = ev->data;
+
+    if (client->state & CLIENT_STATE_TLS_HANDSHAKE)
+    {
+        ret = se_client_handshake(ev);
+        /* 
+         * Application data may have come with the last handshake message,
+         * if not server_recv() will just return EAGAIN.
+         */
+        if (ret != SE_OK || client->state & CLIENT_STATE_TLS_HANDSHAKE)
+            return ret;
+    }
+
+    if (client->idle_timer)
+        client->last_active = server_timer_wheel_now(client->ew->timers);
+
+    db_pipeline_set_ctx(&th->db, client);
+
+    /*
+     * Read until EAGAIN. Edge-triggered events only fire again on new data,
+     * and records already buffered inside SSL never wake up epoll.
+     */
+    for (i32 i = 0; i < CLIENT_READ_BUDGET; i++)
+    {
+        ret = se_client_recv(th, client);
+        if (ret == SE_AGAIN)
+            return SE_OK;
+        else if (ret != SE_OK)
+            return ret;
+    }
+
+    /* 
+     * Budget used up with data left, give other events a turn.
+     * Edge-triggered won't fire again by itself, re-arm to get a new edge.
+     * io_uring: the rest may be received already, nothing would wake us.
+     */
+    if (ev->ring)
+        server_uring_ready(ev->ring, ev);
+    else if (ev->listen_events & EPOLLET)
+        server_event_rearm(ev);
+
+    return SE_OK;
+}
+
+enum se_status
+se_write_client(UNUSED eworker_t* th, server_event_t* ev)
+{
+    client_t* client = ev->data;
+
+    if (client->state & CLIENT_STATE_TLS_HANDSHAKE)
+        return se_client_handshake(ev);
+
+    server_event_listen(ev, DEFAULT_EPEV);
+    return SE_OK;
+}
+
 enum se_status
 se_close_client(eworker_t* th, server_event_t* ev)
 {
@@ -151,14 +300,70 @@ se_close_client(eworker_t* th, server_event_t* ev)
     return SE_OK;
 }
 
-server_event_t* 
-server_new_event(server_t* server, 
-                 i32 fd, 
-                 void* data, 
-                 se_read_callback_t read_callback, 
-                 se_close_callback_t close_callback)
+void
+se_recv_client(server_event_t* ev, const u8* buf, size_t len)
+{
+    server_client_feed(ev->data, buf, len);
+}
+
+enum se_status
+se_flush_client(UNUSED eworker_t* th, server_event_t* ev)
+{
+    client_t* client = ev->data;
+    enum client_flush_status ret;
+
+    pthread_mutex_lock(&client->ssl_mutex);
+    /* ssl is NULL once server_free_client() ran, nothing left to send. */
+    ret = (client->ssl) ? server_client_flush(client) : CLIENT_FLUSH_ERROR;
+    if (ret == CLIENT_FLUSH_DONE && client->state & CLIENT_STATE_CLOSING)
+    {
+        /* Last response is out, client's own event gets the hang up. */
+        shutdown(client->addr.sock, SHUT_RDWR);
+    }
+    if (ret != CLIENT_FLUSH_AGAIN && client->send.watcher == ev)
+    {
+        /* 
+         * Detach while locked, next server_send() that queues 
+         * makes a new watcher instead of relying on this one.
+         */
+        client->send.watcher = NULL;
+    }
+    pthread_mutex_unlock(&client->ssl_mutex);
+
+    return (ret == CLIENT_FLUSH_AGAIN) ? SE_OK : SE_CLOSE;
+}
+
+enum se_status
+se_close_flush(eworker_t* th, server_event_t* ev)
+{
+    client_t* client = ev->data;
+
+    /* Still attached, e.g. EPOLLERR on the socket. */
+    pthread_mutex_lock(&client->ssl_mutex);
+    if (client->send.watcher == ev)
+        client->send.watcher = NULL;
+    pthread_mutex_unlock(&client->ssl_mutex);
+
+    if (close(ev->fd) == -1)
+        error("close flush fd %d: %s\n", ev->fd, ERRSTR);
+    /* May be the last reference, if the client is gone already. */
+    server_client_unref(th, client);
+    return SE_OK;
+}
+
+static server_event_t*
+se_new(eworker_t* ew, 
+       i32 epfd,
+       i32 fd, 
+       void* data, 
+       se_read_callback_t read_callback, 
+       se_write_callback_t write_callback,
+       se_close_callback_t close_callback,
+       u32 listen_events,
+       enum uring_op uring_op)
 {
     server_event_t* se;
+    server_t* server = ew->server;
 
     if (!server || !read_callback || (data && !close_callback))
     {
@@ -167,31 +372,101 @@ server_new_event(server_t* server,
         return NULL;
     }
     
-    se = calloc(1, sizeof(server_event_t));
+    se = server_pool_alloc(eworker_pool(ew, event), sizeof(server_event_t));
     se->fd = fd;
+    se->epfd = epfd;
+    se->ring = ew->ring;
     se->data = data;
     se->read = read_callback;
+    se->write = write_callback;
     se->close = close_callback;
-    se->listen_events = DEFAULT_EPEV;
+    se->listen_events = listen_events;
+    se->uring_op = server_uring_op(ew->ring, uring_op);
+    if (se->uring_op == URING_OP_RECV)
+        se->recv = se_recv_client;
 
-    if (server_ght_insert(&server->event_ht, fd, se) == false)
+    if (server_fdt_set_event(&server->fdt, fd, se) == false)
     {
         error("new_event(): Failed to insert.\n");
         goto err;
     }
-    if (server_event_add(server, se) == -1)
+    /* New generation for this fd, tells stale completions apart. */
+    se->uring_id = server_fdt_gen(&server->fdt, fd);
+    if (server_event_add(se) == -1)
     {
         error("ep_addfd %d failed\n", fd);
         goto err;
     }
     return se;
 err:
-    server_event_remove(server, se);
-    server_ght_del(&server->event_ht, fd);
-    free(se);
+    server_event_remove(se);
+    server_fdt_del_event(&server->fdt, fd, se);
+    server_pool_free(eworker_pool(ew, event), se);
     return NULL;
 }
 
+server_event_t* 
+server_new_event(eworker_t* ew, 
+                 i32 fd, 
+                 void* data, 
+                 se_read_callback_t read_callback, 
+                 se_close_callback_t close_callback)
+{
+    return se_new(ew, ew->epfd, fd, data, read_callback, NULL, close_callback, 
+                  DEFAULT_EPEV | ew->epev_mode, URING_OP_POLL);
+}
+
+server_event_t* 
+server_new_accept_event(eworker_t* ew, i32 listen_fd)
+{
+    return se_new(ew, ew->epfd, listen_fd, NULL, se_accept_conn, NULL, NULL,
+                  DEFAULT_EPEV | ew->epev_mode, URING_OP_ACCEPT);
+}
+
+server_event_t* 
+server_new_client_event(eworker_t* ew, client_t* client)
+{
+    return se_new(ew, ew->epfd, client->addr.sock, client, 
+                  se_read_client, se_write_client, se_close_client,
+                  DEFAULT_EPEV | ew->epev_mode | ew->epev_client, URING_OP_RECV);
+}
+
+server_event_t*
+server_new_flush_event(eworker_t* ew, client_t* client)
+{
+    server_event_t* se;
+    i32 fd;
+
+    /* 
+     * Own fd so it's a separate epoll registration from the client's
+     * event, which may be busy in another worker right now.
+     */
+    if ((fd = fcntl(client->addr.sock, F_DUPFD_CLOEXEC, 0)) == -1)
+    {
+        error("dup client fd %d: %s\n", client->addr.sock, ERRSTR);
+        return NULL;
+    }
+
+    se = se_new(ew, ew->epfd, fd, client, se_flush_client, se_flush_client, se_close_flush,
+                EPOLLOUT | EPOLLONESHOT, URING_OP_POLL);
+    if (se == NULL)
+        close(fd);
+    return se;
+}
+
+server_event_t*
+server_new_db_event(eworker_t* ew)
+{
+    /* 
+     * Shared epoll: any worker could get it, but a PGconn is only
+     * used by its own worker. Goes in the worker's private waitfd.
+     */
+    const i32 epfd = (ew->waitfd != -1) ? ew->waitfd : ew->epfd;
+
+    return se_new(ew, epfd, ew->db.fd, ew, se_read_db, se_write_db, se_close_db,
+                  DEFAULT_EPEV | ((ew->ring) ? EPOLLONESHOT : 0), URING_OP_POLL);
+}
+
 void 
 server_del_event(eworker_t* th, server_event_t* se)
 {
@@ -204,31 +479,30 @@ server_del_event(eworker_t* th, server_event_t* se)
         return;
     }
 
-    server_event_remove(server, se);
+    server_event_remove(se);
+    /* Before close, once closed the fd number can be reused. */
+    server_fdt_del_event(&server->fdt, se->fd, se);
     if (se->close)
         se->close(th, se);
     else
         if (close(se->fd) == -1)
             error("del_event: close(%d): %s\n", se->fd, ERRSTR);
 
-    if (server->running)
-        server_ght_del(&server->event_ht, se->fd);
-
-    free(se);
+    server_pool_free(eworker_pool(th, event), se);
 }
 
 server_event_t* 
 server_get_event(server_t* server, i32 fd)
 {
-    return server_ght_get(&server->event_ht, fd);
+    return server_fdt_get_event(&server->fdt, fd);
 }
 
 void 
 server_process_event(eworker_t* ew, server_event_t* se)
 {
     enum se_status ret;
-    server_t* server = ew->server;
     const u32 ev = se->ep_events;
+    const u32 listen_events = se->listen_events;
     const i32 fd = se->fd;
 
     if (ev & EPOLLERR)
@@ -241,13 +515,18 @@ server_process_event(eworker_t* ew, server_event_t* se)
         verbose("fd: %d hang up.\n", fd);
         server_del_event(ew, se);
     }
-    else if (ev & EPOLLIN)
+    else if (ev & (EPOLLIN | EPOLLOUT))
     {
-        ret = se->read(ew, se);
+        ret = SE_OK;
+        if (ev & EPOLLOUT && se->write)
+            ret = se->write(ew, se);
+        if (ret == SE_OK && ev & EPOLLIN)
+            ret = se->read(ew, se);
         if (ret == SE_CLOSE || ret == SE_ERROR)
             server_del_event(ew, se);
-        else if (se->listen_events & EPOLLONESHOT)
-            server_event_rearm(server, se);
+        else if (se->listen_events & EPOLLONESHOT || 
+                 se->listen_events != listen_events)
+            server_event_rearm(se);
     }
     else
         warn("Not handled fd: %d, ev: 0x%x\n", fd, ev);
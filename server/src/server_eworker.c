@@ -5,12 +5,15 @@
 #include "server_events.h"
 #include "server_tm.h"
 #include "server.h"
+#include "server_uring.h"
 #include <libpq-fe.h>
-#include <poll.h>
+
+__thread eworker_t* eworker_self;
 
 static void*
 eworker_main(void* arg)
 {
+    eworker_self = arg;
     if (server_eworker_init(arg) == false)
         return NULL;
     server_eworker_async_run(arg);
@@ -25,19 +28,30 @@ eworker_prep_event(eworker_t* ew, server_event_t* se)
     db_pipeline_current_done(&ew->db);
 }
 
+static void
+eworker_wait_for_uring(eworker_t* ew)
+{
+    server_event_t* se;
+    i32 ncqes;
+
+    ncqes = server_uring_wait(ew->ring, ew->uring_cqes, EWORKER_MAX_EVENTS, true);
+    if (ncqes == -1)
+        return;
+
+    for (i32 i = 0; i < ncqes; i++)
+        if ((se = server_uring_event(ew->ring, ew->server, ew->uring_cqes + i)))
+            eworker_prep_event(ew, se);
+}
+
 static void 
-eworker_wait_for_events(eworker_t* ew)
+eworker_epoll_wait(eworker_t* ew, i32 epfd, i32 timeout)
 {
-    const server_t* server = ew->server;
     const struct epoll_event* event;
     server_event_t* se;
+    bool shared_ready = false;
     i32 nfds;
-    i32 timeout;
-
-    /* Block if pipeline is empty, else return immediately. */
-    timeout = (ew->db.queue.count == 0) ? -1 : 0;
 
-    nfds = epoll_wait(server->epfd, ew->ep_events, EWORKER_MAX_EVENTS, timeout);
+    nfds = epoll_wait(epfd, ew->ep_events, EWORKER_MAX_EVENTS, timeout);
     if (nfds == -1)
     {
         error("%s: epoll_wait: %s",
@@ -49,10 +63,74 @@ eworker_wait_for_events(eworker_t* ew)
     {
         event = ew->ep_events + i;
         se = event->data.ptr;
+        /* waitfd: NULL is the shared epoll */
+        if (se == NULL)
+        {
+            shared_ready = true;
+            continue;
+        }
         se->ep_events = event->events;
 
         eworker_prep_event(ew, se);
     }
+
+    if (shared_ready)
+        eworker_epoll_wait(ew, ew->epfd, 0);
+}
+
+static void 
+eworker_wait_for_events(eworker_t* ew)
+{
+    if (ew->ring)
+    {
+        eworker_wait_for_uring(ew);
+        return;
+    }
+
+    /* 
+     * Shared epoll: with queries in flight, sleep on waitfd so DB results
+     * wake us too. Otherwise straight on the shared epoll, so an event
+     * only wakes one worker.
+     */
+    if (ew->waitfd != -1 && ew->db_se && ew->db.queue.count)
+        eworker_epoll_wait(ew, ew->waitfd, -1);
+    else
+        eworker_epoll_wait(ew, ew->epfd, -1);
+}
+
+/* Before sleeping: send buffered queries and pick up buffered results. */
+static void
+eworker_db_prepare(eworker_t* ew)
+{
+    server_event_t* se = ew->db_se;
+    u32 events = DEFAULT_EPEV;
+    i32 ret;
+
+    if (se == NULL)
+        return;
+
+    /* libpq may read results while sending, the socket won't tell us. */
+    if (ew->db.queue.count)
+        db_process_results(ew);
+
+    if ((ret = PQflush(ew->db.conn)) == 1)
+        events |= EPOLLOUT;
+    else if (ret == -1)
+        error("%s: database flush: %s", ew->name, PQerrorMessage(ew->db.conn));
+
+    if ((se->listen_events & ~SE_MODE_EPEV) == events)
+        return;
+    server_event_listen(se, events);
+
+    if (se->ring == NULL)
+        server_event_rearm(se);
+    else if (events & EPOLLOUT)
+    {
+        /* Pending poll doesn't wait for POLLOUT, replace it. */
+        server_event_remove(se);
+        server_event_add(se);
+    }
+    /* else: dropping POLLOUT takes effect on the next re-arm. */
 }
 
 bool 
@@ -60,6 +138,15 @@ server_create_eworker(server_t* server, eworker_t* ew, size_t i)
 {
     ew->db.cmd = &server->db_commands;
     ew->server = server;
+    server_pools_init(&ew->pools);
+    ew->db.cmd_pool = &ew->pools.dbcmd;
+
+    if (server_init_eworker_epoll(server, ew, i) == false)
+        return false;
+    if (server_timer_wheel_init(ew) == false)
+        return false;
+    if (server_mq_init(ew) == false)
+        return false;
 
     if (pthread_create(&ew->pth, NULL, eworker_main, ew) != 0)
     {
@@ -75,12 +162,15 @@ bool
 server_eworker_init(eworker_t* ew)
 {
     ew->tid = gettid();
+    if (ew->ring)
+        server_uring_set_owner(ew->ring);
     if (!server_db_open(&ew->db, ew->server->conf.database, 
                         DB_PIPELINE | DB_NONBLOCK))
         return false;
 
     PQpipelineSync(ew->db.conn);
-    db_process_results(ew);
+    if ((ew->db_se = server_new_db_event(ew)) == NULL)
+        return false;
 
     debug("%s up & running!\n", ew->name);
     return true;
@@ -91,28 +181,11 @@ server_eworker_async_run(eworker_t* ew)
 {
     server_t* server = ew->server;
     server_tm_t* tm = &server->tm;
-    // server_db_t* db = &ew->db;
-    struct pollfd pfd = {
-        .fd = ew->db.fd,
-        .events = POLLIN
-    };
-    i32 ret;
 
+    /* Blocks until a client event or a DB result, no busy polling. */
     while ((tm->state & TM_STATE_SHUTDOWN) == 0)
     {
-        if ((ret = poll(&pfd, 1, 0)) == -1) 
-        {
-            error("poll: %s\n", ERRSTR);
-            tm->state |= TM_STATE_SHUTDOWN;
-            break;
-        }
-
-        // debug("tid: %d\n\tret: %d\n\tdb->queue: %d\n", 
-        //       ew->tid, ret, db->queue.count);
-
-        if (ret > 0)
-            db_process_results(ew);
-
+        eworker_db_prepare(ew);
         eworker_wait_for_events(ew);
     }
 }
@@ -120,6 +193,8 @@ server_eworker_async_run(eworker_t* ew)
 void 
 server_eworker_cleanup(eworker_t* ew)
 {
+    if (ew->db_se)
+        server_del_event(ew, ew->db_se);
     server_db_close(&ew->db);
     debug("%s shutdown.\n", ew->name);
 }
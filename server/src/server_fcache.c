@@ -0,0 +1,646 @@
+#include "server_fcache.h"
+#include "server.h"
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#define FCACHE_WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE |\
+                           IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |\
+                           IN_DELETE_SELF | IN_MOVE_SELF)
+/* Once per file, but on a worker: 10 and 11 cost far more for little. */
+#define FCACHE_BROTLI_QUALITY 9
+
+/* return: compressed `body` after FCACHE_HEAD_MAX free bytes, NULL on failure. */
+typedef u8* (*fcache_compress_t)(const u8* body, size_t len, size_t* out_len);
+
+static const char* const fcache_enc_name[HTTP_ENC_COUNT] = {
+    [HTTP_ENC_IDENTITY] = NULL,
+    [HTTP_ENC_GZIP]     = "gzip",
+    [HTTP_ENC_BR]       = "br",
+};
+
+/* Each encoding is its own representation, with its own ETag. */
+static const char* const fcache_etag_suffix[HTTP_ENC_COUNT] = {
+    [HTTP_ENC_IDENTITY] = "",
+    [HTTP_ENC_GZIP]     = "-gz",
+    [HTTP_ENC_BR]       = "-br",
+};
+
+static size_t
+fcache_file_size(const fcache_file_t* file)
+{
+    size_t size = 0;
+
+    for (size_t i = 0; i < HTTP_ENC_COUNT; i++)
+        if (file->resp[i].data)
+            size += file->resp[i].head_len + file->resp[i].body_len;
+    return size;
+}
+
+static void
+fcache_file_free(fcache_file_t* file)
+{
+    for (size_t i = 0; i < HTTP_ENC_COUNT; i++)
+        free(file->resp[i].data);
+    free(file->path);
+    free(file);
+}
+
+void
+server_fcache_unref(fcache_file_t* file)
+{
+    if (file && __atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        fcache_file_free(file);
+}
+
+/* Behind the hand, the last one it gets to. Under fc->mutex. */
+static void
+fcache_clock_add(server_fcache_t* fc, fcache_file_t* file)
+{
+    if (fc->hand == NULL)
+    {
+        file->clock_next = file;
+        file->clock_prev = file;
+        fc->hand = file;
+    }
+    else
+    {
+        file->clock_next = fc->hand;
+        file->clock_prev = fc->hand->clock_prev;
+        file->clock_prev->clock_next = file;
+        fc->hand->clock_prev = file;
+    }
+    fc->bytes += file->size;
+}
+
+/* 
+ * GHT free callback, the cache's own reference. 
+ * Every del/clear of fc->files is under fc->mutex.
+ */
+static void
+fcache_file_drop(void* data)
+{
+    fcache_file_t* file = data;
+    server_fcache_t* fc = file->fc;
+
+    if (file->clock_next == file)
+        fc->hand = NULL;
+    else
+    {
+        if (fc->hand == file)
+            fc->hand = file->clock_next;
+        file->clock_prev->clock_next = file->clock_next;
+        file->clock_next->clock_prev = file->clock_prev;
+    }
+    fc->bytes -= file->size;
+    server_fcache_unref(file);
+}
+
+/* Make room for `size` bytes, under fc->mutex. At most two laps. */
+static void
+fcache_evict(server_fcache_t* fc, size_t size)
+{
+    fcache_file_t* victim;
+
+    while (fc->hand && fc->bytes + size > fc->max_bytes)
+    {
+        victim = fc->hand;
+        fc->hand = victim->clock_next;
+        if (__atomic_exchange_n(&victim->used, false, __ATOMIC_RELAXED))
+            continue;
+
+        debug("File cache: evicted '%s'.\n", victim->path);
+        server_ght_del(&fc->files, server_ght_hashstr(victim->path));
+    }
+}
+
+/* Register a load before reading, invalidations from now on make it stale. */
+static void
+fcache_load_begin(server_fcache_t* fc, fcache_load_t* load)
+{
+    pthread_mutex_lock(&fc->mutex);
+    load->next = fc->loads;
+    fc->loads = load;
+    pthread_mutex_unlock(&fc->mutex);
+}
+
+/* Under fc->mutex. */
+static void
+fcache_load_end(server_fcache_t* fc, fcache_load_t* load)
+{
+    fcache_load_t** prev = &fc->loads;
+
+    while (*prev != load)
+        prev = &(*prev)->next;
+    *prev = load->next;
+}
+
+/* Drop `path`, or everything if NULL. Other files and loads are left alone. */
+static void
+fcache_invalidate(server_fcache_t* fc, const char* path)
+{
+    pthread_mutex_lock(&fc->mutex);
+    for (fcache_load_t* load = fc->loads; load; load = load->next)
+        if (path == NULL || strcmp(load->path, path) == 0)
+            load->stale = true;
+
+    if (path)
+    {
+        if (server_ght_del(&fc->files, server_ght_hashstr(path)))
+            debug("File cache: dropped '%s'.\n", path);
+    }
+    else
+    {
+        debug("File cache: dropped all files.\n");
+        server_ght_clear(&fc->files);
+    }
+    pthread_mutex_unlock(&fc->mutex);
+}
+
+static void
+fcache_handle_inotify(server_fcache_t* fc, const struct inotify_event* iev)
+{
+    char path[PATH_MAX];
+    const char* dir;
+
+    if (iev->mask & IN_Q_OVERFLOW)
+    {
+        warn("File cache: inotify queue overflow.\n");
+        fcache_invalidate(fc, NULL);
+        return;
+    }
+
+    if (iev->mask & IN_IGNORED)
+    {
+        /* Watch is gone (directory deleted/moved), wd can be reused. */
+        server_ght_del(&fc->dirs, iev->wd);
+        fcache_invalidate(fc, NULL);
+        return;
+    }
+    if (iev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+        fcache_invalidate(fc, NULL);
+        return;
+    }
+
+    if (iev->len == 0 || (dir = server_ght_get(&fc->dirs, iev->wd)) == NULL)
+        return;
+
+    snprintf(path, PATH_MAX, "%s/%s", dir, iev->name);
+    fcache_invalidate(fc, path);
+}
+
+static enum se_status
+se_fcache_read(UNUSED eworker_t* ew, server_event_t* ev)
+{
+    server_fcache_t* fc = ev->data;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* iev;
+    ssize_t len;
+
+    while ((len = read(fc->inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char* ptr = buf; ptr < buf + len;
+             ptr += sizeof(struct inotify_event) + iev->len)
+        {
+            iev = (const struct inotify_event*)ptr;
+            fcache_handle_inotify(fc, iev);
+        }
+    }
+    if (len == -1 && errno != EAGAIN)
+        error("File cache inotify read: %s\n", ERRSTR);
+
+    return SE_OK;
+}
+
+static enum se_status
+se_fcache_close(UNUSED eworker_t* ew, server_event_t* ev)
+{
+    server_fcache_t* fc = ev->data;
+
+    if (close(fc->inotify_fd) == -1)
+        error("close inotify fd (%d): %s\n", fc->inotify_fd, ERRSTR);
+    fc->inotify_fd = -1;
+    return SE_OK;
+}
+
+bool
+server_fcache_init(server_t* server)
+{
+    server_fcache_t* fc = &server->fcache;
+
+    fc->inotify_fd = -1;
+    fc->max_bytes = (size_t)server->conf.file_cache_mb * KIB * KIB;
+    if (fc->max_bytes == 0)
+    {
+        info("File cache disabled.\n");
+        return true;
+    }
+
+    if (server_ght_init(&fc->files, 64, fcache_file_drop) == false)
+        return false;
+    if (server_ght_init(&fc->dirs, 16, free /* libc free() */) == false)
+        return false;
+    pthread_mutex_init(&fc->mutex, NULL);
+
+    fc->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fc->inotify_fd == -1)
+    {
+        fatal("inotify_init1: %s\n", ERRSTR);
+        return false;
+    }
+
+    /* Any worker will do, invalidation doesn't care who runs it. */
+    if (server_new_event(server->tm.workers, fc->inotify_fd, fc,
+                         se_fcache_read, se_fcache_close) == NULL)
+    {
+        close(fc->inotify_fd);
+        fc->inotify_fd = -1;
+        return false;
+    }
+
+    info("File cache: %u MiB.\n", server->conf.file_cache_mb);
+    return true;
+}
+
+void
+server_fcache_destroy(server_fcache_t* fc)
+{
+    if (fc->max_bytes == 0 || fc->files.table.slots == NULL)
+        return;
+
+    server_ght_destroy(&fc->files);
+    server_ght_destroy(&fc->dirs);
+    pthread_mutex_destroy(&fc->mutex);
+}
+
+fcache_file_t*
+server_fcache_get(server_fcache_t* fc, const char* path)
+{
+    fcache_file_t* file;
+
+    if (fc->max_bytes == 0)
+        return NULL;
+
+    server_ght_rdlock(&fc->files);
+    file = server_ght_get_locked(&fc->files, server_ght_hashstr(path));
+    if (file && strcmp(file->path, path) == 0)
+    {
+        __atomic_fetch_add(&file->refs, 1, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&file->used, __ATOMIC_RELAXED) == false)
+            __atomic_store_n(&file->used, true, __ATOMIC_RELAXED);
+    }
+    else
+        file = NULL;
+    server_ght_unlock(&fc->files);
+
+    return file;
+}
+
+/* Watch the directory of `path` before reading it, no change is missed. */
+static bool
+fcache_watch_dir(server_fcache_t* fc, const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    char* dir;
+    i32 wd;
+
+    if (slash == NULL)
+        return false;
+    dir = strndup(path, slash - path);
+
+    wd = inotify_add_watch(fc->inotify_fd, dir, FCACHE_WATCH_MASK);
+    if (wd == -1)
+    {
+        warn("File cache: inotify_add_watch '%s': %s\n", dir, ERRSTR);
+        free(dir);
+        return false;
+    }
+
+    /* Same wd if already watched. */
+    if (server_ght_insert(&fc->dirs, wd, dir) == false)
+        free(dir);
+    return true;
+}
+
+static u8*
+fcache_gzip(const u8* body, size_t len, size_t* out_len)
+{
+    z_stream zs;
+    size_t bound;
+    u8* buf;
+    i32 ret;
+
+    memset(&zs, 0, sizeof(z_stream));
+    /* 15 + 16: gzip wrapper, not zlib. */
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, 
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    bound = deflateBound(&zs, len);
+    buf = malloc(FCACHE_HEAD_MAX + bound);
+    zs.next_in = (Bytef*)body;
+    zs.avail_in = len;
+    zs.next_out = buf + FCACHE_HEAD_MAX;
+    zs.avail_out = bound;
+
+    ret = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END)
+    {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+#ifdef HAVE_BROTLI
+static u8*
+fcache_brotli(const u8* body, size_t len, size_t* out_len)
+{
+    size_t bound = BrotliEncoderMaxCompressedSize(len);
+    u8* buf;
+
+    if (bound == 0)
+        return NULL;
+    buf = malloc(FCACHE_HEAD_MAX + bound);
+    *out_len = bound;
+    if (!BrotliEncoderCompress(FCACHE_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, 
+                               BROTLI_MODE_TEXT, len, body, out_len, 
+                               buf + FCACHE_HEAD_MAX))
+    {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+#endif
+
+static const fcache_compress_t fcache_compress[HTTP_ENC_COUNT] = {
+    [HTTP_ENC_GZIP] = fcache_gzip,
+#ifdef HAVE_BROTLI
+    [HTTP_ENC_BR]   = fcache_brotli,
+#endif
+};
+
+static bool
+fcache_compressible(const char* content_type)
+{
+    return !strncmp(content_type, "text/", 5) ||
+           strstr(content_type, "javascript") ||
+           strstr(content_type, "json") ||
+           strstr(content_type, "xml"); /* Also image/svg+xml */
+}
+
+static size_t
+fcache_build_head(server_t* server, const fcache_file_t* file, fcache_resp_t* resp, 
+                  enum http_encoding enc, const char* content_type, bool vary, char* head)
+{
+    struct tm tm;
+    char date[64];
+    i32 len;
+
+    gmtime_r(&file->mtime, &tm);
+    strftime(date, sizeof(date), HTTP_DATE_FMT, &tm);
+
+    len = snprintf(head, FCACHE_HEAD_MAX,
+                   HTTP_VERSION " 200 OK" HTTP_NL
+                   "Server: " SERVER_NAME HTTP_NL
+                   HTTP_HEAD_CONTENT_TYPE ": %s" HTTP_NL
+                   HTTP_HEAD_CONTENT_LEN ": %zu" HTTP_NL
+                   "Last-Modified: %s" HTTP_NL
+                   "ETag: %s" HTTP_NL
+                   "Cache-Control: %s" HTTP_NL
+                   "Accept-Ranges: bytes" HTTP_NL
+                   "%s%s%s"
+                   "%s",
+                   content_type, resp->body_len, date, resp->etag, file->cache_control,
+                   (enc != HTTP_ENC_IDENTITY) ? "Content-Encoding: " : "",
+                   (enc != HTTP_ENC_IDENTITY) ? fcache_enc_name[enc] : "",
+                   (enc != HTTP_ENC_IDENTITY) ? HTTP_NL : "",
+                   (vary) ? "Vary: " HTTP_HEAD_ACCEPT_ENC HTTP_NL : "");
+    if (len >= FCACHE_HEAD_MAX)
+        return len;
+    resp->common_len = len;
+
+    if (server->conf.idle_timeout)
+        len += snprintf(head + len, FCACHE_HEAD_MAX - len,
+                        "Connection: keep-alive" HTTP_NL
+                        "Keep-Alive: timeout=%u" HTTP_NL HTTP_NL,
+                        server->conf.idle_timeout);
+    else
+        len += snprintf(head + len, FCACHE_HEAD_MAX - len,
+                        "Connection: keep-alive" HTTP_NL HTTP_NL);
+    return len;
+}
+
+/*
+ * Make `buf` (FCACHE_HEAD_MAX free bytes, then the body) the `enc`
+ * response of `file`, takes ownership of `buf`.
+ */
+static bool
+fcache_set_resp(server_t* server, fcache_file_t* file, const struct stat* st, 
+                enum http_encoding enc, const char* content_type, bool vary,
+                u8* buf, size_t body_len)
+{
+    fcache_resp_t* resp = file->resp + enc;
+    char head[FCACHE_HEAD_MAX];
+
+    resp->body_len = body_len;
+    file->cache_control = server_http_file_etag(server, file->path, st, 
+                                                fcache_etag_suffix[enc], resp->etag);
+
+    resp->head_len = fcache_build_head(server, file, resp, enc, content_type, vary, head);
+    if (resp->head_len >= FCACHE_HEAD_MAX)
+    {
+        free(buf);
+        return false;
+    }
+    memmove(buf + resp->head_len, buf + FCACHE_HEAD_MAX, body_len);
+    memcpy(buf, head, resp->head_len);
+    resp->data = buf;
+    return true;
+}
+
+/* Compressed responses of a text file, if smaller. return: any made */
+static bool
+fcache_compress_file(server_t* server, fcache_file_t* file, const struct stat* st,
+                     const char* content_type, const u8* body, size_t body_len)
+{
+    bool any = false;
+    size_t len;
+    u8* buf;
+
+    if (body_len < FCACHE_MIN_COMPRESS || !fcache_compressible(content_type))
+        return false;
+
+    for (i32 enc = HTTP_ENC_IDENTITY + 1; enc < HTTP_ENC_COUNT; enc++)
+    {
+        if (fcache_compress[enc] == NULL || 
+            (buf = fcache_compress[enc](body, body_len, &len)) == NULL)
+            continue;
+        if (len >= body_len)
+        {
+            free(buf);
+            continue;
+        }
+        if (fcache_set_resp(server, file, st, enc, content_type, true, buf, len))
+            any = true;
+    }
+    return any;
+}
+
+fcache_file_t*
+server_fcache_load(server_t* server, const char* path, const struct stat* st_hint)
+{
+    server_fcache_t* fc = &server->fcache;
+    fcache_load_t load = {.path = path};
+    fcache_file_t* file = NULL;
+    const char* content_type;
+    struct stat st;
+    u64 key;
+    ssize_t bytes_read;
+    size_t size;
+    u8* buf = NULL;
+    i32 fd = -1;
+
+    if (fc->max_bytes == 0 || !S_ISREG(st_hint->st_mode) || 
+        st_hint->st_size > FCACHE_MAX_FILE)
+        return NULL;
+
+    /* Loaded by another worker meanwhile? */
+    if ((file = server_fcache_get(fc, path)))
+        return file;
+
+    /* Same file by another name would miss invalidations. */
+    if (strstr(path, "//") || strstr(path, "/./"))
+        return NULL;
+
+    if (fcache_watch_dir(fc, path) == false)
+        return NULL;
+    fcache_load_begin(fc, &load);
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        goto err;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > FCACHE_MAX_FILE)
+        goto err;
+    size = st.st_size;
+
+    file = calloc(1, sizeof(fcache_file_t));
+    file->fc = fc;
+    file->path = strdup(path);
+    file->mtime = st.st_mtim.tv_sec;
+
+    /* 
+     * The head needs the content type, which may need the body.
+     * Read the body after the max head size and move it back after.
+     */
+    buf = malloc(FCACHE_HEAD_MAX + size);
+    bytes_read = read(fd, buf + FCACHE_HEAD_MAX, size);
+    if (bytes_read != (ssize_t)size)
+    {
+        warn("File cache: read '%s': %s\n", path, (bytes_read == -1) ? ERRSTR : "short read");
+        goto err;
+    }
+    close(fd);
+    fd = -1;
+
+    content_type = server_get_content_type(path);
+    if (strcmp(content_type, "application/octet-stream") == 0)
+    {
+        const char* temp = server_mime_type(server, buf + FCACHE_HEAD_MAX, size);
+        if (temp)
+            content_type = temp;
+    }
+
+    /* Before the identity one, which moves the body. */
+    file->vary = fcache_compress_file(server, file, &st, content_type, 
+                                      buf + FCACHE_HEAD_MAX, size);
+    if (fcache_set_resp(server, file, &st, HTTP_ENC_IDENTITY, content_type, file->vary, 
+                        buf, size) == false)
+    {
+        buf = NULL;
+        goto err;
+    }
+    file->size = fcache_file_size(file);
+
+    /* Caller's reference, plus the cache's if it's inserted. */
+    file->refs = 1;
+    key = server_ght_hashstr(path);
+    pthread_mutex_lock(&fc->mutex);
+    fcache_load_end(fc, &load);
+    if (load.stale == false && server_ght_get(&fc->files, key) == NULL)
+    {
+        fcache_evict(fc, file->size);
+        file->refs++;
+        if (server_ght_insert(&fc->files, key, file))
+            fcache_clock_add(fc, file);
+        else
+            file->refs--;
+    }
+    pthread_mutex_unlock(&fc->mutex);
+
+    verbose("File cache: loaded '%s' (%s, %zu bytes, gzip: %zu, br: %zu).\n", 
+            path, content_type, size, file->resp[HTTP_ENC_GZIP].body_len,
+            file->resp[HTTP_ENC_BR].body_len);
+    return file;
+err:
+    pthread_mutex_lock(&fc->mutex);
+    fcache_load_end(fc, &load);
+    pthread_mutex_unlock(&fc->mutex);
+    if (fd != -1)
+        close(fd);
+    free(buf);
+    if (file)
+        fcache_file_free(file);
+    return NULL;
+}
+
+ssize_t
+server_fcache_send(client_t* client, const fcache_file_t* file, const http_t* req)
+{
+    const char* close_end = "Connection: close" HTTP_NL HTTP_NL;
+    const fcache_resp_t* resp = file->resp + HTTP_ENC_IDENTITY;
+    const u32 accept = http_accept_encoding(req);
+    char head[FCACHE_HEAD_MAX + 32];
+    struct iovec iov[2];
+    http_cache_t cache;
+    size_t len;
+
+    for (i32 enc = HTTP_ENC_COUNT - 1; enc > HTTP_ENC_IDENTITY; enc--)
+    {
+        if (accept & (1 << enc) && file->resp[enc].data)
+        {
+            resp = file->resp + enc;
+            break;
+        }
+    }
+
+    cache.etag = resp->etag;
+    cache.mtime = file->mtime;
+    cache.cache_control = file->cache_control;
+    cache.vary = file->vary;
+    if (http_not_modified(req, &cache))
+    {
+        server_http_resp_not_modified(client, &cache);
+        return 0;
+    }
+
+    if (client->state & CLIENT_STATE_KEEP_ALIVE)
+        return server_send(client, resp->data, resp->head_len + resp->body_len);
+
+    /* Prebuilt head is for keep-alive, end this one with close. */
+    memcpy(head, resp->data, resp->common_len);
+    len = resp->common_len + strlen(close_end);
+    memcpy(head + resp->common_len, close_end, strlen(close_end));
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = len;
+    iov[1].iov_base = resp->data + resp->head_len;
+    iov[1].iov_len = resp->body_len;
+    return server_sendv(client, iov, 2);
+}
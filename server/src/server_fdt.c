@@ -0,0 +1,132 @@
+#include "server_fdt.h"
+#include <sys/resource.h>
+
+static inline bool
+fdt_valid(const server_fdt_t* fdt, i32 fd)
+{
+    return fd >= 0 && (size_t)fd < fdt->size;
+}
+
+static void
+fdt_update_max(server_fdt_t* fdt, i32 fd)
+{
+    i32 max = __atomic_load_n(&fdt->max_fd, __ATOMIC_RELAXED);
+
+    while (fd > max && 
+           !__atomic_compare_exchange_n(&fdt->max_fd, &max, fd, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static bool
+fdt_swap(void** slot_ptr, const void* expected, void* data)
+{
+    void* old = (void*)expected;
+
+    return __atomic_compare_exchange_n(slot_ptr, &old, data, false,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+bool
+server_fdt_init(server_fdt_t* fdt)
+{
+    struct rlimit rlim;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == -1)
+    {
+        error("getrlimit: %s\n", ERRSTR);
+        return false;
+    }
+
+    fdt->size = (rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > FDT_MAX_SIZE)
+                    ? FDT_MAX_SIZE : rlim.rlim_cur;
+    fdt->max_fd = -1;
+    fdt->slots = calloc(fdt->size, sizeof(fdt_slot_t));
+    if (fdt->slots == NULL)
+    {
+        error("calloc fd table (%zu): %s\n", fdt->size, ERRSTR);
+        return false;
+    }
+    debug("fd table size: %zu\n", fdt->size);
+
+    return true;
+}
+
+void
+server_fdt_destroy(server_fdt_t* fdt)
+{
+    free(fdt->slots);
+    fdt->slots = NULL;
+    fdt->size = 0;
+}
+
+bool
+server_fdt_set_event(server_fdt_t* fdt, i32 fd, server_event_t* se)
+{
+    fdt_slot_t* slot;
+
+    if (!fdt_valid(fdt, fd))
+    {
+        warn("fdt: fd %d out of range (%zu)\n", fd, fdt->size);
+        return false;
+    }
+    slot = fdt->slots + fd;
+
+    if (fdt_swap((void**)&slot->se, NULL, se) == false)
+        return false;
+    __atomic_add_fetch(&slot->gen, 1, __ATOMIC_RELAXED);
+    fdt_update_max(fdt, fd);
+    return true;
+}
+
+server_event_t*
+server_fdt_get_event(const server_fdt_t* fdt, i32 fd)
+{
+    if (!fdt_valid(fdt, fd))
+        return NULL;
+    return __atomic_load_n(&fdt->slots[fd].se, __ATOMIC_ACQUIRE);
+}
+
+void
+server_fdt_del_event(server_fdt_t* fdt, i32 fd, const server_event_t* se)
+{
+    if (fdt_valid(fdt, fd))
+        fdt_swap((void**)&fdt->slots[fd].se, se, NULL);
+}
+
+u32
+server_fdt_gen(const server_fdt_t* fdt, i32 fd)
+{
+    if (!fdt_valid(fdt, fd))
+        return 0;
+    return __atomic_load_n(&fdt->slots[fd].gen, __ATOMIC_RELAXED);
+}
+
+bool
+server_fdt_set_client(server_fdt_t* fdt, i32 fd, client_t* client)
+{
+    if (!fdt_valid(fdt, fd))
+    {
+        warn("fdt: fd %d out of range (%zu)\n", fd, fdt->size);
+        return false;
+    }
+    if (fdt_swap((void**)&fdt->slots[fd].client, NULL, client) == false)
+        return false;
+    fdt_update_max(fdt, fd);
+    return true;
+}
+
+client_t*
+server_fdt_get_client(const server_fdt_t* fdt, i32 fd)
+{
+    if (!fdt_valid(fdt, fd))
+        return NULL;
+    return __atomic_load_n(&fdt->slots[fd].client, __ATOMIC_ACQUIRE);
+}
+
+void
+server_fdt_del_client(server_fdt_t* fdt, i32 fd, const client_t* client)
+{
+    if (fdt_valid(fdt, fd))
+        fdt_swap((void**)&fdt->slots[fd].client, client, NULL);
+}
@@ -0,0 +1,455 @@
+#include "server_handoff.h"
+#include "server.h"
+#include <sys/wait.h>
+#include <poll.h>
+
+static bool
+handoff_write_all(i32 fd, const void* buf, size_t len)
+{
+    const u8* ptr = buf;
+    ssize_t n;
+
+    while (len)
+    {
+        if ((n = write(fd, ptr, len)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error("handoff write: %s\n", ERRSTR);
+            return false;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool
+handoff_read_all(i32 fd, void* buf, size_t len)
+{
+    u8* ptr = buf;
+    ssize_t n;
+
+    while (len)
+    {
+        if ((n = read(fd, ptr, len)) <= 0)
+        {
+            if (n == -1 && errno == EINTR)
+                continue;
+            error("handoff read: %s\n", (n == 0) ? "EOF" : ERRSTR);
+            return false;
+        }
+        ptr += n;
+        len -= n;
+    }
+    return true;
+}
+
+static u32
+handoff_listen_socks(const server_t* server, i32* socks)
+{
+    const server_tm_t* tm = &server->tm;
+    u32 n = 0;
+
+    if (server->conf.reuseport == false)
+    {
+        socks[n++] = server->sock;
+        return n;
+    }
+
+    for (size_t i = 0; i < tm->n_workers && n < HANDOFF_MAX_SOCKS; i++)
+        socks[n++] = tm->workers[i].sock;
+    /* Extra sockets we got ourselves, see server_handoff_finish(). */
+    for (u32 i = tm->n_workers; i < server->handoff.n_socks && n < HANDOFF_MAX_SOCKS; i++)
+        socks[n++] = server->handoff.socks[i];
+    return n;
+}
+
+static handoff_session_t*
+handoff_sessions(server_t* server, u32* n_sessions)
+{
+    server_ght_t* ht = &server->session_ht;
+    handoff_session_t* sessions;
+    u32 n = 0;
+
+    server_ght_rdlock(ht);
+    sessions = calloc(ht->count + 1, sizeof(handoff_session_t));
+    GHT_FOREACH(const session_t* session, ht, {
+        sessions[n].session_id = session->session_id;
+        sessions[n].user_id = session->user_id;
+        n++;
+    });
+    server_ght_unlock(ht);
+
+    *n_sessions = n;
+    return sessions;
+}
+
+static bool
+handoff_send(server_t* server, i32 fd)
+{
+    i32 socks[HANDOFF_MAX_SOCKS];
+    handoff_session_t* sessions;
+    handoff_hdr_t hdr = {
+        .magic = HANDOFF_MAGIC
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(socks))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = &hdr,
+        .iov_len = sizeof(handoff_hdr_t)
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+    };
+    struct cmsghdr* cmsg;
+    bool ret;
+
+    hdr.n_socks = handoff_listen_socks(server, socks);
+    sessions = handoff_sessions(server, &hdr.n_sessions);
+
+    memset(&control, 0, sizeof(control));
+    msg.msg_controllen = CMSG_SPACE(hdr.n_socks * sizeof(i32));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(hdr.n_socks * sizeof(i32));
+    memcpy(CMSG_DATA(cmsg), socks, hdr.n_socks * sizeof(i32));
+
+    if (sendmsg(fd, &msg, 0) != sizeof(handoff_hdr_t))
+    {
+        error("handoff sendmsg: %s\n", ERRSTR);
+        free(sessions);
+        return false;
+    }
+
+    ret = handoff_write_all(fd, sessions, hdr.n_sessions * sizeof(handoff_session_t));
+    if (ret)
+        info("Handoff: sent %u listening sockets and %u sessions.\n",
+             hdr.n_socks, hdr.n_sessions);
+    free(sessions);
+    return ret;
+}
+
+static bool
+handoff_wait_ack(i32 fd)
+{
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN
+    };
+    char ack = 0;
+    i32 ret;
+
+    ret = poll(&pfd, 1, HANDOFF_ACK_TIMEOUT_MS);
+    if (ret <= 0)
+    {
+        error("Handoff: no ack from new server: %s\n",
+              (ret == 0) ? "timeout" : ERRSTR);
+        return false;
+    }
+    if (read(fd, &ack, 1) != 1 || ack != HANDOFF_ACK)
+    {
+        error("Handoff: new server failed to start.\n");
+        return false;
+    }
+    return true;
+}
+
+/* Options taking a value, which may look like an option itself. */
+static bool
+handoff_opt_has_value(const char* arg)
+{
+    static const char* const opts[] = {
+        "-p", "-d", "-T", "--port", "--database-name", "--thread-pool"
+    };
+
+    for (size_t i = 0; i < sizeof(opts) / sizeof(const char*); i++)
+        if (!strcmp(arg, opts[i]))
+            return true;
+    return false;
+}
+
+static pid_t
+handoff_exec(server_t* server, i32 child_fd)
+{
+    char fd_str[16];
+    char** argv;
+    const char* arg;
+    i32 argc = 1;
+    pid_t pid;
+
+    /* Built before fork(), only async-signal-safe calls in the child. */
+    snprintf(fd_str, sizeof(fd_str), "%d", child_fd);
+    argv = calloc(server->argc + 3, sizeof(char*));
+    argv[0] = server->exe_path;
+    for (i32 i = 1; i < server->argc; i++)
+    {
+        arg = server->argv[i];
+        /* Drop our own --handoff-fd if this server was an upgrade too. */
+        if (!strcmp(arg, "--handoff-fd") || !strcmp(arg, "-H"))
+        {
+            i++;
+            continue;
+        }
+        /* "-H<fd>", option values are skipped below so this is one. */
+        if (!strncmp(arg, "--handoff-fd=", 13) || (!strncmp(arg, "-H", 2) && arg[2]))
+            continue;
+        argv[argc++] = server->argv[i];
+
+        /* A value like "-d -Hx" is kept as is. */
+        if (handoff_opt_has_value(arg) && i + 1 < server->argc)
+            argv[argc++] = server->argv[++i];
+    }
+    argv[argc] = "--handoff-fd";
+    argv[argc + 1] = fd_str;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        execv(server->exe_path, argv);
+        _exit(127);
+    }
+    else if (pid == -1)
+        error("Handoff fork: %s\n", ERRSTR);
+
+    free(argv);
+    return pid;
+}
+
+bool
+server_handoff_start(server_t* server)
+{
+    server_handoff_t* ho = &server->handoff;
+    i32 sv[2];
+
+    if (server->draining || ho->pid)
+    {
+        warn("Handoff already in progress.\n");
+        return false;
+    }
+    if (server->exe_path[0] == 0)
+    {
+        warn("Handoff: path of the server binary unknown.\n");
+        return false;
+    }
+
+    info("Handoff: starting new server '%s'.\n", server->exe_path);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        error("Handoff socketpair: %s\n", ERRSTR);
+        return false;
+    }
+    /* Only sv[1] goes to the new server. */
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    ho->pid = handoff_exec(server, sv[1]);
+    close(sv[1]);
+    if (ho->pid == -1)
+        goto err;
+
+    if (!handoff_send(server, sv[0]) || !handoff_wait_ack(sv[0]))
+        goto err;
+    close(sv[0]);
+
+    /* New server is accepting, stop accepting here and drain. */
+    server->draining = true;
+    ho->drain_deadline = time(NULL) + server->conf.drain_timeout;
+    alarm(1);
+    info("Handoff done (pid %d), draining clients for max %us.\n",
+         ho->pid, server->conf.drain_timeout);
+    return true;
+err:
+    close(sv[0]);
+    if (ho->pid > 0)
+        waitpid(ho->pid, NULL, WNOHANG);
+    ho->pid = 0;
+    warn("Handoff failed, still serving.\n");
+    return false;
+}
+
+void
+server_handoff_drain_tick(server_t* server)
+{
+    const time_t deadline = server->handoff.drain_deadline;
+    const time_t now = time(NULL);
+    size_t n_clients = 0;
+    u64 pending;
+
+    if (!server->draining)
+        return;
+
+    for (i32 fd = 0; fd <= server->fdt.max_fd; fd++)
+        if (server_fdt_get_client(&server->fdt, fd))
+            n_clients++;
+    pending = __atomic_load_n(&server->stats.send_pending, __ATOMIC_RELAXED);
+
+    /* 
+     * Past the deadline, clients still getting queued data (e.g. a large
+     * download) get up to another drain_timeout to flush it.
+     */
+    if (n_clients == 0 || 
+        (now >= deadline && 
+         (pending == 0 || now >= deadline + server->conf.drain_timeout)))
+    {
+        info("Drain done, %zu clients left, %lu with unsent data.\n", 
+             n_clients, pending);
+        server->running = false;
+    }
+    else
+        alarm(1);
+}
+
+/*
+ * A SO_REUSEPORT group can't be joined by a socket without it (and the
+ * other way around), so follow the old server's mode.
+ */
+static void
+handoff_check_reuseport(server_t* server)
+{
+    i32 reuseport = 0;
+    socklen_t len = sizeof(i32);
+
+    if (getsockopt(server->sock, SOL_SOCKET, SO_REUSEPORT, &reuseport, &len) == -1)
+    {
+        error("Handoff getsockopt SO_REUSEPORT: %s\n", ERRSTR);
+        return;
+    }
+    if ((reuseport != 0) == server->conf.reuseport)
+        return;
+
+    warn("Handoff: old server %s reuseport, following it.\n",
+         (reuseport) ? "uses" : "doesn't use");
+    server->conf.reuseport = reuseport != 0;
+    if (!server->conf.reuseport)
+    {
+        server->conf.edge_triggered = false;
+        server->conf.io_uring = false;
+    }
+}
+
+bool
+server_handoff_recv(server_t* server)
+{
+    server_handoff_t* ho = &server->handoff;
+    handoff_hdr_t hdr;
+    union {
+        char buf[CMSG_SPACE(sizeof(ho->socks))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {
+        .iov_base = &hdr,
+        .iov_len = sizeof(handoff_hdr_t)
+    };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    struct cmsghdr* cmsg;
+    size_t n_fds;
+
+    if (recvmsg(ho->fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(handoff_hdr_t))
+    {
+        fatal("Handoff recvmsg: %s\n", ERRSTR);
+        return false;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (hdr.magic != HANDOFF_MAGIC || !cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        fatal("Handoff: invalid message.\n");
+        return false;
+    }
+    n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(i32);
+    if (n_fds == 0 || n_fds != hdr.n_socks)
+    {
+        fatal("Handoff: got %zu sockets, expected %u.\n", n_fds, hdr.n_socks);
+        return false;
+    }
+    memcpy(ho->socks, CMSG_DATA(cmsg), n_fds * sizeof(i32));
+    ho->n_socks = n_fds;
+
+    ho->sessions = calloc(hdr.n_sessions + 1, sizeof(handoff_session_t));
+    ho->n_sessions = hdr.n_sessions;
+    if (!handoff_read_all(ho->fd, ho->sessions,
+                          hdr.n_sessions * sizeof(handoff_session_t)))
+        return false;
+
+    info("Handoff: got %u listening sockets and %u sessions.\n",
+         ho->n_socks, ho->n_sessions);
+
+    server->sock = ho->socks[0];
+    handoff_check_reuseport(server);
+    return true;
+}
+
+i32
+server_handoff_sock(server_t* server, size_t i)
+{
+    server_handoff_t* ho = &server->handoff;
+
+    if (ho->fd == -1 || i >= ho->n_socks)
+        return -1;
+    return ho->socks[i];
+}
+
+bool
+server_handoff_finish(server_t* server)
+{
+    server_handoff_t* ho = &server->handoff;
+    server_tm_t* tm = &server->tm;
+    const u32 n_used = (server->conf.reuseport) ? tm->n_workers : 1;
+    const char ack = HANDOFF_ACK;
+    session_t* session;
+    union timer_data data;
+
+    if (ho->fd == -1)
+        return true;
+
+    for (u32 i = 0; i < ho->n_sessions; i++)
+    {
+        session = calloc(1, sizeof(session_t));
+        session->session_id = ho->sessions[i].session_id;
+        session->user_id = ho->sessions[i].user_id;
+        if (server_ght_insert(&server->session_ht, session->session_id, session) == false)
+        {
+            free(session);
+            continue;
+        }
+
+        /* Logged out until the client reconnects here. */
+        data.session = session;
+        session->timer = server_addtimer(tm->workers + (i % tm->n_workers),
+                                         SESSION_EXPIRE, TIMER_ONCE,
+                                         TIMER_CLIENT_SESSION,
+                                         &data, sizeof(void*));
+    }
+    free(ho->sessions);
+    ho->sessions = NULL;
+
+    /* 
+     * Old server had more reuseport sockets than we have workers. Closing
+     * one would drop the connections queued on it, accept on it as well.
+     */
+    for (u32 i = n_used; i < ho->n_socks; i++)
+    {
+        info("Handoff: %s also accepts on socket %d.\n", 
+             tm->workers[i % tm->n_workers].name, ho->socks[i]);
+        if (server_new_accept_event(tm->workers + (i % tm->n_workers), 
+                                    ho->socks[i]) == NULL)
+            return false;
+    }
+
+    if (!handoff_write_all(ho->fd, &ack, 1))
+        return false;
+    close(ho->fd);
+    ho->fd = -1;
+    return true;
+}
@@ -4,165 +4,244 @@
  * ght_* (without server_ prefix) will be only used here.
  */
 
-#define GHT_MAX_LOAD 0.7
+#define GHT_MAX_LOAD 0.8
 #define GHT_MIN_LOAD 0.2
 #define GHT_HASH_VAL 5381
+#define GHT_MIGRATE_SLOTS 64 /* Old slots moved per insert/delete */
 
-#define GHT_BUCKET_INHEAP -1
-#define GHT_BUDKET_INARRAY 0
+/* splitmix64 finalizer, spreads sequential ids and fds over all bits. */
+static inline u64
+ght_mix(u64 key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
 
-static size_t 
-ght_hash(const server_ght_t* ht, u64 key)
+static size_t
+ght_pow2(size_t size)
 {
-    return key % ht->size;
+    size_t pow2 = 1;
+
+    while (pow2 < size)
+        pow2 <<= 1;
+    return pow2;
 }
 
-static void 
-ght_calc_load(server_ght_t* ht)
+static bool
+ght_table_alloc(ght_table_t* table, size_t size)
 {
-    ht->load = (f32)ht->count / ht->size;
+    table->slots = calloc(size, sizeof(ght_slot_t));
+    if (table->slots == NULL)
+    {
+        fatal("calloc() returned NULL!\n");
+        return false;
+    }
+    table->size = size;
+    table->mask = size - 1;
+    return true;
 }
 
-static void 
-ght_inc(server_ght_t* ht)
+static void
+ght_table_free(ght_table_t* table)
 {
-    ht->count++;
-    ght_calc_load(ht);
+    free(table->slots);
+    memset(table, 0, sizeof(ght_table_t));
 }
 
-static void 
-ght_dec(server_ght_t* ht)
+static void
+ght_calc_load(server_ght_t* ht)
 {
-    ht->count--;
-    ght_calc_load(ht);
+    ht->load = (f32)ht->count / ht->table.size;
 }
 
-static bool 
-ght_insert(server_ght_t* ht, u64 key, void* data)
+/* return: slot index of `key`, -1 if not found. */
+static ssize_t
+ght_table_find(const ght_table_t* table, u64 key)
 {
     size_t idx;
-    ght_bucket_t* bucket;
-    ght_bucket_t* parent;
-    ght_bucket_t** next;
+    const ght_slot_t* slot;
 
-    idx = ght_hash(ht, key);
-    bucket = ht->table + idx;
+    if (table->size == 0)
+        return -1;
 
-    if (bucket->key == key)
-        return false;
-    if (bucket->data)
+    idx = ght_mix(key) & table->mask;
+    for (u32 dist = 0; ; dist++)
+    {
+        slot = table->slots + idx;
+        /*
+         * Robin Hood invariant: had `key` been here, it would have taken
+         * any slot with an element closer to its home.
+         */
+        if (slot->data == NULL || slot->dist < dist)
+            return -1;
+        if (slot->key == key)
+            return idx;
+        idx = (idx + 1) & table->mask;
+    }
+}
+
+/* `key` must not be in `table`. */
+static void
+ght_table_insert(ght_table_t* table, u64 key, void* data)
+{
+    ght_slot_t new = {
+        .key = key,
+        .data = data,
+        .dist = 0
+    };
+    ght_slot_t tmp;
+    ght_slot_t* slot;
+    size_t idx;
+
+    idx = ght_mix(key) & table->mask;
+    for (;;)
     {
-        parent = bucket;
-        next = &parent->next;
-        while (*next)
+        slot = table->slots + idx;
+        if (slot->data == NULL)
+        {
+            *slot = new;
+            return;
+        }
+        /* Take from the rich (close to home), keep probing with it. */
+        if (slot->dist < new.dist)
         {
-            if (next[0]->key == key)
-                return false;
-            next = &next[0]->next;
+            tmp = *slot;
+            *slot = new;
+            new = tmp;
         }
-        bucket = calloc(1, sizeof(ght_bucket_t));
-        bucket->inheap = GHT_BUCKET_INHEAP;
-        *next = bucket;
+        new.dist++;
+        idx = (idx + 1) & table->mask;
     }
-    bucket->key = key;
-    bucket->data = data;
-    ght_inc(ht);
-    return true;
 }
 
-static void 
-ght_resize(server_ght_t* ht, size_t new_size)
+/* Backward shift: move following displaced elements one closer to home. */
+static void
+ght_table_del(ght_table_t* table, size_t idx)
 {
-    size_t old_size;
-    size_t old_count;
-    ght_bucket_t* old_table;
-    ght_bucket_t* old_bucket;
-    ght_bucket_t* old_bucket_tmp;
+    ght_slot_t* slot = table->slots + idx;
+    ght_slot_t* next;
 
-    if (new_size < ht->min_size)
-        new_size = ht->min_size;
-    if (new_size == ht->size || ht->ignore_resize)
-        return;
+    for (;;)
+    {
+        next = table->slots + ((idx + 1) & table->mask);
+        if (next->data == NULL || next->dist == 0)
+            break;
+        *slot = *next;
+        slot->dist--;
+        slot = next;
+        idx = (idx + 1) & table->mask;
+    }
+    memset(slot, 0, sizeof(ght_slot_t));
+}
 
-    debug("Resizing GHT: %zu -> %zu\n", ht->size, new_size);
+/* return: table with `key` and its slot in `idx`, NULL if not found. */
+static ght_table_t*
+ght_find(server_ght_t* ht, u64 key, ssize_t* idx)
+{
+    if ((*idx = ght_table_find(&ht->table, key)) != -1)
+        return &ht->table;
+    if ((*idx = ght_table_find(&ht->old, key)) != -1)
+        return &ht->old;
+    return NULL;
+}
 
-    old_size = ht->size;
-    old_count = ht->count;
-    old_table = ht->table;
+/*
+ * Move up to `n` old slots to the new table. Same walk as GHT_FOREACH:
+ * from after an empty slot, delete from old and look at a slot again
+ * until it's empty, the old table stays valid for lookups.
+ */
+static void
+ght_migrate(server_ght_t* ht, size_t n)
+{
+    ght_table_t* old = &ht->old;
+    ght_slot_t* slot;
 
-    ht->size = new_size;
-    ht->table = calloc(new_size, sizeof(ght_bucket_t));
-    ht->count = 0;
+    if (ht->ignore_resize)
+        return;
 
-    for (size_t i = 0; i < old_size; i++)
+    while (ht->migrate_left && n--)
     {
-        old_bucket = old_table + i;
-        do {
-            if (old_bucket->data)
-                ght_insert(ht, old_bucket->key, old_bucket->data);
-
-            old_bucket_tmp = old_bucket->next;
-            if (old_bucket->inheap)
-                free(old_bucket);
-            old_bucket = old_bucket_tmp;
-        } while (old_bucket);
+        slot = old->slots + ht->migrate_pos;
+        while (slot->data)
+        {
+            ght_table_insert(&ht->table, slot->key, slot->data);
+            ght_table_del(old, ht->migrate_pos);
+        }
+        ht->migrate_pos = (ht->migrate_pos + 1) & old->mask;
+        ht->migrate_left--;
     }
-    free(old_table);
 
-    if (old_count != ht->count)
-        warn("ght_resize() old_count != ht->count: %zu/%zu\n", 
-             old_count, ht->count);
+    if (ht->migrate_left == 0 && old->size)
+    {
+        debug("GHT migrated to %zu slots.\n", ht->table.size);
+        ght_table_free(old);
+    }
 }
 
-static void 
-ght_check_load(server_ght_t* ht)
+static void
+ght_resize(server_ght_t* ht, size_t new_size)
 {
-    if (ht->load > ht->max_load)
-        ght_resize(ht, ht->size * 2);
-    else if (ht->load < ht->min_load)
-        ght_resize(ht, ht->size / 2);
+    new_size = ght_pow2(new_size);
+    if (new_size < ht->min_size)
+        new_size = ht->min_size;
+    if (new_size == ht->table.size || ht->ignore_resize)
+        return;
+
+    /* Rare, only if a resize is due before the last one finished. */
+    ght_migrate(ht, SIZE_MAX);
+
+    debug("Resizing GHT: %zu -> %zu\n", ht->table.size, new_size);
+
+    ht->old = ht->table;
+    if (ght_table_alloc(&ht->table, new_size) == false)
+    {
+        ht->table = ht->old;
+        memset(&ht->old, 0, sizeof(ght_table_t));
+        return;
+    }
+    ht->migrate_pos = server_ght_foreach_start(&ht->old);
+    ht->migrate_left = ht->old.size;
+    ght_calc_load(ht);
 }
 
-static void 
-ght_del_bucket(server_ght_t* ht, ght_bucket_t* bucket)
+static void
+ght_check_load(server_ght_t* ht)
 {
-    ght_bucket_t* next;
+    size_t size;
 
-    if (ht->free)
-        ht->free(bucket->data);
-    if ((next = bucket->next))
+    if (ht->load > ht->max_load)
+        ght_resize(ht, ht->table.size * 2);
+    else if (ht->load < ht->min_load && ht->table.size > ht->min_size)
     {
-        if (bucket->inheap == GHT_BUDKET_INARRAY)
-            next->inheap = GHT_BUDKET_INARRAY;
-        memcpy(bucket, next, sizeof(ght_bucket_t));
-        free(next);
+        /* Shrink to about max_load / 2, not just one step down. */
+        size = ght_pow2((size_t)(ht->count / (ht->max_load / 2)) + 1);
+        ght_resize(ht, size);
     }
-    else if (bucket->inheap == -1)
-        free(bucket);
-    else
-        memset(bucket, 0, sizeof(ght_bucket_t));
-    ght_dec(ht);
-    ght_check_load(ht);
 }
 
 bool
-server_ght_init(server_ght_t* ht, 
-                size_t initial_size, 
+server_ght_init(server_ght_t* ht,
+                size_t initial_size,
                 ght_free_t free_callback)
 {
+    pthread_rwlockattr_t attr;
+
     if (initial_size == 0)
     {
         error("ght_init() initial_size cannot be 0.\n");
         return false;
     }
+    initial_size = ght_pow2(initial_size);
 
-    ht->table = calloc(initial_size, sizeof(ght_bucket_t));
-    if (ht->table == NULL)
-    {
-        fatal("calloc() returned NULL!\n");
+    memset(&ht->old, 0, sizeof(ght_table_t));
+    if (ght_table_alloc(&ht->table, initial_size) == false)
         return false;
-    }
-    ht->size = initial_size;
+    ht->migrate_pos = 0;
+    ht->migrate_left = 0;
     ht->min_size = initial_size;
     ht->count = 0;
     ht->free = free_callback;
@@ -171,24 +250,34 @@ server_ght_init(server_ght_t* ht,
     ht->min_load = GHT_MIN_LOAD;
     ht->ignore_resize = false;
 
-    pthread_mutex_init(&ht->mutex, NULL);
+    /* Logins must not starve behind a stream of broadcast lookups. */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ht->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
 
     return true;
 }
 
-void 
+void
 server_ght_lock(server_ght_t* ht)
 {
-    pthread_mutex_lock(&ht->mutex);
+    pthread_rwlock_wrlock(&ht->lock);
+}
+
+void
+server_ght_rdlock(server_ght_t* ht)
+{
+    pthread_rwlock_rdlock(&ht->lock);
 }
 
-void 
+void
 server_ght_unlock(server_ght_t* ht)
 {
-    pthread_mutex_unlock(&ht->mutex);
+    pthread_rwlock_unlock(&ht->lock);
 }
 
-u64     
+u64
 server_ght_hashstr(const char* str)
 {
     u64 hash = GHT_HASH_VAL;
@@ -197,101 +286,124 @@ server_ght_hashstr(const char* str)
     return hash;
 }
 
-bool    
+size_t
+server_ght_foreach_start(const ght_table_t* table)
+{
+    /* Load is always < 1, there is an empty slot. */
+    for (size_t i = 0; i < table->size; i++)
+        if (table->slots[i].data == NULL)
+            return (i + 1) & table->mask;
+    return 0;
+}
+
+bool
 server_ght_insert(server_ght_t* ht, u64 key, void* data)
 {
-    bool ret;
+    ssize_t idx;
+    bool ret = false;
 
     if (!data)
         return false;
 
     server_ght_lock(ht);
-    if ((ret = ght_insert(ht, key, data)))
+    if (ght_find(ht, key, &idx) == NULL)
+    {
+        ght_table_insert(&ht->table, key, data);
+        ht->count++;
+        ght_calc_load(ht);
+        ght_migrate(ht, GHT_MIGRATE_SLOTS);
         ght_check_load(ht);
+        ret = true;
+    }
     server_ght_unlock(ht);
     return ret;
 }
 
-void*   
+void*
 server_ght_get(server_ght_t* ht, u64 key)
 {
     void* ret = NULL;
-    size_t idx;
-    ght_bucket_t* bucket;
+    const ght_table_t* table;
+    ssize_t idx;
 
-    server_ght_lock(ht);
-    idx = ght_hash(ht, key);
-    bucket = ht->table + idx;
-    if (bucket->data == NULL)
-        goto unlock;
-    if (bucket->key == key)
+    server_ght_rdlock(ht);
+    if ((table = ght_find(ht, key, &idx)))
+        ret = table->slots[idx].data;
+    server_ght_unlock(ht);
+    return ret;
+}
+
+void*
+server_ght_get_locked(server_ght_t* ht, u64 key)
+{
+    const ght_table_t* table;
+    ssize_t idx;
+
+    if ((table = ght_find(ht, key, &idx)))
+        return table->slots[idx].data;
+    return NULL;
+}
+
+size_t
+server_ght_get_batch(server_ght_t* ht, const u32* keys, size_t n, void** out)
+{
+    const ght_table_t* table;
+    size_t found = 0;
+    ssize_t idx;
+
+    server_ght_rdlock(ht);
+    for (size_t i = 0; i < n; i++)
     {
-        ret = bucket->data;        
-        goto unlock;
+        if ((table = ght_find(ht, keys[i], &idx)))
+        {
+            out[i] = table->slots[idx].data;
+            found++;
+        }
+        else
+            out[i] = NULL;
     }
-    while (bucket && bucket->key != key)
-        bucket = bucket->next;
-    if (bucket)
-        ret = bucket->data;
-unlock:
     server_ght_unlock(ht);
-    return ret;
+    return found;
 }
 
-bool    
+bool
 server_ght_del(server_ght_t* ht, u64 key)
 {
-    ght_bucket_t* bucket;
-    ght_bucket_t* prev;
-    size_t idx;
-    bool ret = true;
+    ght_table_t* table;
+    ssize_t idx;
 
     server_ght_lock(ht);
-    idx = ght_hash(ht, key);
-    bucket = ht->table + idx;
-    if (bucket->key == key)
-    {
-        ght_del_bucket(ht, bucket);
-        goto unlock;
-    }
-    prev = bucket;
-    while ((bucket = bucket->next))
+    if ((table = ght_find(ht, key, &idx)))
     {
-        if (bucket->key == key)
-        {
-            prev->next = NULL;
-            ght_del_bucket(ht, bucket);
-            goto unlock;
-        }
-        prev = bucket;
+        if (ht->free)
+            ht->free(table->slots[idx].data);
+        ght_table_del(table, idx);
+        ht->count--;
+        ght_calc_load(ht);
+        ght_migrate(ht, GHT_MIGRATE_SLOTS);
+        ght_check_load(ht);
     }
-    ret = false;
-unlock:
     server_ght_unlock(ht);
-    return ret;
+    return table != NULL;
 }
 
 void
 server_ght_clear(server_ght_t* ht)
 {
-    ght_bucket_t* next;
-    ght_bucket_t* bucket;
+    ght_table_t* tables[] = { &ht->table, &ht->old };
 
     server_ght_lock(ht);
-    for (size_t i = 0; i < ht->size; i++)
+    for (size_t t = 0; t < 2; t++)
     {
-        bucket = ht->table + i;
-        while (bucket && bucket->data)
+        for (size_t i = 0; i < tables[t]->size; i++)
         {
-            if (ht->free)
-                ht->free(bucket->data);
-
-            next = bucket->next;
-            if (bucket->inheap)
-                free(bucket);
-            bucket = next;
+            if (tables[t]->slots[i].data && ht->free)
+                ht->free(tables[t]->slots[i].data);
         }
     }
+    memset(ht->table.slots, 0, ht->table.size * sizeof(ght_slot_t));
+    ght_table_free(&ht->old);
+    ht->migrate_left = 0;
     ht->count = 0;
     ht->load = 0.0;
     server_ght_unlock(ht);
@@ -300,10 +412,10 @@ server_ght_clear(server_ght_t* ht)
 void
 server_ght_destroy(server_ght_t* ht)
 {
-    if (ht->table == NULL)
+    if (ht->table.slots == NULL)
         return;
 
     server_ght_clear(ht);
-    pthread_mutex_destroy(&ht->mutex);
-    free(ht->table);
+    pthread_rwlock_destroy(&ht->lock);
+    ght_table_free(&ht->table);
 }
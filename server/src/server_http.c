@@ -1,90 +1,149 @@
 #include "server_http.h"
 #include "server.h"
 
-#define NAME_CMP(x) !strncmp(header->name, x, HTTP_HEAD_NAME_LEN)
+#define NAME_CMP(x) !strcasecmp(header->name, x)
 
-http_to_str_t 
-http_to_str(const http_t* http)
+static inline char*
+http_put(char* ptr, const char* str, size_t len)
 {
-    http_to_str_t to_str;
-    size_t size;
+    memcpy(ptr, str, len);
+    return ptr + len;
+}
+#define HTTP_PUT_LIT(ptr, lit) http_put(ptr, lit, sizeof(lit) - 1)
+
+static char*
+http_put_u64(char* ptr, u64 val)
+{
+    char tmp[20];
+    size_t n = 0;
+
+    do {
+        tmp[n++] = '0' + val % 10;
+        val /= 10;
+    } while (val);
+    while (n)
+        *ptr++ = tmp[--n];
+    return ptr;
+}
 
-#define HEADER_LINE_LEN (sizeof(http_header_t) + sizeof(HTTP_NL) + sizeof(": "))
+/* Upper bound of http_build_head(). */
+static size_t
+http_head_size(const http_t* http)
+{
+    /* Status line numbers, Content-Length and Connection templates, empty line */
+    size_t size = 160;
 
-    size = (HEADER_LINE_LEN * http->n_headers) + sizeof(HTTP_END);
     if (http->type == HTTP_REQUEST)
-        size += sizeof(http_req_t);
+        size += strlen(http->req.method) + strlen(http->req.url) + strlen(http->req.version);
     else
-        size += sizeof(http_resp_t);
-
-    if (http->body)
-        size += http->body_len;
-    
-    to_str.max = size;
-    to_str.str = calloc(1, size);
+        size += strlen(http->resp.version) + strlen(http->resp.msg);
+    for (size_t i = 0; i < http->n_headers; i++)
+        size += http->headers[i].name_len + http->headers[i].val_len + sizeof(": " HTTP_NL);
+    return size;
+}
 
+/* 
+ * Status line, headers, then the Connection and Content-Length lines
+ * from templates. memcpy() only, header lengths are already known.
+ */
+static size_t
+http_build_head(const http_t* http, const client_t* client, char* buf)
+{
+    const http_header_t* header;
+    char* ptr = buf;
 
     if (http->type == HTTP_REQUEST)
-        snprintf(to_str.str, size, "%s %s %s" HTTP_NL, http->req.method, http->req.url, http->req.version);
+    {
+        ptr = http_put(ptr, http->req.method, strlen(http->req.method));
+        *ptr++ = ' ';
+        ptr = http_put(ptr, http->req.url, strlen(http->req.url));
+        *ptr++ = ' ';
+        ptr = http_put(ptr, http->req.version, strlen(http->req.version));
+    }
     else
-        snprintf(to_str.str, size, "%s %u %s" HTTP_NL, http->resp.version, http->resp.code, http->resp.msg);
+    {
+        ptr = http_put(ptr, http->resp.version, strlen(http->resp.version));
+        *ptr++ = ' ';
+        ptr = http_put_u64(ptr, http->resp.code);
+        *ptr++ = ' ';
+        ptr = http_put(ptr, http->resp.msg, strlen(http->resp.msg));
+    }
+    ptr = HTTP_PUT_LIT(ptr, HTTP_NL);
 
     for (size_t i = 0; i < http->n_headers; i++)
     {
-        const http_header_t* header = &http->headers[i];
-        if (header->name[0] == 0x00 || header->val[0] == 0x00)
-            continue;
-
-        char header_line[HEADER_LINE_LEN];
-        snprintf(header_line, HEADER_LINE_LEN, "%s: %s%s", 
-            header->name,
-            header->val, 
-            (i + 1 >= http->n_headers) ? "" : HTTP_NL // New line or not
-        );
-        strcat(to_str.str, header_line);
+        header = http->headers + i;
+        ptr = http_put(ptr, header->name, header->name_len);
+        ptr = HTTP_PUT_LIT(ptr, ": ");
+        ptr = http_put(ptr, header->val, header->val_len);
+        ptr = HTTP_PUT_LIT(ptr, HTTP_NL);
     }
 
-    strcat(to_str.str, HTTP_END);
-    size_t current_len = strnlen(to_str.str, to_str.max);
-    if (http->body)
-        memcpy(to_str.str + current_len, http->body, http->body_len);
+    if (http->type == HTTP_RESPOND && http->resp.code >= 200)
+    {
+        if (client->state & CLIENT_STATE_KEEP_ALIVE)
+        {
+            ptr = HTTP_PUT_LIT(ptr, "Connection: keep-alive" HTTP_NL);
+            if (client->idle_timer)
+            {
+                ptr = HTTP_PUT_LIT(ptr, "Keep-Alive: timeout=");
+                ptr = http_put_u64(ptr, client->ew->server->conf.idle_timeout);
+                ptr = HTTP_PUT_LIT(ptr, HTTP_NL);
+            }
+        }
+        else
+            ptr = HTTP_PUT_LIT(ptr, "Connection: close" HTTP_NL);
+    }
 
-    to_str.len = current_len + http->body_len;
+    /* 1xx and 304 responses have no body. */
+    if (http->type == HTTP_REQUEST || 
+        (http->resp.code >= 200 && http->resp.code != HTTP_CODE_NOT_MODIFIED))
+    {
+        ptr = HTTP_PUT_LIT(ptr, HTTP_HEAD_CONTENT_LEN ": ");
+        ptr = http_put_u64(ptr, http->body_len);
+        ptr = HTTP_PUT_LIT(ptr, HTTP_NL);
+    }
 
-    return to_str;
+    ptr = HTTP_PUT_LIT(ptr, HTTP_NL);
+    return ptr - buf;
 }
 
 static void 
-set_client_connection(client_t* client, http_header_t* header)
+set_client_connection(client_t* client, const http_header_t* header)
 {
-    char* connection;
-    char* saveptr;
-    char* token;
-
-    connection = header->val;
-    token = strtok_r(connection, ", ", &saveptr);
+#define TOKEN_IS(x) (len == sizeof(x) - 1 && !strncasecmp(token, x, len))
+    const char* token = header->val;
+    size_t len;
 
-    while (token)
+    /* Tokens are matched in place, the value in the receive buffer stays as is. */
+    for (;;)
     {
-        if (!strncmp(token, "keep-alive", HTTP_HEAD_VAL_LEN))
+        token += strspn(token, ", ");
+        if ((len = strcspn(token, ", ")) == 0)
+            break;
+
+        if (TOKEN_IS("keep-alive"))
             client->state |= CLIENT_STATE_KEEP_ALIVE;
-        else if (!strncmp(token, "close", HTTP_HEAD_VAL_LEN))
-            client->state = CLIENT_STATE_SHORT_LIVE;
-        else if (!strncmp(token, "Upgrade", HTTP_HEAD_VAL_LEN))
+        else if (TOKEN_IS("close"))
+            client->state &= ~CLIENT_STATE_KEEP_ALIVE;
+        else if (TOKEN_IS("Upgrade"))
             client->state |= CLIENT_STATE_UPGRADE_PENDING;
         else
-            warn("HTTP Connection: '%s' not implemented.\n", token);
+            warn("HTTP Connection: '%.*s' not implemented.\n", (i32)len, token);
 
-        token = strtok_r(NULL, ", ", &saveptr);
+        token += len;
     }
+#undef TOKEN_IS
 }
 
 static void 
-handle_http_upgrade(client_t* client, http_header_t* header)
+handle_http_upgrade(client_t* client, const http_header_t* header)
 {
-    if (client->state & CLIENT_STATE_UPGRADE_PENDING)
+    if (header == NULL)
+        warn("Client fd:%d upgrade without Upgrade header.\n", client->addr.sock);
+    else if (client->state & CLIENT_STATE_UPGRADE_PENDING)
     {
-        if (!strncmp(header->val, "websocket", HTTP_HEAD_VAL_LEN))
+        if (!strcasecmp(header->val, "websocket"))
         {
             client->state |= CLIENT_STATE_WEBSOCKET;
         }
@@ -105,171 +164,205 @@ handle_websocket_key(http_t* http, http_header_t* header)
     http->websocket_key = server_compute_websocket_key(header->val);
 }
 
-static void 
+/* 
+ * Digits only: strtoull() would take a sign, spaces and garbage after,
+ * and a body length both sides disagree on smuggles requests.
+ */
+static bool
 http_handle_content_len(http_t* http, http_header_t* header)
 {
-    char* endptr;
-    http->body_len = strtoull(header->val, &endptr, 10);
-    
-    if ((errno == ERANGE && (http->body_len == ULONG_MAX)) || (errno != 0 && http->body_len == 0))
-    {
-        error("HTTP Content-Length: '%s' failed to convert to uint64_t: %s\n",
-            header->val, ERRSTR);
-    }
+    size_t len = 0;
+    const char* ptr = header->val;
 
-    if (endptr == header->val)
+    if (*ptr == 0)
+        goto err;
+    for (; *ptr; ptr++)
     {
-        error("HTTP strtoull: No digits were found.\n");
+        if (*ptr < '0' || *ptr > '9' || len > (SIZE_MAX - 9) / 10)
+            goto err;
+        len = len * 10 + (*ptr - '0');
     }
+    http->body_len = len;
+    return true;
+err:
+    warn("HTTP Content-Length: '%s' invalid.\n", header->val);
+    return false;
 }
 
-static void 
+static bool
 handle_http_header(client_t* client, http_t* http, http_header_t* header)
 {
-    if (NAME_CMP("Content-Length"))
-        http_handle_content_len(http, header);
+    if (NAME_CMP(HTTP_HEAD_CONTENT_LEN))
+        return http_handle_content_len(http, header);
     else if (NAME_CMP("Connection"))
         set_client_connection(client, header);
     else if (NAME_CMP("Sec-WebSocket-Key"))
         handle_websocket_key(http, header);
+    return true;
 }
 
 static void 
 parse_url(http_t* http, char* url)
 {
-    char* path;
     char* params_line;
     char* param;
-    char* endptr;
+    char* val;
+    http_header_t* http_param;
 
-    path = strtok_r(url, "?", &params_line);
-    
-    if (*params_line)
-    {
-        param = strtok_r(params_line, "&", &endptr);
-
-        while (param && http->n_params < HTTP_MAX_PARAMS)
-        {
-            char* key;
-            char* val;
-            http_header_t* http_param = http->params + http->n_params;
+    http->req.url = url;
 
-            key = strtok_r(param, "=", &val);
+    if ((params_line = strchr(url, '?')) == NULL)
+        return;
+    *params_line++ = 0x00;
 
-            strncpy(http_param->name, key, HTTP_HEAD_NAME_LEN);
-            strncpy(http_param->val, val, HTTP_HEAD_VAL_LEN);
+    while ((param = strsep(&params_line, "&")) && http->n_params < HTTP_MAX_PARAMS)
+    {
+        http_param = http->params + http->n_params;
+        val = strchr(param, '=');
+        if (val)
+            *val++ = 0x00;
+        else
+            val = param + strlen(param);
 
-            param = strtok_r(NULL, "&", &endptr);
-            http->n_params++;
-        }
+        http_param->name = param;
+        http_param->name_len = val - param;
+        http_param->val = val;
+        http_param->val_len = strlen(val);
+        http->n_params++;
     }
-
-    strncpy(http->req.url, path, HTTP_URL_LEN);
 }
 
-static http_t* 
-parse_http(client_t* client, char* buf, size_t buf_len) 
+/*
+ * return: Length of the head up to and including the empty line,
+ * 0 if it's not complete. Only bytes after `seen` are new, searching
+ * starts just before them in case "\r\n\r\n" was split between reads.
+ */
+static size_t
+http_head_len(const char* buf, size_t buf_len, size_t seen)
 {
-    http_t* http;
-    char* saveptr;
-    char* token;
-    char* header;
-    char* header_line;
-    size_t header_len;
-    size_t actual_body_len;
+    const char* end;
+    const size_t start = (seen > 3) ? seen - 3 : 0;
 
-    http = calloc(1, sizeof(http_t));
+    if (buf_len <= start)
+        return 0;
 
-    header = strsplit(buf, HTTP_END, &saveptr);
-    if (!header)
-    {
-        warn("parse_http first token is NULL!?!\n");
-        free(http);
+    end = memmem(buf + start, buf_len - start, HTTP_END, sizeof(HTTP_END) - 1);
+    if (end == NULL)
+        return 0;
+    return (end - buf) + sizeof(HTTP_END) - 1;
+}
+
+/* NUL-terminate the line at `*pos` and move past it. */
+static char*
+http_next_line(char* buf, size_t head_len, size_t* pos)
+{
+    char* line = buf + *pos;
+    char* nl;
+
+    nl = memchr(line, '\n', head_len - *pos);
+    if (nl == NULL)
         return NULL;
-    }
+    *pos = (nl - buf) + 1;
 
-    http->body = strsplit(NULL, HTTP_END, &saveptr);
+    if (nl > line && nl[-1] == '\r')
+        nl--;
+    *nl = 0x00;
+    return line;
+}
 
-    header_len = strlen(header) + strlen(HTTP_END);
-    if (http->body)
-        actual_body_len = buf_len - header_len;
-    else
-        actual_body_len = 0;
+static bool
+parse_start_line(http_t* http, char* line)
+{
+    char* first;
+    char* second;
 
-    header_line = strsplit(header, HTTP_NL, &saveptr);
+    first = strsep(&line, " ");
+    second = strsep(&line, " ");
+    if (!*first || !second || !*second || !line || !*line)
+        return false;
 
-    token = strtok(header_line, " ");
-    if (token)
+    if (!strncmp(first, "HTTP/", 5))
     {
-        if (strstr(token, "HTTP/"))
-        {
-            http->type = HTTP_RESPOND;
-            strncpy(http->resp.version, token, HTTP_VERSION_LEN);
-        }
-        else
-        {
-            http->type = HTTP_REQUEST;
-            strncpy(http->req.method, token, HTTP_METHOD_LEN);
-        }
+        http->type = HTTP_RESPOND;
+        http->resp.version = first;
+        http->resp.code = atoi(second);
+        http->resp.msg = line;
     }
     else
     {
-        free(http);
-        return NULL;
+        http->type = HTTP_REQUEST;
+        http->req.method = first;
+        http->req.version = line;
+        parse_url(http, second);
     }
+    return true;
+}
 
-    token = strtok(NULL, " ");
-    if (token)
-    {
-        if (http->type == HTTP_REQUEST)
-            parse_url(http, token);
-        else
-            http->resp.code = atoi(token);
-    }
+static bool
+parse_header_line(http_t* http, char* line, size_t len)
+{
+    http_header_t* header;
+    char* colon;
+    char* val;
+    char* end = line + len;
 
-    token = strtok(NULL, HTTP_NL);
-    if (token)
+    colon = memchr(line, ':', len);
+    if (colon == NULL || colon == line)
+        return false;
+
+    if (http->n_headers >= HTTP_MAX_HEADERS)
     {
-        if (http->type == HTTP_REQUEST)
-            strncpy(http->req.version, token, HTTP_METHOD_LEN);
-        else
-            strncpy(http->resp.msg, token, HTTP_STATUS_MSG_LEN);
+        warn("HTTP more than %d headers, ignoring '%.*s'.\n", 
+             HTTP_MAX_HEADERS, (i32)(colon - line), line);
+        return true;
     }
 
-    header_line = strsplit(NULL, HTTP_NL, &saveptr);
+    val = colon + 1;
+    while (val < end && (*val == ' ' || *val == '\t'))
+        val++;
+    while (end > val && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *colon = 0x00;
+    *end = 0x00;
+
+    header = http->headers + http->n_headers++;
+    header->name = line;
+    header->name_len = colon - line;
+    header->val = val;
+    header->val_len = end - val;
+    return true;
+}
 
-    while (header_line)
-    {
-        http_header_t* http_header = &http->headers[http->n_headers];
-        char* name;
-        char* val;
+/*
+ * Parse the `head_len` byte head at `buf` in place into `http`.
+ * return: false if it's malformed.
+ */
+static bool
+parse_http(client_t* client, http_t* http, char* buf, size_t head_len)
+{
+    size_t pos = 0;
+    char* line;
 
-        token = strtok(header_line, ": ");
-        if (!token)
-            break;
-        name = token;
+    http->header_len = head_len;
 
-        token = strtok(NULL, "");
-        if (!token)
-            break;
-        if (*token == ' ')
-            token++;
-        val = token;
+    line = http_next_line(buf, head_len, &pos);
+    if (!line || !parse_start_line(http, line))
+        return false;
 
-        strncpy(http_header->name, name, HTTP_HEAD_NAME_LEN);
-        strncpy(http_header->val, val, HTTP_HEAD_VAL_LEN);
+    /* HTTP/1.1 is persistent unless "Connection: close", 1.0 the opposite. */
+    client->state &= ~CLIENT_STATE_KEEP_ALIVE;
+    if (http->type == HTTP_REQUEST && !strcmp(http->req.version, HTTP_VERSION))
+        client->state |= CLIENT_STATE_KEEP_ALIVE;
 
-        header_line = strsplit(NULL, HTTP_NL, &saveptr);
-        http->n_headers++;
-        if (http->n_headers >= HTTP_MAX_HEADERS)
-        {
-            http->n_headers = HTTP_MAX_HEADERS - 1;
-            break;
-        }
+    while ((line = http_next_line(buf, head_len, &pos)) && *line)
+    {
+        if (!parse_header_line(http, line, strlen(line)))
+            return false;
     }
 
     for (size_t i = 0; i < http->n_headers; i++)
-        handle_http_header(client, http, &http->headers[i]);
+        if (handle_http_header(client, http, &http->headers[i]) == false)
+            return false;
 
     if (client->state & CLIENT_STATE_UPGRADE_PENDING)
     {
@@ -281,21 +374,7 @@ parse_http(client_t* client, char* buf, size_t buf_len)
         );
     }
 
-    if (http->body || http->body_len)
-    {
-        if (http->body_len > actual_body_len)
-        {
-            http->buf.missing = true;
-            http->buf.total_recv = actual_body_len;
-            char* new_body = calloc(1, http->body_len);
-            memcpy(new_body, http->body, actual_body_len);
-            http->body = new_body;
-            http->body_inheap = true;
-            client->recv.http = http;
-        }
-    }
-
-    return http;
+    return true;
 }
 
 void 
@@ -324,7 +403,7 @@ print_parsed_http(const http_t* http)
     }
 
     if (http->body)
-        verbose("BODY (strlen: %zu, http: %zu):\t'%s'\n", strlen(http->body), http->body_len, (http->body) ? http->body : "NULL");
+        verbose("BODY (%zu):\t'%.*s'\n", http->body_len, (i32)http->body_len, http->body);
 }
 
 void 
@@ -334,11 +413,91 @@ http_free(http_t* http)
         return;
 
     if (http->body && http->body_inheap)
-        free(http->body);
+        free((char*)http->body);
 
+    http_upload_free(http->upload);
+    free(http->websocket_key);
     free(http);
 }
 
+static http_upload_t*
+http_upload_new(const char* dir)
+{
+    http_upload_t* upload = malloc(sizeof(http_upload_t));
+
+    upload->path = malloc(PATH_MAX);
+    snprintf(upload->path, PATH_MAX, "%s/" HTTP_UPLOAD_TMP_DIR "/upload-XXXXXX", dir);
+    upload->fd = mkostemp(upload->path, O_CLOEXEC);
+    if (upload->fd == -1)
+    {
+        error("Upload temp file '%s': %s\n", upload->path, ERRSTR);
+        free(upload->path);
+        free(upload);
+        return NULL;
+    }
+    SHA256_Init(&upload->sha256);
+    upload->size = 0;
+    upload->head_len = 0;
+
+    return upload;
+}
+
+static bool
+http_upload_write(http_upload_t* upload, const u8* data, size_t len)
+{
+    size_t head;
+    ssize_t n;
+
+    SHA256_Update(&upload->sha256, data, len);
+    if (upload->head_len < HTTP_SNIFF_LEN)
+    {
+        head = HTTP_SNIFF_LEN - upload->head_len;
+        if (head > len)
+            head = len;
+        memcpy(upload->head + upload->head_len, data, head);
+        upload->head_len += head;
+    }
+
+    while (len)
+    {
+        if ((n = write(upload->fd, data, len)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error("Upload write '%s': %s\n", upload->path, ERRSTR);
+            return false;
+        }
+        data += n;
+        len -= n;
+        upload->size += n;
+    }
+    return true;
+}
+
+void
+http_upload_finish(http_upload_t* upload, char* hash)
+{
+    server_sha256_final_str(&upload->sha256, hash);
+    close(upload->fd);
+    upload->fd = -1;
+}
+
+void
+http_upload_free(http_upload_t* upload)
+{
+    if (!upload)
+        return;
+
+    if (upload->fd != -1)
+        close(upload->fd);
+    if (upload->path)
+    {
+        unlink(upload->path);
+        free(upload->path);
+    }
+    free(upload);
+}
+
 http_header_t* 
 http_get_header(const http_t* http, const char* name)
 {
@@ -353,6 +512,200 @@ http_get_header(const http_t* http, const char* name)
     return NULL;
 }
 
+static i32
+http_encoding_from_name(const char* name, size_t len)
+{
+#define ENC_CMP(x) (len == sizeof(x) - 1 && !strncasecmp(name, x, len))
+    if (ENC_CMP("gzip") || ENC_CMP("x-gzip"))
+        return HTTP_ENC_GZIP;
+    else if (ENC_CMP("br"))
+        return HTTP_ENC_BR;
+    else if (ENC_CMP("identity"))
+        return HTTP_ENC_IDENTITY;
+    return -1;
+#undef ENC_CMP
+}
+
+u32
+http_accept_encoding(const http_t* http)
+{
+    const http_header_t* header = http_get_header(http, HTTP_HEAD_ACCEPT_ENC);
+    const u32 all = (1 << HTTP_ENC_COUNT) - 1;
+    u32 accept = 1 << HTTP_ENC_IDENTITY;
+    u32 listed = 0;
+    bool star = false;
+    bool ok;
+    const char* ptr;
+    const char* end;
+    const char* q;
+    size_t len;
+    i32 enc;
+
+    if (header == NULL)
+        return accept;
+
+    /* "gzip, deflate, br;q=0.5, *;q=0" */
+    for (ptr = header->val; *ptr; ptr = (*end) ? end + 1 : end)
+    {
+        ptr += strspn(ptr, " \t");
+        end = strchr(ptr, ',');
+        if (end == NULL)
+            end = ptr + strlen(ptr);
+        len = strcspn(ptr, ";, \t");
+        if (len > (size_t)(end - ptr))
+            len = end - ptr;
+
+        q = memmem(ptr, end - ptr, "q=", 2);
+        ok = !(q && strtod(q + 2, NULL) <= 0.0);
+
+        if (len == 1 && *ptr == '*')
+        {
+            star = ok;
+            continue;
+        }
+        if ((enc = http_encoding_from_name(ptr, len)) == -1)
+            continue;
+        listed |= 1 << enc;
+        if (ok)
+            accept |= 1 << enc;
+        else
+            accept &= ~(1 << enc);
+    }
+    if (star)
+        accept |= all & ~listed;
+
+    return accept;
+}
+
+/* Weak comparison, as If-None-Match wants. */
+static bool
+http_etag_match(const char* list, const char* etag)
+{
+    const char* ptr = list;
+    size_t len;
+
+    if (!strncmp(etag, "W/", 2))
+        etag += 2;
+    len = strlen(etag);
+
+    while (*ptr)
+    {
+        ptr += strspn(ptr, " \t,");
+        if (*ptr == '*')
+            return true;
+        if (!strncmp(ptr, "W/", 2))
+            ptr += 2;
+        if (!strncmp(ptr, etag, len) && strchr(" \t,", ptr[len]))
+            return true;
+        ptr += strcspn(ptr, ",");
+    }
+    return false;
+}
+
+bool
+http_not_modified(const http_t* req, const http_cache_t* cache)
+{
+    const http_header_t* header;
+    struct tm tm;
+
+    /* If-None-Match wins, If-Modified-Since is only for old clients. */
+    if ((header = http_get_header(req, "If-None-Match")))
+        return http_etag_match(header->val, cache->etag);
+
+    if ((header = http_get_header(req, "If-Modified-Since")))
+    {
+        memset(&tm, 0, sizeof(struct tm));
+        if (strptime(header->val, HTTP_DATE_FMT, &tm) == NULL)
+            return false;
+        return cache->mtime <= timegm(&tm);
+    }
+    return false;
+}
+
+/* If-Range takes one strong ETag or the exact Last-Modified date. */
+static bool
+http_if_range_match(const char* val, const http_cache_t* cache)
+{
+    struct tm tm;
+
+    if (*val == '"' || !strncmp(val, "W/", 2))
+        return !strcmp(val, cache->etag);
+
+    memset(&tm, 0, sizeof(struct tm));
+    if (strptime(val, HTTP_DATE_FMT, &tm) == NULL)
+        return false;
+    return cache->mtime == timegm(&tm);
+}
+
+/* Digits only, strtoull() would also take spaces and signs. */
+static bool
+http_parse_size(const char* str, const char** end, size_t* val)
+{
+    if (*str < '0' || *str > '9')
+        return false;
+    errno = 0;
+    *val = strtoull(str, (char**)end, 10);
+    return errno == 0;
+}
+
+enum http_range_status 
+http_get_range(const http_t* req, const http_cache_t* cache, size_t size, 
+               http_range_t* range)
+{
+    const http_header_t* header = http_get_header(req, "Range");
+    const http_header_t* if_range;
+    const char* spec;
+    const char* end;
+    size_t first;
+    size_t last;
+
+    if (header == NULL || strncasecmp(header->val, "bytes=", 6))
+        return HTTP_RANGE_NONE;
+    if ((if_range = http_get_header(req, "If-Range")) && 
+        http_if_range_match(if_range->val, cache) == false)
+        return HTTP_RANGE_NONE;
+
+    /* 
+     * Multiple ranges would need multipart/byteranges, the whole file
+     * is just as valid an answer.
+     */
+    spec = header->val + 6;
+    if (strchr(spec, ','))
+        return HTTP_RANGE_NONE;
+    spec += strspn(spec, " \t");
+
+    if (*spec == '-')
+    {
+        /* Suffix: last N bytes. */
+        if (!http_parse_size(spec + 1, &end, &last) || *end)
+            return HTTP_RANGE_NONE;
+        if (last == 0 || size == 0)
+            return HTTP_RANGE_UNSATISFIABLE;
+        first = (last < size) ? size - last : 0;
+        last = size - 1;
+    }
+    else
+    {
+        if (!http_parse_size(spec, &end, &first) || *end != '-')
+            return HTTP_RANGE_NONE;
+        spec = end + 1;
+        if (*spec == '\0')
+            last = SIZE_MAX;
+        else if (!http_parse_size(spec, &end, &last) || *end || last < first)
+            return HTTP_RANGE_NONE;
+
+        if (first >= size)
+            return HTTP_RANGE_UNSATISFIABLE;
+        if (last >= size)
+            last = size - 1;
+    }
+
+    range->start = first;
+    range->len = last - first + 1;
+    return HTTP_RANGE_OK;
+}
+
+/* `name` and `val` are not copied. */
 static void 
 http_add_header(http_t* http, const char* name, const char* val)
 {
@@ -364,7 +717,7 @@ http_add_header(http_t* http, const char* name, const char* val)
     for (size_t i = 0; i < http->n_headers; i++)
     {
         http_header_t* header = http->headers + i;
-        if (NAME_CMP(name) || header->name[0] == 0x00 || header->val[0] == 0x00)
+        if (NAME_CMP(name))
         {
             to_header = header;
             break;
@@ -383,8 +736,10 @@ http_add_header(http_t* http, const char* name, const char* val)
         http->n_headers++;
     }
 
-    strncpy(to_header->name, name, HTTP_HEAD_NAME_LEN);
-    strncpy(to_header->val, val, HTTP_HEAD_VAL_LEN);
+    to_header->name = name;
+    to_header->name_len = strlen(name);
+    to_header->val = val;
+    to_header->val_len = strlen(val);
 }
 
 static void 
@@ -402,9 +757,15 @@ server_upgrade_client_to_websocket(client_t* client, http_t* req_http)
     }
 
     if (http_send(client, http) != -1)
+    {
         client->state |= CLIENT_STATE_WEBSOCKET;
+        /* WebSocket clients can be quiet for long, no idle timeout. */
+        server_timer_cancel(client->idle_timer);
+        client->idle_timer = NULL;
+    }
     http_free(http);
     free(req_http->websocket_key);
+    req_http->websocket_key = NULL;
 }
 
 static void 
@@ -418,26 +779,21 @@ server_handle_client_upgrade(client_t* client, http_t* http)
         return;
     }
 
-    if (!strncmp(upgrade->val, "websocket", HTTP_HEAD_VAL_LEN))
+    if (!strcasecmp(upgrade->val, "websocket"))
         server_upgrade_client_to_websocket(client, http);
     else
-        warn("Connection upgrade '%s' not implemented.\n", upgrade);
+        warn("Connection upgrade '%s' not implemented.\n", upgrade->val);
 
     client->state ^= CLIENT_STATE_UPGRADE_PENDING;
 }
 
+/* Not copied, `body` must outlive http_send(). */
 static void 
 http_add_body(http_t* restrict http, const char* restrict body, size_t body_len)
 {
-    http->body = calloc(1, body_len);
-    memcpy(http->body, body, body_len);
-    http->body_inheap = true;
+    http->body = body;
+    http->body_inheap = false;
     http->body_len = body_len;
-
-    char val[HTTP_HEAD_VAL_LEN];
-    snprintf(val, HTTP_HEAD_VAL_LEN, "%zu", body_len);
-
-    http_add_header(http, HTTP_HEAD_CONTENT_LEN, val);
 }
 
 http_t* 
@@ -447,8 +803,8 @@ http_new_resp(u16 code, const char* status_msg, const char* body, size_t body_le
 
     http->type = HTTP_RESPOND;
     http->resp.code = code;
-    strncpy(http->resp.msg, status_msg, HTTP_STATUS_MSG_LEN);
-    strncpy(http->resp.version, HTTP_VERSION, HTTP_VERSION_LEN);
+    http->resp.msg = status_msg;
+    http->resp.version = HTTP_VERSION;
 
     http_add_header(http, "Server", SERVER_NAME);
 
@@ -469,6 +825,88 @@ server_http_resp_ok(client_t* client, char* content, size_t content_len, const c
     http_free(http);
 }
 
+/* `date` must outlive http_send(). */
+static void
+http_add_cache_headers(http_t* http, const http_cache_t* cache, char* date, size_t date_size)
+{
+    struct tm tm;
+
+    gmtime_r(&cache->mtime, &tm);
+    strftime(date, date_size, HTTP_DATE_FMT, &tm);
+
+    http_add_header(http, "Last-Modified", date);
+    http_add_header(http, "ETag", cache->etag);
+    http_add_header(http, "Cache-Control", cache->cache_control);
+    if (cache->vary)
+        http_add_header(http, "Vary", HTTP_HEAD_ACCEPT_ENC);
+}
+
+void 
+server_http_resp_file(client_t* client, i32 fd, size_t size, const http_range_t* range,
+                      const char* content_type, const http_cache_t* cache)
+{
+    http_t* http;
+    const http_range_t whole = {
+        .start = 0,
+        .len = size
+    };
+    char date[64];
+    char content_range[64];
+
+    if (range)
+    {
+        http = http_new_resp(HTTP_CODE_PARTIAL, "Partial Content", NULL, 0);
+        snprintf(content_range, sizeof(content_range), "bytes %zu-%zu/%zu",
+                 range->start, range->start + range->len - 1, size);
+        http_add_header(http, "Content-Range", content_range);
+    }
+    else
+    {
+        http = http_new_resp(HTTP_CODE_OK, "OK", NULL, 0);
+        range = &whole;
+    }
+
+    http_add_header(http, HTTP_HEAD_CONTENT_TYPE, content_type);
+    http_add_header(http, "Accept-Ranges", "bytes");
+    if (cache)
+        http_add_cache_headers(http, cache, date, sizeof(date));
+    /* Head only, the body follows from the file. */
+    http->body_len = range->len;
+
+    if (http_send(client, http) == -1)
+        close(fd);
+    else
+        server_send_file(client, fd, range->start, range->len);
+
+    http_free(http);
+}
+
+void 
+server_http_resp_range_not_satisfiable(client_t* client, size_t size)
+{
+    http_t* http = http_new_resp(HTTP_CODE_RANGE_NOT_SATISFIABLE, "Range Not Satisfiable", 
+                                 NULL, 0);
+    char content_range[64];
+
+    snprintf(content_range, sizeof(content_range), "bytes */%zu", size);
+    http_add_header(http, "Content-Range", content_range);
+    http_send(client, http);
+
+    http_free(http);
+}
+
+void 
+server_http_resp_not_modified(client_t* client, const http_cache_t* cache)
+{
+    http_t* http = http_new_resp(HTTP_CODE_NOT_MODIFIED, "Not Modified", NULL, 0);
+    char date[64];
+
+    http_add_cache_headers(http, cache, date, sizeof(date));
+    http_send(client, http);
+
+    http_free(http);
+}
+
 void 
 server_http_resp_error(client_t* client, u16 error_code, const char* status_msg)
 {
@@ -505,14 +943,32 @@ server_http_url_checks(http_t* http)
         warn("GET URL '%s' very sus.\n", url);
         return -1;
     }
+    /* Hidden files, like upload temp files in img_dir/.tmp, aren't served. */
+    if (strstr(url, "/."))
+        return -1;
 
     return 0;
 }
 
+/* Not keep-alive, close now or once the response left the send queue. */
+static enum client_recv_status
+http_close_after_send(client_t* client)
+{
+    bool queued;
+
+    pthread_mutex_lock(&client->ssl_mutex);
+    queued = client->send.head != NULL;
+    if (queued)
+        client->state |= CLIENT_STATE_CLOSING;
+    pthread_mutex_unlock(&client->ssl_mutex);
+
+    return (queued) ? RECV_OK : RECV_DISCONNECT;
+}
+
 static enum client_recv_status 
 server_handle_http_req(eworker_t* th, client_t* client, http_t* http)
 {
-#define HTTP_CMP_METHOD(x) strncmp(http->req.method, x, HTTP_METHOD_LEN)
+#define HTTP_CMP_METHOD(x) strcmp(http->req.method, x)
     enum client_recv_status ret = RECV_OK;
 
     if (!HTTP_CMP_METHOD("GET"))
@@ -555,29 +1011,173 @@ server_handle_http(eworker_t* th, client_t* client, http_t* http)
         }
     }
 
-    http_free(http);
+    if (ret == RECV_OK && 
+        !(client->state & (CLIENT_STATE_KEEP_ALIVE | CLIENT_STATE_WEBSOCKET)))
+        ret = http_close_after_send(client);
 
     return ret;
 }
 
+/*
+ * A body costs a temp file, only authorized uploads within the size
+ * limit get one. Decided on the head, before a byte of it is stored.
+ * return: HTTP_CODE_OK or the error to answer with.
+ */
+static u16
+http_body_allowed(server_t* server, const http_t* http, const char** status_msg)
+{
+    if (http->type != HTTP_REQUEST || strcmp(http->req.method, "POST"))
+    {
+        *status_msg = "Bad Request";
+        return HTTP_CODE_BAD_REQ;
+    }
+    if (http->body_len > (size_t)server->conf.max_upload_mb * KIB * KIB)
+    {
+        *status_msg = "Payload Too Large";
+        return HTTP_CODE_PAYLOAD_TOO_LARGE;
+    }
+    if (server_http_post_allowed(server, http) == false)
+    {
+        *status_msg = "Upload-Token failed";
+        return HTTP_CODE_BAD_REQ;
+    }
+    return HTTP_CODE_OK;
+}
+
 enum client_recv_status 
 server_http_parse(eworker_t* th, client_t* client, u8* buf, size_t buf_len)
 {
-    http_t* http;
+    http_t http;
+    size_t head_len;
+    size_t body_recv;
+    size_t req_len;
+    u16 code;
+    const char* status_msg;
     enum client_recv_status ret = RECV_OK;
 
-    http = parse_http(client, (char*)buf, buf_len);
-    if (!http)
+    /* Pipelined requests after a "Connection: close" one are dropped. */
+    if (client->state & CLIENT_STATE_CLOSING)
     {
-        error("parse_http() returned NULL, deleting client.\n");
-        return RECV_ERROR;
+        client->recv.busy = false;
+        return RECV_OK;
     }
 
-    print_parsed_http(http);
+    for (;;)
+    {
+        head_len = http_head_len((const char*)buf, buf_len, client->recv.offset);
+        if (head_len == 0)
+            break;
+
+        memset(&http, 0, sizeof(http_t));
+        if (parse_http(client, &http, (char*)buf, head_len) == false)
+        {
+            free(http.websocket_key);
+            warn("Client fd:%d sent malformed HTTP.\n", client->addr.sock);
+            client->state &= ~CLIENT_STATE_KEEP_ALIVE;
+            server_http_resp_error(client, HTTP_CODE_BAD_REQ, "Bad Request");
+            return RECV_DISCONNECT;
+        }
+
+        print_parsed_http(&http);
+
+        /* Bodies go to disk as they arrive, never whole in memory. */
+        body_recv = 0;
+        if (http.body_len)
+        {
+            body_recv = buf_len - head_len;
+            if (body_recv > http.body_len)
+                body_recv = http.body_len;
+
+            code = http_body_allowed(th->server, &http, &status_msg);
+            if (code == HTTP_CODE_OK)
+            {
+                http.upload = http_upload_new(th->server->conf.img_dir);
+                if (http.upload == NULL || 
+                    http_upload_write(http.upload, buf + head_len, body_recv) == false)
+                {
+                    code = HTTP_CODE_INTERAL_ERROR;
+                    status_msg = "Internal Server Error";
+                }
+            }
+            if (code != HTTP_CODE_OK)
+            {
+                http_upload_free(http.upload);
+                free(http.websocket_key);
+                client->state &= ~CLIENT_STATE_KEEP_ALIVE;
+                server_http_resp_error(client, code, status_msg);
+                return RECV_DISCONNECT;
+            }
+
+            if (body_recv < http.body_len)
+            {
+                /* Headers point into the receive buffer, keep it too. */
+                http.buf.missing = true;
+                http.buf.total_recv = body_recv;
+                client->recv.http = malloc(sizeof(http_t));
+                memcpy(client->recv.http, &http, sizeof(http_t));
+                client->recv.busy = true;
+                return RECV_OK;
+            }
+        }
 
-    if (!http->buf.missing)
-        ret = server_handle_http(th, client, http);
+        ret = server_handle_http(th, client, &http);
 
+        http_upload_free(http.upload);
+        free(http.websocket_key);
+
+        req_len = head_len + body_recv;
+        client->recv.offset = 0;
+        if (ret != RECV_OK || req_len == buf_len ||
+            client->state & (CLIENT_STATE_CLOSING | CLIENT_STATE_WEBSOCKET))
+        {
+            client->recv.busy = false;
+            return ret;
+        }
+
+        /* Pipelined, next request is already here. */
+        buf_len -= req_len;
+        memmove(buf, buf + req_len, buf_len);
+    }
+
+    if (buf_len >= client->recv.data_size)
+    {
+        warn("Client fd:%d HTTP head over %zu bytes.\n", 
+             client->addr.sock, client->recv.data_size);
+        client->state &= ~CLIENT_STATE_KEEP_ALIVE;
+        server_http_resp_error(client, HTTP_CODE_HEAD_TOO_LARGE, 
+                               "Request Header Fields Too Large");
+        return RECV_DISCONNECT;
+    }
+
+    /* Partial head, keep it and append the next read to it. */
+    client->recv.offset = buf_len;
+    client->recv.busy = true;
+    return RECV_OK;
+}
+
+enum client_recv_status 
+server_http_recv_body(eworker_t* ew, client_t* client, size_t len)
+{
+    http_t* http = client->recv.http;
+    enum client_recv_status ret;
+
+    http->buf.total_recv += len;
+    verbose("HTTP recv: %zu/%zu\n", http->buf.total_recv, http->body_len);
+
+    if (http_upload_write(http->upload, http->upload->chunk, len) == false)
+    {
+        client->state &= ~CLIENT_STATE_KEEP_ALIVE;
+        server_http_resp_error(client, HTTP_CODE_INTERAL_ERROR, "Internal Server Error");
+        ret = RECV_DISCONNECT;
+    }
+    else if (http->buf.total_recv < http->body_len)
+        return RECV_OK;
+    else
+        ret = server_handle_http(ew, client, http);
+
+    http_free(http);
+    client->recv.http = NULL;
+    client->recv.busy = false;
     return ret;
 }
 
@@ -591,18 +1191,34 @@ http_send(client_t* client, http_t* http)
     }
 
     ssize_t bytes_sent = 0;
-    http_to_str_t to_str = http_to_str(http);
-
-    verbose("HTTP send to fd:%d (%s:%s), len: %zu\n%s\n", client->addr.sock, client->addr.ip_str, client->addr.serv, to_str.len, to_str.str);
-
-    if ((bytes_sent = server_send(client, to_str.str, to_str.len)) == -1)
+    char stack_buf[HTTP_RESP_BUF];
+    char* buf = stack_buf;
+    size_t head_len;
+    struct iovec iov[2];
+
+    /* Huge heads only, every normal response is built on the stack. */
+    if (http_head_size(http) > sizeof(stack_buf))
+        buf = malloc(http_head_size(http));
+    head_len = http_build_head(http, client, buf);
+
+    verbose("HTTP send to fd:%d (%s:%s), len: %zu\n%.*s\n", client->addr.sock, client->addr.ip_str, client->addr.serv, head_len + ((http->body) ? http->body_len : 0), (i32)head_len, buf);
+
+    /* The body goes out from where the caller has it, never copied. */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = (void*)http->body;
+    iov[1].iov_len = (http->body) ? http->body_len : 0;
+    bytes_sent = server_sendv(client, iov, 2);
+
+    if (bytes_sent == -1)
     {
         error("HTTP send to (fd: %d, IP: %s:%s): %s\n",
             client->addr.sock, client->addr.ip_str, client->addr.serv, ERRSTR
         );
     }
 
-    free(to_str.str);
+    if (buf != stack_buf)
+        free(buf);
 
     return bytes_sent;
 }
@@ -2,6 +2,59 @@
 #include "server_http.h"
 #include "server_util.h"
 
+/* return: the SHA-256 name of an upload, NULL if `path` isn't one. */
+static const char*
+http_upload_hash(const server_t* server, const char* path)
+{
+    const char* dirs[] = {
+        server->conf.img_dir, server->conf.vid_dir, server->conf.file_dir
+    };
+    const size_t hash_len = SERVER_HASH256_STR_SIZE - 1;
+    const char* name;
+    size_t len;
+
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(const char*); i++)
+    {
+        len = strlen(dirs[i]);
+        if (strncmp(path, dirs[i], len) || path[len] != '/')
+            continue;
+        name = path + len + 1;
+        if (strlen(name) == hash_len && strspn(name, "0123456789abcdef") == hash_len)
+            return name;
+    }
+    return NULL;
+}
+
+const char*
+server_http_file_etag(server_t* server, const char* path, const struct stat* st, 
+                      const char* suffix, char* etag)
+{
+    const char* hash;
+
+    if ((hash = http_upload_hash(server, path)))
+    {
+        snprintf(etag, HTTP_ETAG_LEN, "\"%s%s\"", hash, suffix);
+        return HTTP_CACHE_IMMUTABLE;
+    }
+
+    snprintf(etag, HTTP_ETAG_LEN, "\"%lx-%lx%s\"", (u64)st->st_size, 
+             (u64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec, suffix);
+    return HTTP_CACHE_REVALIDATE;
+}
+
+static bool
+http_stat(const char* path, struct stat* st)
+{
+    if (stat(path, st) == 0)
+        return true;
+
+    if (errno == ENOENT)
+        debug("stat on '%s': %s\n", path, ERRSTR);
+    else
+        error("stat on '%s': %s\n", path, ERRSTR);
+    return false;
+}
+
 enum client_recv_status 
 server_handle_http_get(server_t* server, client_t* client, http_t* http)
 {    
@@ -9,13 +62,21 @@ server_handle_http_get(server_t* server, client_t* client, http_t* http)
     memset(path, 0, PATH_MAX);
     i32 fd;
     size_t content_len;
-    char* content;
-    size_t url_len = strnlen(http->req.url, HTTP_URL_LEN);
+    struct stat st;
+    char etag[HTTP_ETAG_LEN];
+    http_cache_t cache;
+    http_range_t range;
+    enum http_range_status range_status;
+    bool ranged;
+    char sniff[HTTP_SNIFF_LEN];
+    ssize_t sniff_len;
+    fcache_file_t* file;
+    size_t url_len = strlen(http->req.url);
 
     if (server_http_url_checks(http) == -1)
     {
         server_http_resp_error(client, HTTP_CODE_NOT_FOUND, "Not found");
-        return RECV_ERROR;
+        return RECV_OK;
     }
 
     // TODO: Add "default_file_per_dir" config, default should be "index.html"
@@ -23,47 +84,91 @@ server_handle_http_get(server_t* server, client_t* client, http_t* http)
         snprintf(path, PATH_MAX, "%s%s%s", server->conf.root_dir, http->req.url, "index.html"); 
     else
         snprintf(path, PATH_MAX, "%s%s", server->conf.root_dir, http->req.url); 
+
+    /* Ranges are cut from the file, whatever its size. */
+    ranged = http_get_header(http, "Range") != NULL;
+
+    /* Cached: no stat(), open() or read(). */
+    if (!ranged && (file = server_fcache_get(&server->fcache, path)))
+        goto send_cached;
     
-    i32 isdir = file_isdir(path);
-    if (isdir == -1)
+    /* Also tells the cache what it can't hold, before it touches the file. */
+    if (http_stat(path, &st) == false)
     {
         server_http_resp_404_not_found(client);
-        return RECV_ERROR;
+        return RECV_OK;
     }
-    else if (isdir)
+    if (S_ISDIR(st.st_mode))
+    {
         strcat(path, "/index.html");
+        if (http_stat(path, &st) == false)
+        {
+            server_http_resp_404_not_found(client);
+            return RECV_OK;
+        }
+    }
+
+    if (!ranged && (file = server_fcache_load(server, path, &st)))
+        goto send_cached;
 
     const char* content_type = server_get_content_type(path);
 
-    fd = open(path, O_RDONLY);
+    /* Too big to cache (or cache off): stream it, never read it in. */
+    fd = open(path, O_RDONLY | O_CLOEXEC);
     if (fd == -1)
     {
         error("GET request of '%s' failed: %s\n", path, ERRSTR);
         server_http_resp_404_not_found(client);
-        return RECV_ERROR;
+        return RECV_OK;
     }
-    content_len = fdsize(fd);
-    content = malloc(content_len);
-    if (read(fd, content, content_len) == -1)
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
     {
-        error("read '%s' failed: %s\n", path, ERRSTR);
         close(fd);
         server_http_resp_404_not_found(client);
-        return RECV_ERROR;
+        return RECV_OK;
+    }
+    content_len = st.st_size;
+
+    cache.cache_control = server_http_file_etag(server, path, &st, "", etag);
+    cache.etag = etag;
+    cache.mtime = st.st_mtim.tv_sec;
+    cache.vary = false;
+    if (http_not_modified(http, &cache))
+    {
+        close(fd);
+        server_http_resp_not_modified(client, &cache);
+        return RECV_OK;
+    }
+
+    range_status = http_get_range(http, &cache, content_len, &range);
+    if (range_status == HTTP_RANGE_UNSATISFIABLE)
+    {
+        close(fd);
+        server_http_resp_range_not_satisfiable(client, content_len);
+        return RECV_OK;
     }
-    close(fd);
 
     if (strcmp(content_type, "application/octet-stream") == 0)
     {
-        const char* temp = server_mime_type(server, content, content_len);
-        if (temp)
-            content_type = temp;
+        /* libmagic only needs the start of the file. */
+        if ((sniff_len = pread(fd, sniff, sizeof(sniff), 0)) > 0)
+        {
+            const char* temp = server_mime_type(server, sniff, sniff_len);
+            if (temp)
+                content_type = temp;
+        }
     }
 
-    verbose("Got file (%s): '%s'\n", content_type, path);
-    server_http_resp_ok(client, content, content_len, content_type);
-    free(content);
+    verbose("Streaming file (%s, %zu bytes): '%s'\n", content_type, content_len, path);
+    server_http_resp_file(client, fd, content_len, 
+                          (range_status == HTTP_RANGE_OK) ? &range : NULL,
+                          content_type, &cache);
 
     return RECV_OK;
+send_cached:
+    verbose("Cached file: '%s'\n", file->path);
+    server_fcache_send(client, file, http);
+    server_fcache_unref(file);
+    return RECV_OK;
 }
 
@@ -10,3 +10,9 @@ server_handle_http_post(eworker_t* th, client_t* client, const http_t* http)
 {
     server_handle_user_upload(th, client, http);
 }
+
+bool
+server_http_post_allowed(server_t* server, const http_t* http)
+{
+    return server_user_upload_allowed(server, http);
+}
@@ -3,6 +3,8 @@
 #include "server.h"
 #include "server_events.h"
 #include "server_ht.h"
+#include "server_uring.h"
+#include "server_handoff.h"
 #include "chat/cmd.h"
 #include <sys/eventfd.h>
 
@@ -32,16 +34,46 @@ server_default_config(void)
                            json_object_new_string("chitychat"));
     json_object_object_add(config, "thread_pool",
                            json_object_new_int(-1));
+    json_object_object_add(config, "reuseport",
+                           json_object_new_boolean(false));
+    json_object_object_add(config, "edge_triggered",
+                           json_object_new_boolean(false));
+    json_object_object_add(config, "event_backend",
+                           json_object_new_string("epoll"));
+    json_object_object_add(config, "send_queue_low_kb",
+                           json_object_new_int(CLIENT_SEND_QUEUE_LOW / KIB));
+    json_object_object_add(config, "send_queue_high_kb",
+                           json_object_new_int(CLIENT_SEND_QUEUE_HIGH / KIB));
+    json_object_object_add(config, "send_queue_max_kb",
+                           json_object_new_int(CLIENT_SEND_QUEUE_MAX / KIB));
+    json_object_object_add(config, "idle_timeout",
+                           json_object_new_int(CLIENT_IDLE_TIMEOUT));
+    json_object_object_add(config, "drain_timeout",
+                           json_object_new_int(HANDOFF_DRAIN_TIMEOUT));
+    json_object_object_add(config, "file_cache_mb",
+                           json_object_new_int(FCACHE_SIZE_MB));
+    json_object_object_add(config, "max_upload_mb",
+                           json_object_new_int(HTTP_UPLOAD_MAX_MB));
 
     return config;
 }
 
 static void 
-server_chdir(const char* exe_path)
+server_chdir(server_t* server, const char* exe_path)
 {
     char realpath_str[PATH_MAX];
     char* dir;
-    realpath(exe_path, realpath_str);
+
+    /* argv[0] may be a bare name found in $PATH. */
+    if (realpath(exe_path, realpath_str) == NULL &&
+        realpath("/proc/self/exe", realpath_str) == NULL)
+    {
+        error("realpath '%s': %s, handoff disabled.\n", exe_path, ERRSTR);
+        server->exe_path[0] = 0;
+        return;
+    }
+    /* Relative argv[0] is useless after chdir(), keep it for handoff. */
+    snprintf(server->exe_path, sizeof(server->exe_path), "%s", realpath_str);
     dir = dirname(dirname(realpath_str)); // Get the parent of the exe directory 
 
     if (chdir(dir) == -1)
@@ -63,7 +95,11 @@ print_help(const char* exe_path)
         "  -T, --thread-pool=N\t\tSet the number of threads for the thread pool,\n"\
         "\t\t\t\tUse -1 (default) to automatically determine the number based on system threads.\n"\
         "  -6, --ipv6\t\t\tUse IPv6\n"\
-        "  -4, --ipv4\t\t\tUse IPv4\n",
+        "  -4, --ipv4\t\t\tUse IPv4\n"\
+        "  -R, --reuseport\t\tEach worker gets its own epoll and SO_REUSEPORT socket\n"\
+        "  -E, --edge-triggered\t\tEdge-triggered client connections (requires --reuseport)\n"\
+        "  -U, --io-uring\t\tUse io_uring instead of epoll (requires --reuseport)\n"\
+        "  -H, --handoff-fd=FD\t\tTake over listening sockets from old server (set by SIGUSR2 upgrade)\n",
         exe_path
     );
 }
@@ -83,10 +119,14 @@ server_argv(server_t* server, int argc, char* const* argv)
         {"fork", 0, NULL, 'f'},
         {"help", 0, NULL, 'h'},
         {"thread-pool", required_argument, NULL, 'T'},
+        {"reuseport", 0, NULL, 'R'},
+        {"edge-triggered", 0, NULL, 'E'},
+        {"io-uring", 0, NULL, 'U'},
+        {"handoff-fd", required_argument, NULL, 'H'},
         {NULL, 0, NULL, 0}
     };
 
-    while ((opt = getopt_long(argc, argv, "T:p:d:v46hf", long_opts, NULL)) != -1)
+    while ((opt = getopt_long(argc, argv, "T:p:d:v46hfREUH:", long_opts, NULL)) != -1)
     {
         switch (opt)
         {
@@ -127,6 +167,26 @@ server_argv(server_t* server, int argc, char* const* argv)
             case 'T':
                 server->conf.thread_pool = atoi(optarg);
                 break;
+            case 'R':
+                server->conf.reuseport = true;
+                break;
+            case 'E':
+                server->conf.edge_triggered = true;
+                break;
+            case 'U':
+                server->conf.io_uring = true;
+                break;
+            case 'H':
+                server->handoff.fd = strtol(optarg, &endptr, 10);
+                if (*endptr || server->handoff.fd < 0)
+                {
+                    error("Invalid handoff fd: '%s'\n", optarg);
+                    server->handoff.fd = -1;
+                    return false;
+                }
+                /* Ours only, not for any later handoff. */
+                fcntl(server->handoff.fd, F_SETFD, FD_CLOEXEC);
+                break;
             case '?':
                 error("Unknown or missing argument\n");
                 return false;
@@ -136,6 +196,22 @@ server_argv(server_t* server, int argc, char* const* argv)
     return true;
 }
 
+static size_t
+server_config_kib(json_object* config, const char* key, size_t default_size)
+{
+    json_object* json = json_object_object_get(config, key);
+    i32 kib = json_object_get_int(json);
+
+    if (json == NULL)
+        return default_size;
+    if (kib <= 0)
+    {
+        warn("Config: %s: %d? Default to %zu\n", key, kib, default_size / KIB);
+        return default_size;
+    }
+    return (size_t)kib * KIB;
+}
+
 static bool        
 server_load_config(server_t* server, int argc, char* const* argv)
 {
@@ -153,6 +229,14 @@ server_load_config(server_t* server, int argc, char* const* argv)
     json_object* database;
     json_object* log_level_json;
     json_object* thread_pool_json;
+    json_object* reuseport_json;
+    json_object* edge_triggered_json;
+    json_object* event_backend_json;
+    json_object* idle_timeout_json;
+    json_object* drain_timeout_json;
+    json_object* file_cache_mb_json;
+    json_object* max_upload_mb_json;
+    const char* event_backend_str;
     const char* root_dir_str;
     const char* img_dir_str;
     const char* vid_dir_str;
@@ -165,7 +249,7 @@ server_load_config(server_t* server, int argc, char* const* argv)
     enum server_log_level log_level = SERVER_DEBUG;
     const char* config_path = SERVER_CONFIG_PATH;
 
-    server_chdir(argv[0]);
+    server_chdir(server, argv[0]);
 
     fd = open(config_path, O_RDONLY);
     if (fd == -1)
@@ -261,6 +345,78 @@ server_load_config(server_t* server, int argc, char* const* argv)
     thread_pool_str = json_object_get_string(thread_pool_json);
     server->conf.thread_pool = atoi(thread_pool_str);
 
+    reuseport_json = JSON_GET("reuseport");
+    server->conf.reuseport = json_object_get_boolean(reuseport_json);
+
+    edge_triggered_json = JSON_GET("edge_triggered");
+    server->conf.edge_triggered = json_object_get_boolean(edge_triggered_json);
+
+    event_backend_json = JSON_GET("event_backend");
+    event_backend_str = json_object_get_string(event_backend_json);
+    if (event_backend_str && !strcmp(event_backend_str, "io_uring"))
+        server->conf.io_uring = true;
+    else if (event_backend_str && strcmp(event_backend_str, "epoll"))
+        warn("Config: event_backend: \"%s\"? Default to epoll\n", event_backend_str);
+
+    server->conf.send_queue_low = server_config_kib(config, "send_queue_low_kb", 
+                                                    CLIENT_SEND_QUEUE_LOW);
+    server->conf.send_queue_high = server_config_kib(config, "send_queue_high_kb", 
+                                                     CLIENT_SEND_QUEUE_HIGH);
+    server->conf.send_queue_max = server_config_kib(config, "send_queue_max_kb", 
+                                                    CLIENT_SEND_QUEUE_MAX);
+    if (server->conf.send_queue_low >= server->conf.send_queue_high ||
+        server->conf.send_queue_high > server->conf.send_queue_max)
+    {
+        warn("Config: send_queue_*_kb needs low < high <= max, using defaults.\n");
+        server->conf.send_queue_low = CLIENT_SEND_QUEUE_LOW;
+        server->conf.send_queue_high = CLIENT_SEND_QUEUE_HIGH;
+        server->conf.send_queue_max = CLIENT_SEND_QUEUE_MAX;
+    }
+
+    idle_timeout_json = JSON_GET("idle_timeout");
+    if (idle_timeout_json == NULL)
+        server->conf.idle_timeout = CLIENT_IDLE_TIMEOUT;
+    else if (json_object_get_int(idle_timeout_json) < 0)
+    {
+        warn("Config: idle_timeout < 0? Default to %d\n", CLIENT_IDLE_TIMEOUT);
+        server->conf.idle_timeout = CLIENT_IDLE_TIMEOUT;
+    }
+    else
+        server->conf.idle_timeout = json_object_get_int(idle_timeout_json);
+
+    drain_timeout_json = JSON_GET("drain_timeout");
+    if (drain_timeout_json == NULL)
+        server->conf.drain_timeout = HANDOFF_DRAIN_TIMEOUT;
+    else if (json_object_get_int(drain_timeout_json) < 0)
+    {
+        warn("Config: drain_timeout < 0? Default to %d\n", HANDOFF_DRAIN_TIMEOUT);
+        server->conf.drain_timeout = HANDOFF_DRAIN_TIMEOUT;
+    }
+    else
+        server->conf.drain_timeout = json_object_get_int(drain_timeout_json);
+
+    file_cache_mb_json = JSON_GET("file_cache_mb");
+    if (file_cache_mb_json == NULL)
+        server->conf.file_cache_mb = FCACHE_SIZE_MB;
+    else if (json_object_get_int(file_cache_mb_json) < 0)
+    {
+        warn("Config: file_cache_mb < 0? Default to %d\n", FCACHE_SIZE_MB);
+        server->conf.file_cache_mb = FCACHE_SIZE_MB;
+    }
+    else
+        server->conf.file_cache_mb = json_object_get_int(file_cache_mb_json);
+
+    max_upload_mb_json = JSON_GET("max_upload_mb");
+    if (max_upload_mb_json == NULL)
+        server->conf.max_upload_mb = HTTP_UPLOAD_MAX_MB;
+    else if (json_object_get_int(max_upload_mb_json) <= 0)
+    {
+        warn("Config: max_upload_mb <= 0? Default to %d\n", HTTP_UPLOAD_MAX_MB);
+        server->conf.max_upload_mb = HTTP_UPLOAD_MAX_MB;
+    }
+    else
+        server->conf.max_upload_mb = json_object_get_int(max_upload_mb_json);
+
     log_level_json = JSON_GET("log_level");
     if (log_level_json)
     {
@@ -315,17 +471,31 @@ server_load_config(server_t* server, int argc, char* const* argv)
     if (server->conf.thread_pool == -1)
         server->conf.thread_pool = server_tm_system_threads();
 
+    /* 
+     * With a shared epoll, events must be EPOLLONESHOT so two workers
+     * never read the same client, edge-triggered gains nothing there.
+     */
+    if (server->conf.edge_triggered && !server->conf.reuseport)
+    {
+        warn("edge_triggered requires reuseport, ignored.\n");
+        server->conf.edge_triggered = false;
+    }
+
+    /* Rings are per worker, a shared event queue stays on epoll. */
+    if (server->conf.io_uring && !server->conf.reuseport)
+    {
+        warn("io_uring requires reuseport, using epoll.\n");
+        server->conf.io_uring = false;
+    }
+
     return true;
 }
 
 static bool 
 server_init_socket(server_t* server)
 {
-    int domain;
-
     if (server->conf.addr_version == IPv4)
     {
-        domain = AF_INET;
         server->addr_len = sizeof(struct sockaddr_in);
         server->addr_in.sin_family = AF_INET;
         server->addr_in.sin_port = htons(server->conf.addr_port);
@@ -344,7 +514,6 @@ server_init_socket(server_t* server)
     }
     else
     {
-        domain = AF_INET6;
         server->addr_len = sizeof(struct sockaddr_in6);
         server->addr_in6.sin6_family = AF_INET6;
         server->addr_in6.sin6_port = htons(server->conf.addr_port);
@@ -362,30 +531,58 @@ server_init_socket(server_t* server)
 
     server->addr = (struct sockaddr*)&server->addr_in;
 
-    server->sock = socket(domain, SOCK_STREAM, 0);
-    if (server->sock == -1)
+    /* Upgrade: old server's sockets are already bound and listening. */
+    if (server->handoff.fd != -1)
+        return server_handoff_recv(server);
+
+    server->sock = server_new_listen_sock(server);
+
+    return server->sock != -1;
+}
+
+i32
+server_new_listen_sock(const server_t* server)
+{
+    i32 sock;
+    i32 opt = 1;
+
+    sock = socket(server->addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1)
     {
         fatal("socket: %s\n", strerror(errno));
-        return false;
+        return -1;
     }
 
-    int opt = 1;
-    if (setsockopt(server->sock, SOL_SOCKET, SO_REUSEADDR, &opt, server->addr_len) == -1)
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
         error("setsockopt: %s\n", strerror(errno));
 
-    if (bind(server->sock, server->addr, server->addr_len) == -1)
+    /* 
+     * Every worker binds its own socket to the same address, 
+     * the kernel load balances new connections between them.
+     */
+    if (server->conf.reuseport &&
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+    {
+        fatal("setsockopt SO_REUSEPORT: %s\n", strerror(errno));
+        goto err;
+    }
+
+    if (bind(sock, server->addr, server->addr_len) == -1)
     {   
         fatal("bind: %s\n", strerror(errno));
-        return false;
+        goto err;
     }
 
-    if (listen(server->sock, LISTEN_BACKLOG) == -1)
+    if (listen(sock, LISTEN_BACKLOG) == -1)
     {
         fatal("listen: %s\n", strerror(errno)); 
-        return false;
+        goto err;
     }
 
-    return true;
+    return sock;
+err:
+    close(sock);
+    return -1;
 }
 
 static bool 
@@ -398,7 +595,20 @@ server_init_epoll(server_t* server)
         return false;
     }
 
-    if (server_new_event(server, server->sock, NULL, se_accept_conn, NULL) == NULL)
+    server->main_ew.server = server;
+    server->main_ew.pth = pthread_self();
+    eworker_self = &server->main_ew;
+    server_pools_init(&server->main_ew.pools);
+    server->main_ew.mq.efd = -1;
+    server->main_ew.epfd = server->epfd;
+    server->main_ew.sock = server->sock;
+    server->main_ew.epev_mode = EPOLLONESHOT;
+
+    /* In reuseport mode each worker listens in its own epoll. */
+    if (server->conf.reuseport)
+        return true;
+
+    if (server_new_accept_event(&server->main_ew, server->sock) == NULL)
         return false;
     
     return true;
@@ -420,6 +630,12 @@ server_init_ssl(server_t* server)
     }
 
     SSL_CTX_set_options(server->ssl_ctx, SSL_OP_SINGLE_DH_USE);
+#ifdef SSL_OP_ENABLE_KTLS
+    /* Kernel TLS if the cipher and kernel allow it, files go out with sendfile. */
+    SSL_CTX_set_options(server->ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    /* Client sockets are non-blocking, SSL_write() may be retried. */
+    SSL_CTX_set_mode(server->ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     SSL_CTX_set_ecdh_auto(server->ssl_ctx, 1);
     if (SSL_CTX_use_certificate_file(server->ssl_ctx, "server/server.crt", SSL_FILETYPE_PEM) <= 0)
     {
@@ -440,10 +656,7 @@ server_init_ht(server_t* server)
 {
     const size_t ht_size = 10;
 
-    if (server_ght_init(&server->event_ht, ht_size, NULL) == false)
-        return false;
-
-    if (server_ght_init(&server->client_ht, ht_size, NULL) == false)
+    if (server_fdt_init(&server->fdt) == false)
         return false;
 
     if (server_ght_init(&server->user_ht, ht_size, NULL) == false)
@@ -473,29 +686,144 @@ eventfd_dummy_read(eworker_t* ew, UNUSED server_event_t* ev)
 }
 
 static bool
-server_init_eventfd(server_t* server)
+server_add_eventfd(eworker_t* ew, i32 fd)
 {
     server_event_t* se;
 
-    server->eventfd = eventfd(0, 0);
+    se = server_new_event(ew, fd, NULL, eventfd_dummy_read, NULL);
+    if (se == NULL)
+        return false;
+
+    /* Already polled once, a second poll would deliver it twice. */
+    if (se->ring)
+        return true;
+
+    /*
+     * Default server_new_event() will use EPOLLONESHOT,
+     * in this case we don't, we want all threads get this event.
+     */
+    se->listen_events = EPOLLIN;
+    if (server_event_rearm(se) == -1)
+        return false;
+
+    return true;
+}
+
+static bool
+server_init_eventfd(server_t* server)
+{
+    server->eventfd = eventfd(0, EFD_CLOEXEC);
     if (server->eventfd == -1)
     {
         fatal("eventfd: %s\n", ERRSTR);
         return false;
     }
 
-    se = server_new_event(server, server->eventfd, NULL, eventfd_dummy_read, NULL);
-    if (se == NULL)
+    /* In reuseport mode each worker adds its own copy. */
+    if (server->conf.reuseport)
+        return true;
+
+    return server_add_eventfd(&server->main_ew, server->eventfd);
+}
+
+bool
+server_init_eworker_epoll(server_t* server, eworker_t* ew, size_t i)
+{
+    i32 eventfd_dup;
+
+    if (server->conf.reuseport == false)
+    {
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.ptr = NULL
+        };
+
+        ew->epfd = server->epfd;
+        ew->sock = server->sock;
+        ew->epev_mode = EPOLLONESHOT;
+
+        /* Our DB socket can't be in the shared epoll, see server_new_db_event() */
+        ew->waitfd = epoll_create1(EPOLL_CLOEXEC);
+        if (ew->waitfd == -1)
+        {
+            fatal("epoll_create1: %s\n", ERRSTR);
+            return false;
+        }
+        if (epoll_ctl(ew->waitfd, EPOLL_CTL_ADD, server->epfd, &ev) == -1)
+        {
+            fatal("epoll_ctl add shared epoll: %s\n", ERRSTR);
+            return false;
+        }
+        return true;
+    }
+    ew->waitfd = -1;
+
+    ew->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ew->epfd == -1)
+    {
+        fatal("epoll_create1: %s\n", ERRSTR);
         return false;
+    }
+    ew->epev_mode = 0;
+    ew->epev_client = (server->conf.edge_triggered) ? EPOLLET : 0;
 
-    /*
-     * Default server_new_event() will use EPOLLONESHOT,
-     * in this case we don't, we want all threads get this event.
+    if (server->conf.io_uring)
+    {
+        if ((ew->ring = server_uring_new()) == NULL)
+            warn("ew:%zu: io_uring not available, using epoll.\n", i);
+        else
+        {
+            /* Poll requests are one-shot, always re-arm after an event. */
+            ew->epev_mode = EPOLLONESHOT;
+            ew->epev_client = 0;
+        }
+    }
+
+    /* 
+     * First worker takes the socket made in server_init_socket(),
+     * so no socket in the reuseport group is left without a worker.
+     * After a handoff, workers take the old server's sockets.
      */
-    se->listen_events = EPOLLIN;
-    if (server_event_rearm(server, se) == -1)
+    if (i == 0)
+        ew->sock = server->sock;
+    else if ((ew->sock = server_handoff_sock(server, i)) == -1)
+        ew->sock = server_new_listen_sock(server);
+    if (ew->sock == -1)
+        return false;
+    if (server_new_accept_event(ew, ew->sock) == NULL)
+        return false;
+
+    /* 
+     * The same eventfd can't be in the fd table twice, 
+     * dup() it so each worker's epoll gets its own fd. 
+     */
+    eventfd_dup = fcntl(server->eventfd, F_DUPFD_CLOEXEC, 0);
+    if (eventfd_dup == -1)
+    {
+        fatal("dup eventfd: %s\n", ERRSTR);
+        return false;
+    }
+    if (server_add_eventfd(ew, eventfd_dup) == false)
+    {
+        close(eventfd_dup);
         return false;
+    }
+
+    return true;
+}
 
+/* Upload temp files, renamed into img_dir once stored. */
+static bool
+server_init_upload_dir(server_t* server)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, PATH_MAX, "%s/" HTTP_UPLOAD_TMP_DIR, server->conf.img_dir);
+    if (mkdir(path, S_IRWXU) == -1 && errno != EEXIST)
+    {
+        fatal("mkdir '%s': %s\n", path, ERRSTR);
+        return false;
+    }
     return true;
 }
 
@@ -510,6 +838,9 @@ server_init(int argc, char* const* argv)
         fatal("calloc() failed.\n");
         return NULL;
     }
+    server->handoff.fd = -1;
+    server->argc = argc;
+    server->argv = argv;
 
     // Load config and command line arguments
     if (!server_load_config(server, argc, argv))
@@ -546,6 +877,10 @@ server_init(int argc, char* const* argv)
     if (!server_init_magic(server))
         goto error;
 
+    // Upload temp dir, out of the file cache's sight
+    if (!server_init_upload_dir(server))
+        goto error;
+
     // Init OpenSSL
     if (!server_init_ssl(server))
         goto error;
@@ -561,6 +896,14 @@ server_init(int argc, char* const* argv)
     if (!server_init_tm(server, server->conf.thread_pool))
         goto error;
 
+    // Init static file cache (its inotify event goes to a worker)
+    if (!server_fcache_init(server))
+        goto error;
+
+    // Tell the old server we're up, it stops accepting
+    if (!server_handoff_finish(server))
+        goto error;
+
     server->running = true;
 
     return server;
@@ -0,0 +1,169 @@
+#include "server_mq.h"
+#include "server.h"
+#include <sys/eventfd.h>
+
+server_frame_t*
+server_frame_new(size_t len)
+{
+    server_frame_t* frame;
+
+    frame = malloc(sizeof(server_frame_t) + len);
+    frame->refs = 1;
+    frame->len = len;
+    return frame;
+}
+
+server_frame_t*
+server_frame_ref(server_frame_t* frame)
+{
+    __atomic_fetch_add(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+void
+server_frame_unref(server_frame_t* frame)
+{
+    if (frame && __atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(frame);
+}
+
+static void
+mq_free_msg(server_msg_t* msg)
+{
+    server_frame_unref(msg->frame);
+    free(msg);
+}
+
+/* Owner only. Take all messages, oldest first. */
+static server_msg_t*
+mq_take(server_mq_t* mq)
+{
+    server_msg_t* msg;
+    server_msg_t* next;
+    server_msg_t* fifo = NULL;
+
+    msg = __atomic_exchange_n(&mq->head, NULL, __ATOMIC_ACQUIRE);
+    for (; msg; msg = next)
+    {
+        next = msg->next;
+        msg->next = fifo;
+        fifo = msg;
+    }
+    return fifo;
+}
+
+static void
+mq_push(server_mq_t* mq, server_msg_t* msg)
+{
+    const u64 one = 1;
+
+    msg->next = __atomic_load_n(&mq->head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&mq->head, &msg->next, msg, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    /* Was empty, owner may be sleeping. Otherwise a wakeup is pending. */
+    if (msg->next == NULL && write(mq->efd, &one, sizeof(u64)) == -1 &&
+        errno != EAGAIN)
+        error("mq eventfd write: %s\n", ERRSTR);
+}
+
+static enum se_status
+se_mq_read(eworker_t* ew, server_event_t* ev)
+{
+    server_mq_t* mq = ev->data;
+    server_fdt_t* fdt = &ew->server->fdt;
+    server_msg_t* msg;
+    server_msg_t* next;
+    u64 count;
+
+    if (read(mq->efd, &count, sizeof(u64)) == -1 && errno != EAGAIN)
+    {
+        error("mq eventfd read: %s\n", ERRSTR);
+        return SE_ERROR;
+    }
+
+    for (msg = mq_take(mq); msg; msg = next)
+    {
+        next = msg->next;
+        /* Only we free our clients, so if it's still there it stays. */
+        if (server_fdt_get_client(fdt, msg->fd) == msg->client &&
+            server_fdt_gen(fdt, msg->fd) == msg->gen)
+        {
+            server_send_adv(msg->client, msg->frame->data, msg->frame->len,
+                            msg->flags);
+        }
+        mq_free_msg(msg);
+    }
+
+    return SE_OK;
+}
+
+static enum se_status
+se_mq_close(UNUSED eworker_t* ew, server_event_t* ev)
+{
+    server_mq_t* mq = ev->data;
+    server_msg_t* msg;
+    server_msg_t* next;
+
+    for (msg = mq_take(mq); msg; msg = next)
+    {
+        next = msg->next;
+        mq_free_msg(msg);
+    }
+
+    if (close(mq->efd) == -1)
+        error("close mq eventfd (%d): %s\n", mq->efd, ERRSTR);
+    mq->efd = -1;
+    return SE_OK;
+}
+
+bool
+server_mq_init(eworker_t* ew)
+{
+    server_mq_t* mq = &ew->mq;
+
+    mq->efd = -1;
+
+    /* Shared epoll: any worker handles any client, see server_mq.h */
+    if (ew->server->conf.reuseport == false)
+        return true;
+
+    mq->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (mq->efd == -1)
+    {
+        fatal("mq eventfd: %s\n", ERRSTR);
+        return false;
+    }
+
+    if (server_new_event(ew, mq->efd, mq, se_mq_read, se_mq_close) == NULL)
+    {
+        close(mq->efd);
+        mq->efd = -1;
+        return false;
+    }
+    return true;
+}
+
+void
+server_send_frame(eworker_t* ew, client_t* client,
+                  server_frame_t* frame, u32 flags)
+{
+    eworker_t* owner = client->ew;
+    server_msg_t* msg;
+
+    if (owner == NULL || owner == ew || owner->mq.efd == -1)
+    {
+        server_send_adv(client, frame->data, frame->len, flags);
+        return;
+    }
+
+    msg = malloc(sizeof(server_msg_t));
+    msg->client = client;
+    msg->fd = client->addr.sock;
+    msg->gen = server_fdt_gen(&ew->server->fdt, msg->fd);
+    msg->flags = flags;
+    msg->frame = server_frame_ref(frame);
+    mq_push(&owner->mq, msg);
+    server_stats_inc(ew->server, mq_queued);
+}
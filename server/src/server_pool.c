@@ -0,0 +1,93 @@
+#include "server_pool.h"
+#include "server_client.h"
+#include "server_events.h"
+#include "chat/db.h"
+
+typedef struct pool_obj
+{
+    struct pool_obj* next;
+} pool_obj_t;
+
+static inline void
+pool_stat_inc(u64* stat)
+{
+    __atomic_store_n(stat, *stat + 1, __ATOMIC_RELAXED);
+}
+
+void
+server_pool_init(server_pool_t* pool, const char* name, size_t obj_size)
+{
+    memset(pool, 0, sizeof(server_pool_t));
+    pool->name = name;
+    pool->obj_size = (obj_size < sizeof(pool_obj_t)) ? sizeof(pool_obj_t) : obj_size;
+}
+
+void
+server_pool_destroy(server_pool_t* pool)
+{
+    pool_obj_t* obj;
+
+    while ((obj = pool->free_list))
+    {
+        pool->free_list = obj->next;
+        free(obj);
+    }
+    pool->n_free = 0;
+}
+
+void*
+server_pool_alloc(server_pool_t* pool, size_t size)
+{
+    pool_obj_t* obj;
+
+    if (pool == NULL)
+        return calloc(1, size);
+
+    if ((obj = pool->free_list))
+    {
+        pool->free_list = obj->next;
+        pool->n_free--;
+        pool_stat_inc(&pool->hits);
+        memset(obj, 0, pool->obj_size);
+        return obj;
+    }
+
+    pool_stat_inc(&pool->misses);
+    return calloc(1, pool->obj_size);
+}
+
+void
+server_pool_free(server_pool_t* pool, void* ptr)
+{
+    pool_obj_t* obj = ptr;
+
+    if (!obj)
+        return;
+    if (pool == NULL || pool->n_free >= POOL_MAX_FREE)
+    {
+        free(obj);
+        return;
+    }
+
+    obj->next = pool->free_list;
+    pool->free_list = obj;
+    pool->n_free++;
+}
+
+void
+server_pools_init(server_pools_t* pools)
+{
+    server_pool_init(&pools->client, "client", sizeof(client_t));
+    server_pool_init(&pools->event, "event", sizeof(server_event_t));
+    server_pool_init(&pools->dbcmd, "dbcmd", sizeof(dbcmd_ctx_t));
+    server_pool_init(&pools->recv_page, "recv_page", CLIENT_RECV_PAGE);
+}
+
+void
+server_pools_destroy(server_pools_t* pools)
+{
+    server_pool_destroy(&pools->client);
+    server_pool_destroy(&pools->event);
+    server_pool_destroy(&pools->dbcmd);
+    server_pool_destroy(&pools->recv_page);
+}
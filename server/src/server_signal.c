@@ -16,6 +16,15 @@ server_handle_signal(server_t* server, const struct signalfd_siginfo* siginfo)
         case SIGTERM:
             server->running = false;
             break;
+        case SIGUSR1:
+            server_print_stats(server);
+            break;
+        case SIGUSR2:
+            server_handoff_start(server);
+            break;
+        case SIGALRM:
+            server_handoff_drain_tick(server);
+            break;
         default:
             break;
     }
@@ -29,9 +38,12 @@ server_init_signal(server_t* server)
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGTERM);
     sigaddset(&mask, SIGPIPE);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);  /* Graceful upgrade, see server_handoff.h */
+    sigaddset(&mask, SIGALRM);  /* Drain check after handoff */
     sigprocmask(SIG_BLOCK, &mask, NULL);
     
-    server->sigfd = signalfd(-1, &mask, 0);
+    server->sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
     if (server->sigfd == -1)
     {
         error("signalfd: %s\n", ERRSTR);
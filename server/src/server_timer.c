@@ -6,8 +6,10 @@ timer_user_session(server_t* server, server_timer_t* timer)
 {
     session_t* session = timer->data.session;
 
-    debug("Client session for user_id:%u expired %zu times, id: %u.\n", 
+    debug("Client session for user_id:%u expired %zu times, id: %u.\n",
           session->user_id, timer->exp, session->session_id);
+    /* Timer is freed by the wheel, don't let it be canceled. */
+    session->timer = NULL;
     server_del_user_session(server, session);
 
     return SE_CLOSE;
@@ -18,17 +20,43 @@ timer_ut(eworker_t* th, server_timer_t* timer)
 {
     upload_token_t* ut = timer->data.ut;
 
-    debug("Upload token for user_id:%u expired %zu times: %u\n", 
+    debug("Upload token for user_id:%u expired %zu times: %u\n",
           ut->user_id, timer->exp, ut->token);
-    /* Set ut->timerfd to 0 so `server_del_upload_token()` won't
-     * free this event 
+    /* Set ut->timer to NULL so `server_del_upload_token()` won't
+     * cancel this timer
      */
-    ut->timerfd = 0;
+    ut->timer = NULL;
     server_del_upload_token(th, ut);
 
     return SE_CLOSE;
 }
 
+static enum se_status
+timer_client_idle(server_timer_t* timer)
+{
+    client_t* client = timer->data.client;
+    server_t* server = client->ew->server;
+    const u64 idle = server_timer_wheel_now(timer->wheel) - client->last_active;
+    const u64 timeout = server->conf.idle_timeout;
+
+    if (idle < timeout)
+    {
+        /* Active since, check again when it could expire. */
+        timer->seconds = timeout - idle;
+        return SE_OK;
+    }
+
+    debug("Client fd:%d idle for %lus, disconnecting.\n",
+          client->addr.sock, idle);
+    /*
+     * Client's own event gets a hang up and frees it,
+     * server_free_client() cancels this timer.
+     */
+    shutdown(client->addr.sock, SHUT_RDWR);
+    timer->seconds = timeout;
+    return SE_OK;
+}
+
 static enum se_status
 server_timer_exp(eworker_t* th, server_timer_t* timer)
 {
@@ -42,6 +70,9 @@ server_timer_exp(eworker_t* th, server_timer_t* timer)
         case TIMER_UPLOAD_TOKEN:
             ret = timer_ut(th, timer);
             break;
+        case TIMER_CLIENT_IDLE:
+            ret = timer_client_idle(timer);
+            break;
         default:
         {
             warn("Not handled timer type: %d\n", timer->type);
@@ -53,144 +84,279 @@ server_timer_exp(eworker_t* th, server_timer_t* timer)
     return ret;
 }
 
-enum se_status
-se_timer_read(eworker_t* th, server_event_t* ev)
+/* Needs wheel->mutex. */
+static void
+wheel_link(server_timer_wheel_t* wheel, server_timer_t* timer, i32 seconds)
+{
+    u32 ticks = (seconds > TIMER_WHEEL_TICK) ? seconds / TIMER_WHEEL_TICK : 1;
+
+    timer->slot = (wheel->current + ticks) & (TIMER_WHEEL_SLOTS - 1);
+    timer->rounds = (ticks - 1) / TIMER_WHEEL_SLOTS;
+    timer->prev = NULL;
+    timer->next = wheel->slots[timer->slot];
+    if (timer->next)
+        timer->next->prev = timer;
+    wheel->slots[timer->slot] = timer;
+    wheel->count++;
+}
+
+/* Needs wheel->mutex. */
+static void
+wheel_unlink(server_timer_wheel_t* wheel, server_timer_t* timer)
+{
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        wheel->slots[timer->slot] = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    wheel->count--;
+}
+
+/* Needs wheel->mutex. Moves expired timers to `expired`. */
+static void
+wheel_tick(server_timer_wheel_t* wheel, server_timer_t** expired)
+{
+    server_timer_t* timer;
+    server_timer_t* next;
+
+    wheel->current = (wheel->current + 1) & (TIMER_WHEEL_SLOTS - 1);
+    __atomic_store_n(&wheel->ticks, wheel->ticks + 1, __ATOMIC_RELAXED);
+
+    for (timer = wheel->slots[wheel->current]; timer; timer = next)
+    {
+        next = timer->next;
+        if (timer->rounds)
+        {
+            timer->rounds--;
+            continue;
+        }
+        wheel_unlink(wheel, timer);
+        /* Owned by se_timer_read() now, cancel only marks it. */
+        timer->expiring = true;
+        timer->next = *expired;
+        *expired = timer;
+    }
+}
+
+/* 
+ * Needs wheel->mutex, dropped while callbacks run: they free sessions
+ * and tokens, which cancels timers of this and other wheels.
+ */
+static void
+wheel_expire(eworker_t* th, server_timer_wheel_t* wheel, server_timer_t* expired)
 {
+    server_timer_t* timer;
+    server_timer_t* next;
     enum se_status ret;
-    server_timer_t* timer = ev->data;
+
+    wheel->runner = pthread_self();
+    for (timer = expired; timer; timer = next)
+    {
+        next = timer->next;
+        ret = SE_CLOSE;
+        if (timer->canceled == false)
+        {
+            wheel->running = timer;
+            pthread_mutex_unlock(&wheel->mutex);
+
+            timer->exp++;
+            ret = server_timer_exp(th, timer);
+
+            pthread_mutex_lock(&wheel->mutex);
+            wheel->running = NULL;
+            pthread_cond_broadcast(&wheel->done);
+        }
+
+        timer->expiring = false;
+        if (ret == SE_OK && timer->canceled == false && 
+            (timer->flags & TIMER_ONCE) == 0)
+            wheel_link(wheel, timer, timer->seconds);
+        else
+            free(timer);
+    }
+}
+
+static enum se_status
+se_timer_read(eworker_t* th, server_event_t* ev)
+{
+    server_timer_wheel_t* wheel = ev->data;
+    server_timer_t* expired = NULL;
     u64 exp;
 
-    if (read(timer->fd, &exp, sizeof(u64)) == -1)
+    if (read(wheel->fd, &exp, sizeof(u64)) == -1)
     {
-        error("read timer->fd (%d): %s\n", timer->fd, ERRSTR);
+        if (errno == EAGAIN)
+            return SE_OK;
+        error("read timer wheel fd (%d): %s\n", wheel->fd, ERRSTR);
         return SE_ERROR;
     }
-    timer->exp += exp;
 
-    ret = server_timer_exp(th, timer);
-    if (ret == SE_CLOSE)
-        ev->keep_data = true;
-    return ret;
-}
+    pthread_mutex_lock(&wheel->mutex);
+    while (exp--)
+        wheel_tick(wheel, &expired);
+    wheel_expire(th, wheel, expired);
+    pthread_mutex_unlock(&wheel->mutex);
 
-enum se_status
-se_timer_close(eworker_t* th, server_event_t* ev)
-{
-    server_close_timer(th, ev->data, ev->keep_data);
     return SE_OK;
 }
 
-server_timer_t*     
-server_addtimer(eworker_t* th, i32 seconds, i32 flags, 
-                enum timer_type type, union timer_data* data,
-                size_t size)
+static enum se_status
+se_timer_close(UNUSED eworker_t* th, server_event_t* ev)
 {
-    struct itimerspec it;
-    server_timer_t* timer = NULL; 
+    server_timer_wheel_t* wheel = ev->data;
 
-    timer = calloc(1, sizeof(server_timer_t));
+    /* Wheel itself is freed with the worker, clients still cancel timers. */
+    if (close(wheel->fd) == -1)
+        error("close timer wheel fd (%d): %s\n", wheel->fd, ERRSTR);
+    wheel->fd = -1;
+    return SE_OK;
+}
 
-    timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-    if (timer->fd == -1)
+bool
+server_timer_wheel_init(eworker_t* ew)
+{
+    server_timer_wheel_t* wheel;
+    struct itimerspec it = {
+        .it_value.tv_sec = TIMER_WHEEL_TICK,
+        .it_interval.tv_sec = TIMER_WHEEL_TICK
+    };
+
+    wheel = calloc(1, sizeof(server_timer_wheel_t));
+    wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (wheel->fd == -1)
     {
         error("timerfd_create: %s\n", ERRSTR);
-        goto error;
-    }
-    timer->seconds = seconds;
-    timer->flags = flags;
-    timer->type = type;
-    if (size > sizeof(union timer_data))
-        size = sizeof(union timer_data);
-    timer->data = *data;
-
-    switch (timer->type)
-    {
-        case TIMER_CLIENT_SESSION:
-            timer->data.session->timerfd = timer->fd;
-            break;
-        case TIMER_UPLOAD_TOKEN:
-            timer->data.ut->timerfd = timer->fd;
-            break;
+        free(wheel);
+        return false;
     }
+    pthread_mutex_init(&wheel->mutex, NULL);
+    pthread_cond_init(&wheel->done, NULL);
 
-    it.it_value.tv_sec = seconds;
-    it.it_value.tv_nsec = 0;
-    it.it_interval.tv_nsec = 0;
-    if (flags & TIMER_ONCE)
-        it.it_interval.tv_sec = 0;
-    else
-        it.it_interval.tv_sec = seconds;
-
-
-    if (timerfd_settime(timer->fd, 0, &it, NULL) == -1)
+    if (timerfd_settime(wheel->fd, 0, &it, NULL) == -1)
     {
         error("timerfd_settime: %s\n", ERRSTR);
         goto error;
     }
 
-    if (server_new_event(th->server, timer->fd, timer, se_timer_read, se_timer_close) == NULL)
+    if (server_new_event(ew, wheel->fd, wheel, se_timer_read, se_timer_close) == NULL)
         goto error;
 
-    debug("New timer for %ds, flags:0x%x, type:%d\n",
-          timer->seconds, timer->flags, timer->type);
-
-    return timer;
-error:;
-    server_close_timer(th, timer, 0);
-    return NULL;
+    ew->timers = wheel;
+    return true;
+error:
+    close(wheel->fd);
+    pthread_mutex_destroy(&wheel->mutex);
+    pthread_cond_destroy(&wheel->done);
+    free(wheel);
+    return false;
 }
 
-i32                 
-server_timer_set(server_timer_t* timer, i32 seconds)
+void
+server_timer_wheel_free(server_timer_wheel_t* wheel)
 {
-    i32 ret;
-    struct itimerspec its;
+    server_timer_t* timer;
 
-    its.it_value.tv_sec = seconds;
-    its.it_value.tv_nsec = 0;
-    its.it_interval.tv_nsec = 0;
-    if (timer->flags & TIMER_ONCE)
-        its.it_interval.tv_sec = 0;
-    else
-        its.it_interval.tv_sec = seconds;
+    if (!wheel)
+        return;
 
-    ret = timerfd_settime(timer->fd, 0, &its, NULL);
-    if (ret == -1)
-        error("timerfd_settime(%d, %ds): %s\n",
-              timer->fd, seconds, ERRSTR);
-    else
-        timer->seconds = seconds;
+    /* Everything timers point to is freed by now. */
+    for (u32 i = 0; i < TIMER_WHEEL_SLOTS; i++)
+    {
+        while ((timer = wheel->slots[i]))
+        {
+            wheel->slots[i] = timer->next;
+            free(timer);
+        }
+    }
+    if (wheel->fd != -1)
+        close(wheel->fd);
+    pthread_mutex_destroy(&wheel->mutex);
+    pthread_cond_destroy(&wheel->done);
+    free(wheel);
+}
 
-    return ret;
+u64
+server_timer_wheel_now(const server_timer_wheel_t* wheel)
+{
+    return __atomic_load_n(&wheel->ticks, __ATOMIC_RELAXED) * TIMER_WHEEL_TICK;
 }
 
-i32                 
-server_timer_get(server_timer_t* timer)
+server_timer_t*
+server_addtimer(eworker_t* th, i32 seconds, i32 flags,
+                enum timer_type type, union timer_data* data,
+                size_t size)
 {
-    i32 ret;
-    struct itimerspec its;
+    server_timer_t* timer = NULL;
+    server_timer_wheel_t* wheel = th->timers;
 
-    ret = timerfd_gettime(timer->fd, &its);
-    if (ret == -1)
-        error("timerfd_gettime(%d): %s\n",
-              timer->fd, ERRSTR);
-    else
-        ret = its.it_value.tv_sec;
+    if (!wheel)
+    {
+        warn("server_addtimer(): %s has no timer wheel.\n", th->name);
+        return NULL;
+    }
 
-    return ret;
+    timer = calloc(1, sizeof(server_timer_t));
+    timer->wheel = wheel;
+    timer->seconds = seconds;
+    timer->flags = flags;
+    timer->type = type;
+    if (size > sizeof(union timer_data))
+        size = sizeof(union timer_data);
+    memcpy(&timer->data, data, size);
+
+    pthread_mutex_lock(&wheel->mutex);
+    wheel_link(wheel, timer, seconds);
+    pthread_mutex_unlock(&wheel->mutex);
+
+    verbose("New timer for %ds, flags:0x%x, type:%d\n",
+            timer->seconds, timer->flags, timer->type);
+
+    return timer;
 }
 
 void
-server_close_timer(eworker_t* th, server_timer_t* timer, bool keep_data)
+server_timer_set(server_timer_t* timer, i32 seconds)
+{
+    server_timer_wheel_t* wheel = timer->wheel;
+
+    pthread_mutex_lock(&wheel->mutex);
+    timer->seconds = seconds;
+    /* Expiring: relinked with `seconds` after its callback. */
+    if (timer->expiring == false)
+    {
+        wheel_unlink(wheel, timer);
+        wheel_link(wheel, timer, seconds);
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+void
+server_timer_cancel(server_timer_t* timer)
 {
+    server_timer_wheel_t* wheel;
+
     if (!timer)
         return;
+    wheel = timer->wheel;
 
-    if (keep_data == false)
-        server_timer_exp(th, timer);
-
-    if (close(timer->fd) == -1)
-        error("close timer->fd (%d): %s\n", timer->fd, ERRSTR);
+    pthread_mutex_lock(&wheel->mutex);
+    if (timer->expiring)
+    {
+        /* 
+         * se_timer_read() frees it. Wait for a running callback, the caller
+         * is about to free what it uses, unless the callback is the caller.
+         */
+        timer->canceled = true;
+        while (wheel->running == timer && 
+               !pthread_equal(wheel->runner, pthread_self()))
+            pthread_cond_wait(&wheel->done, &wheel->mutex);
+        timer = NULL;
+    }
+    else
+        wheel_unlink(wheel, timer);
+    pthread_mutex_unlock(&wheel->mutex);
 
     free(timer);
 }
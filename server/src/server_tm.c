@@ -1,6 +1,7 @@
 #include "server_tm.h"
 #include "chat/db_def.h"
 #include "server.h"
+#include "server_uring.h"
 #include <sys/eventfd.h>
 
 #define EVCB_SIZE 128
@@ -109,8 +110,34 @@ server_tm_shutdown(server_t* server)
     pthread_mutex_destroy(&tm->mutex);
 
     server_db_close(&server->main_ew.db);
+}
+
+void
+server_tm_free(server_t* server)
+{
+    server_tm_t* tm = &server->tm;
+    if (!tm->workers)
+        return;
+
+    /* 
+     * Closed after all events are deleted, 
+     * since events removes themselfs from their epoll.
+     */
+    for (size_t i = 0; i < tm->n_workers; i++)
+    {
+        eworker_t* ew = tm->workers + i;
+        if (ew->epfd > 0 && ew->epfd != server->epfd)
+            close(ew->epfd);
+        if (ew->waitfd > 0)
+            close(ew->waitfd);
+        server_uring_free(ew->ring);
+        server_timer_wheel_free(ew->timers);
+        server_pools_destroy(&ew->pools);
+    }
+    server_pools_destroy(&server->main_ew.pools);
 
     free(tm->workers);
+    tm->workers = NULL;
 }
 
 // void    
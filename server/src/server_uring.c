@@ -0,0 +1,619 @@
+#include "server_uring.h"
+#include "server_events.h"
+#include "server.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_REMOVE_DATA 0 /* user_data for POLL_REMOVE/ASYNC_CANCEL completions */
+#define URING_TEST_DATA   1 /* user_data for the multishot test recv */
+#define URING_BGID        0 /* Provided buffer group of the recv buffers */
+#define URING_OP_SHIFT    62
+#define URING_FD_MASK     0x3fffffff
+
+static i32
+uring_setup(u32 entries, struct io_uring_params* params)
+{
+    return (i32)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static i32
+uring_enter(i32 fd, u32 to_submit, u32 min_complete, u32 flags)
+{
+    return (i32)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static i32
+uring_register(i32 fd, u32 opcode, void* arg, u32 nr_args)
+{
+    return (i32)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* op:2 | fd:30 | fd table generation:32 */
+static inline u64
+uring_user_data(const server_event_t* se, enum uring_op op)
+{
+    return ((u64)op << URING_OP_SHIFT) | 
+           ((u64)((u32)se->fd & URING_FD_MASK) << 32) | se->uring_id;
+}
+
+static inline enum uring_op
+uring_data_op(u64 user_data)
+{
+    return (enum uring_op)(user_data >> URING_OP_SHIFT);
+}
+
+static inline i32
+uring_data_fd(u64 user_data)
+{
+    return (i32)((user_data >> 32) & URING_FD_MASK);
+}
+
+static bool
+uring_mmap(server_uring_t* ring, const struct io_uring_params* p)
+{
+    void* ptr;
+
+    ring->sq.size = p->sq_off.array + p->sq_entries * sizeof(u32);
+    ring->cq.size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq.size > ring->sq.size)
+            ring->sq.size = ring->cq.size;
+        ring->cq.size = ring->sq.size;
+    }
+
+    ptr = mmap(NULL, ring->sq.size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED)
+    {
+        error("io_uring mmap SQ ring: %s\n", ERRSTR);
+        return false;
+    }
+    ring->sq.ptr = ptr;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq.ptr = ptr;
+    else
+    {
+        ptr = mmap(NULL, ring->cq.size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ptr == MAP_FAILED)
+        {
+            error("io_uring mmap CQ ring: %s\n", ERRSTR);
+            return false;
+        }
+        ring->cq.ptr = ptr;
+    }
+
+    ring->sq.sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, ring->sq.sqes_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED)
+    {
+        error("io_uring mmap SQEs: %s\n", ERRSTR);
+        return false;
+    }
+    ring->sq.sqes = ptr;
+
+    ring->sq.head = (u32*)((u8*)ring->sq.ptr + p->sq_off.head);
+    ring->sq.tail = (u32*)((u8*)ring->sq.ptr + p->sq_off.tail);
+    ring->sq.mask = (u32*)((u8*)ring->sq.ptr + p->sq_off.ring_mask);
+    ring->sq.entries = (u32*)((u8*)ring->sq.ptr + p->sq_off.ring_entries);
+    ring->sq.array = (u32*)((u8*)ring->sq.ptr + p->sq_off.array);
+
+    ring->cq.head = (u32*)((u8*)ring->cq.ptr + p->cq_off.head);
+    ring->cq.tail = (u32*)((u8*)ring->cq.ptr + p->cq_off.tail);
+    ring->cq.mask = (u32*)((u8*)ring->cq.ptr + p->cq_off.ring_mask);
+    ring->cq.cqes = (struct io_uring_cqe*)((u8*)ring->cq.ptr + p->cq_off.cqes);
+
+    return true;
+}
+
+/* Needs ring->mutex. */
+static i32
+uring_submit_locked(server_uring_t* ring)
+{
+    i32 ret;
+
+    if (ring->to_submit == 0)
+        return 0;
+
+    ret = uring_enter(ring->fd, ring->to_submit, 0, 0);
+    if (ret == -1)
+        error("io_uring_enter submit: %s\n", ERRSTR);
+    else
+        ring->to_submit = 0;
+    return ret;
+}
+
+/* Needs ring->mutex. */
+static struct io_uring_sqe*
+uring_get_sqe(server_uring_t* ring)
+{
+    struct io_uring_sqe* sqe;
+    u32 head;
+    u32 tail = *ring->sq.tail;
+    u32 idx;
+
+    head = __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+    if (tail - head >= *ring->sq.entries)
+    {
+        /* SQ full, flush it to the kernel. */
+        if (uring_submit_locked(ring) == -1)
+            return NULL;
+        head = __atomic_load_n(ring->sq.head, __ATOMIC_ACQUIRE);
+        if (tail - head >= *ring->sq.entries)
+            return NULL;
+    }
+
+    idx = tail & *ring->sq.mask;
+    sqe = ring->sq.sqes + idx;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq.array[idx] = idx;
+
+    return sqe;
+}
+
+/* Needs ring->mutex. */
+static void
+uring_push_sqe(server_uring_t* ring)
+{
+    __atomic_store_n(ring->sq.tail, *ring->sq.tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+static void
+uring_prep_recv(struct io_uring_sqe* sqe, i32 fd, u64 user_data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    /* len 0: a whole provided buffer each time. */
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = user_data;
+}
+
+/* Give buffer `bid` (back) to the kernel. Owner only. */
+static void
+uring_buf_recycle(server_uring_t* ring, u16 bid)
+{
+    struct io_uring_buf* buf;
+
+    buf = ring->bufs.ring->bufs + (ring->bufs.tail & (URING_RECV_BUFS - 1));
+    buf->addr = (u64)(uintptr_t)(ring->bufs.data + (size_t)bid * URING_RECV_BUF_SIZE);
+    buf->len = URING_RECV_BUF_SIZE;
+    buf->bid = bid;
+    ring->bufs.tail++;
+    __atomic_store_n(&ring->bufs.ring->tail, ring->bufs.tail, __ATOMIC_RELEASE);
+}
+
+static bool
+uring_bufs_init(server_uring_t* ring)
+{
+    struct io_uring_buf_reg reg;
+    const size_t ring_size = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    void* ptr;
+
+    /* Page aligned, the buffer ring first. */
+    ring->bufs.size = ring_size + (size_t)URING_RECV_BUFS * URING_RECV_BUF_SIZE;
+    ptr = mmap(NULL, ring->bufs.size, PROT_READ | PROT_WRITE, 
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        error("io_uring mmap recv buffers: %s\n", ERRSTR);
+        return false;
+    }
+    ring->bufs.ring = ptr;
+    ring->bufs.data = (u8*)ptr + ring_size;
+
+    memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+    reg.ring_addr = (u64)(uintptr_t)ptr;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = URING_BGID;
+    /* Provided buffer rings are 5.19+ */
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        verbose("io_uring register buffer ring: %s\n", ERRSTR);
+        munmap(ptr, ring->bufs.size);
+        ring->bufs.ring = NULL;
+        return false;
+    }
+
+    for (u16 bid = 0; bid < URING_RECV_BUFS; bid++)
+        uring_buf_recycle(ring, bid);
+    return true;
+}
+
+/* 
+ * Multishot recv is 6.0+, a flag the opcode probe doesn't cover. 
+ * Try one on a socketpair with a byte and EOF in it: it completes with
+ * the byte, then ends by itself. Before the ring is used, so all 
+ * completions are ours.
+ */
+static bool
+uring_test_multishot(server_uring_t* ring)
+{
+    const struct io_uring_cqe* cqe;
+    struct io_uring_sqe* sqe;
+    i32 sv[2];
+    u32 head;
+    u32 tail;
+    bool more = true;
+    bool ok = false;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+        return false;
+    if (write(sv[1], "", 1) != 1 || (sqe = uring_get_sqe(ring)) == NULL)
+        goto out;
+    close(sv[1]);
+    sv[1] = -1;
+    uring_prep_recv(sqe, sv[0], URING_TEST_DATA);
+    uring_push_sqe(ring);
+
+    while (more)
+    {
+        if (uring_enter(ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error("io_uring_enter test: %s\n", ERRSTR);
+            break;
+        }
+        ring->to_submit = 0;
+
+        head = *ring->cq.head;
+        tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            cqe = ring->cq.cqes + (head & *ring->cq.mask);
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+            {
+                ok = true;
+                uring_buf_recycle(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            more = cqe->flags & IORING_CQE_F_MORE;
+        }
+        __atomic_store_n(ring->cq.head, head, __ATOMIC_RELEASE);
+    }
+out:
+    close(sv[0]);
+    if (sv[1] != -1)
+        close(sv[1]);
+    return ok;
+}
+
+server_uring_t*
+server_uring_new(void)
+{
+    server_uring_t* ring;
+    struct io_uring_params params;
+
+    ring = calloc(1, sizeof(server_uring_t));
+    memset(&params, 0, sizeof(struct io_uring_params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+
+    ring->fd = uring_setup(URING_SQ_ENTRIES, &params);
+    if (ring->fd == -1)
+    {
+        warn("io_uring_setup: %s\n", ERRSTR);
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_init(&ring->mutex, NULL);
+
+    if (uring_mmap(ring, &params) == false)
+    {
+        server_uring_free(ring);
+        return NULL;
+    }
+
+    if (uring_bufs_init(ring))
+        ring->multishot = uring_test_multishot(ring);
+    if (ring->multishot == false)
+        info("io_uring: no multishot recv, polling sockets instead.\n");
+
+    return ring;
+}
+
+void
+server_uring_set_owner(server_uring_t* ring)
+{
+    pthread_mutex_lock(&ring->mutex);
+    ring->owner = pthread_self();
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+void
+server_uring_free(server_uring_t* ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->sq.sqes)
+        munmap(ring->sq.sqes, ring->sq.sqes_size);
+    if (ring->cq.ptr && ring->cq.ptr != ring->sq.ptr)
+        munmap(ring->cq.ptr, ring->cq.size);
+    if (ring->sq.ptr)
+        munmap(ring->sq.ptr, ring->sq.size);
+    close(ring->fd);
+    /* After the ring, the kernel may still hold the buffers until then. */
+    if (ring->bufs.ring)
+        munmap(ring->bufs.ring, ring->bufs.size);
+    pthread_mutex_destroy(&ring->mutex);
+    free(ring);
+}
+
+enum uring_op
+server_uring_op(const server_uring_t* ring, enum uring_op op)
+{
+    return (ring && ring->multishot) ? op : URING_OP_POLL;
+}
+
+/* Needs ring->mutex. */
+static i32
+uring_arm_locked(server_uring_t* ring, const server_event_t* se, enum uring_op op)
+{
+    struct io_uring_sqe* sqe;
+
+    if ((sqe = uring_get_sqe(ring)) == NULL)
+    {
+        error("io_uring arm fd: %d, no SQE.\n", se->fd);
+        return -1;
+    }
+    sqe->fd = se->fd;
+    sqe->user_data = uring_user_data(se, op);
+
+    switch (op)
+    {
+        case URING_OP_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            /* No address, server_new_client() asks for it. */
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            break;
+        case URING_OP_RECV:
+            uring_prep_recv(sqe, se->fd, sqe->user_data);
+            break;
+        case URING_OP_READY:
+            sqe->opcode = IORING_OP_NOP;
+            sqe->fd = -1;
+            break;
+        case URING_OP_POLL:
+        default:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            /* POLL_ADD is always one-shot, trigger mode bits don't apply. */
+            sqe->poll32_events = se->listen_events & ~SE_MODE_EPEV;
+            /* Next to a multishot recv, only POLLOUT is polled for. */
+            if (se->uring_op != URING_OP_POLL)
+                sqe->poll32_events &= ~(EPOLLIN | EPOLLRDHUP);
+            break;
+    }
+    uring_push_sqe(ring);
+
+    /*
+     * The owner submits with its next wait, other threads (main thread
+     * at init, or a worker adding an event to another ring) submit now.
+     */
+    if (!pthread_equal(ring->owner, pthread_self()))
+        return uring_submit_locked(ring);
+    return 0;
+}
+
+static i32
+uring_arm(server_uring_t* ring, const server_event_t* se, enum uring_op op)
+{
+    i32 ret;
+
+    pthread_mutex_lock(&ring->mutex);
+    ret = uring_arm_locked(ring, se, op);
+    pthread_mutex_unlock(&ring->mutex);
+    return (ret == -1) ? -1 : 0;
+}
+
+i32
+server_uring_add(server_uring_t* ring, server_event_t* se)
+{
+    if (se->uring_op != URING_OP_POLL && uring_arm(ring, se, se->uring_op) == -1)
+        return -1;
+    return server_uring_rearm(ring, se);
+}
+
+i32
+server_uring_rearm(server_uring_t* ring, server_event_t* se)
+{
+    if (se->uring_op == URING_OP_POLL)
+        return uring_arm(ring, se, URING_OP_POLL);
+
+    /* Multishot op is still armed, poll only if waiting for POLLOUT. */
+    if (se->listen_events & EPOLLOUT && se->uring_pollout == false)
+    {
+        if (uring_arm(ring, se, URING_OP_POLL) == -1)
+            return -1;
+        se->uring_pollout = true;
+    }
+    return 0;
+}
+
+i32
+server_uring_ready(server_uring_t* ring, const server_event_t* se)
+{
+    return uring_arm(ring, se, URING_OP_READY);
+}
+
+i32
+server_uring_remove(server_uring_t* ring, const server_event_t* se)
+{
+    struct io_uring_sqe* sqe;
+    i32 ret = -1;
+
+    pthread_mutex_lock(&ring->mutex);
+
+    if ((sqe = uring_get_sqe(ring)) == NULL)
+    {
+        error("io_uring remove fd: %d, no SQE.\n", se->fd);
+        goto out;
+    }
+    if (se->uring_op == URING_OP_POLL)
+    {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = uring_user_data(se, URING_OP_POLL);
+    }
+    else
+    {
+        /* The multishot op and a POLLOUT poll, if any. */
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = se->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    sqe->user_data = URING_REMOVE_DATA;
+    uring_push_sqe(ring);
+
+    /*
+     * Submit now, the fd usually gets closed right after and may be reused
+     * before the next wait.
+     */
+    ret = uring_submit_locked(ring);
+out:
+    pthread_mutex_unlock(&ring->mutex);
+    return (ret == -1) ? -1 : 0;
+}
+
+i32
+server_uring_wait(server_uring_t* ring, server_uring_cqe_t* cqes, 
+                  i32 max_cqes, bool block)
+{
+    const struct io_uring_cqe* cqe;
+    u32 to_submit;
+    u32 head;
+    u32 tail;
+    i32 n = 0;
+
+    pthread_mutex_lock(&ring->mutex);
+    to_submit = ring->to_submit;
+    ring->to_submit = 0;
+    pthread_mutex_unlock(&ring->mutex);
+
+    head = *ring->cq.head;
+    tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+
+    /* Submit re-arms and wait in the same syscall. */
+    if (to_submit || (block && head == tail))
+    {
+        if (uring_enter(ring->fd, to_submit, (block && head == tail),
+                        IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+        {
+            error("io_uring_enter: %s\n", ERRSTR);
+            return -1;
+        }
+        tail = __atomic_load_n(ring->cq.tail, __ATOMIC_ACQUIRE);
+    }
+
+    while (head != tail && n < max_cqes)
+    {
+        cqe = ring->cq.cqes + (head & *ring->cq.mask);
+        head++;
+
+        /* Canceled ones never carry a buffer. */
+        if (cqe->user_data == URING_REMOVE_DATA || cqe->res == -ECANCELED)
+            continue;
+
+        cqes[n].user_data = cqe->user_data;
+        cqes[n].res = cqe->res;
+        cqes[n].flags = cqe->flags;
+        n++;
+    }
+    __atomic_store_n(ring->cq.head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+static server_event_t*
+uring_recv_event(server_uring_t* ring, server_event_t* se, 
+                 const server_uring_cqe_t* cqe, const u8* buf)
+{
+    if (cqe->res > 0 && buf)
+    {
+        se->recv(se, buf, cqe->res);
+        se->ep_events = EPOLLIN;
+    }
+    else if (cqe->res == 0)
+        se->ep_events = EPOLLRDHUP;
+    else if (cqe->res == -ENOBUFS)
+    {
+        /* All buffers were in use, they are back by now. */
+        verbose("io_uring recv fd:%d out of buffers.\n", se->fd);
+        se->ep_events = 0;
+    }
+    else
+        se->ep_events = EPOLLERR;
+
+    /* Multishot recv ended (CQ overflow, no buffers), start a new one. */
+    if (!(cqe->flags & IORING_CQE_F_MORE) && se->ep_events != EPOLLRDHUP && 
+        se->ep_events != EPOLLERR)
+        uring_arm(ring, se, URING_OP_RECV);
+
+    return (se->ep_events) ? se : NULL;
+}
+
+server_event_t*
+server_uring_event(server_uring_t* ring, server_t* server, 
+                   const server_uring_cqe_t* cqe)
+{
+    server_event_t* se;
+    const enum uring_op op = uring_data_op(cqe->user_data);
+    const u8* buf = NULL;
+    u16 bid = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = ring->bufs.data + (size_t)bid * URING_RECV_BUF_SIZE;
+    }
+
+    se = server_get_event(server, uring_data_fd(cqe->user_data));
+    if (!se || se->ring != ring || se->uring_id != (u32)cqe->user_data)
+    {
+        /* Event is gone, so is the client that would take this socket. */
+        if (op == URING_OP_ACCEPT && cqe->res >= 0)
+            close(cqe->res);
+        se = NULL;
+        goto out;
+    }
+
+    switch (op)
+    {
+        case URING_OP_ACCEPT:
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                uring_arm(ring, se, URING_OP_ACCEPT);
+            if (cqe->res < 0)
+            {
+                error("io_uring accept fd:%d: %s\n", se->fd, strerror(-cqe->res));
+                se = NULL;
+                break;
+            }
+            se->uring_res = cqe->res;
+            se->ep_events = EPOLLIN;
+            break;
+        case URING_OP_RECV:
+            se = uring_recv_event(ring, se, cqe, buf);
+            break;
+        case URING_OP_READY:
+            se->ep_events = EPOLLIN;
+            break;
+        case URING_OP_POLL:
+        default:
+            se->uring_pollout = false;
+            se->ep_events = (cqe->res < 0) ? EPOLLERR : (u32)cqe->res;
+            break;
+    }
+out:
+    if (buf)
+        uring_buf_recycle(ring, bid);
+    return se;
+}
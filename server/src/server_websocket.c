@@ -76,6 +76,7 @@ server_ws_parse(eworker_t* th, client_t* client,
          */        
         client->recv.data = realloc(client->recv.data, total_size);
         client->recv.data_size = total_size;
+        client->recv.in_pool = false;
         client->recv.offset = buf_len;
         client->recv.busy = true;
 
@@ -195,6 +196,49 @@ ws_send_adv(client_t* client, u8 opcode, const char* buf, size_t len,
     return bytes_sent;
 }
 
+server_frame_t*
+ws_frame_new(u8 opcode, const char* buf, size_t len)
+{
+    server_frame_t* frame;
+    size_t hdr_len = 2;
+    u8* hdr;
+
+    if (len >= UINT16_MAX)
+        hdr_len += sizeof(u64);
+    else if (len >= 126)
+        hdr_len += sizeof(u16);
+
+    frame = server_frame_new(hdr_len + len);
+    hdr = frame->data;
+    hdr[0] = WS_FIN_BIT | (opcode & WS_OPCODE_BITS);
+    if (len >= UINT16_MAX)
+    {
+        hdr[1] = 127;
+        for (u32 i = 0; i < sizeof(u64); i++)
+            hdr[2 + i] = (u8)((u64)len >> (8 * (7 - i)));
+    }
+    else if (len >= 126)
+    {
+        hdr[1] = 126;
+        hdr[2] = (u8)(len >> 8);
+        hdr[3] = (u8)len;
+    }
+    else
+        hdr[1] = (u8)len;
+    memcpy(hdr + hdr_len, buf, len);
+
+    return frame;
+}
+
+server_frame_t*
+ws_json_frame(json_object* json)
+{
+    size_t len;
+    const char* string = json_object_to_json_string_length(json, 0, &len);
+
+    return ws_frame_new(WS_TEXT_FRAME, string, len);
+}
+
 ssize_t 
 ws_send(client_t* client, const char* buf, size_t len)
 {
@@ -0,0 +1,57 @@
+#include "http_bench_stubs.h"
+#include "server.h"
+#include "server_http.h"
+
+size_t bench_handled;
+size_t bench_sent;
+
+enum client_recv_status
+server_handle_http_get(UNUSED server_t* server, UNUSED client_t* client,
+                       UNUSED http_t* http)
+{
+    bench_handled++;
+    return RECV_OK;
+}
+
+void
+server_handle_http_post(UNUSED eworker_t* ew, UNUSED client_t* client,
+                        UNUSED const http_t* http)
+{
+}
+
+bool
+server_http_post_allowed(UNUSED server_t* server, UNUSED const http_t* http)
+{
+    return false;
+}
+
+ssize_t
+server_send(UNUSED client_t* client, UNUSED const void* buf, size_t len)
+{
+    bench_sent += len;
+    return len;
+}
+
+ssize_t
+server_sendv(UNUSED client_t* client, const struct iovec* iov, u32 n)
+{
+    ssize_t len = 0;
+
+    for (u32 i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    bench_sent += len;
+    return len;
+}
+
+ssize_t
+server_send_file(UNUSED client_t* client, UNUSED i32 fd,
+                 UNUSED size_t offset, size_t size)
+{
+    bench_sent += size;
+    return size;
+}
+
+void
+server_timer_cancel(UNUSED server_timer_t* timer)
+{
+}
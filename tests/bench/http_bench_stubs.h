@@ -0,0 +1,15 @@
+/*
+ * What server_http.c calls outside of itself, for the HTTP benchmarks
+ * linking it with server_log.c, server_crypt.c and server_util.c only.
+ * Handlers only count, sends only count bytes.
+ */
+
+#ifndef _HTTP_BENCH_STUBS_H_
+#define _HTTP_BENCH_STUBS_H_
+
+#include "common.h"
+
+extern size_t bench_handled;    /* GET requests */
+extern size_t bench_sent;       /* Bytes */
+
+#endif // _HTTP_BENCH_STUBS_H_
@@ -0,0 +1,91 @@
+/*
+ * HTTP request head parser (server_http_parse()).
+ *
+ *  Parses the same GET head `reqs` times from a recv page, like a
+ *  keep-alive connection sending one request per read: request line,
+ *  Host, Connection and `headers` X-Bench-N headers with 32 byte values.
+ *  Handlers and sends are stubbed out (http_bench_stubs.c), so only
+ *  parsing and the per-request http_t setup/teardown are measured.
+ *
+ *  Prints the head size and requests/s.
+ *
+ *  meson compile -C build http_parse_bench && ./build/http_parse_bench [reqs] [headers]
+ *
+ *  The file only uses the parser's entry point and the client's recv
+ *  page, so it also builds against older trees, e.g. with a checkout of
+ *  the tree before in-place parsing in old/:
+ *
+ *  cc -O2 -Iold/server/include tests/bench/http_parse_bench.c \
+ *     tests/bench/http_bench_stubs.c old/server/src/server_{http,log,crypt,util}.c \
+ *     $(pkg-config --cflags --libs openssl json-c libpq libmagic)
+ */
+
+#include "server.h"
+#include "server_http.h"
+#include "http_bench_stubs.h"
+#include <time.h>
+
+#define HEAD_SIZE   4096
+
+static size_t
+build_head(char* head, size_t headers)
+{
+    size_t len;
+
+    len = sprintf(head, "GET /index.html HTTP/1.1\r\n"
+                        "Host: 127.0.0.1:8080\r\n"
+                        "Connection: keep-alive\r\n");
+    for (size_t i = 0; i < headers; i++)
+        len += sprintf(head + len, "X-Bench-%zu: %s\r\n", i,
+                       "vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv");
+    len += sprintf(head + len, "\r\n");
+    return len;
+}
+
+int
+main(int argc, const char** argv)
+{
+    server_t server = {0};
+    eworker_t ew = {0};
+    client_t client = {0};
+    char head[HEAD_SIZE];
+    size_t reqs = 1000000;
+    size_t headers = 15;
+    size_t len;
+    u8* page;
+    struct timespec start;
+    struct timespec end;
+    f64 secs;
+
+    if (argc > 1)
+        reqs = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        headers = strtoul(argv[2], NULL, 10);
+    if (headers > 64)
+        headers = 64;
+
+    server_set_loglevel(SERVER_WARN);
+    ew.server = &server;
+    len = build_head(head, headers);
+
+    page = calloc(1, HEAD_SIZE);
+    client.recv.data = page;
+    client.recv.data_size = HEAD_SIZE - 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < reqs; i++)
+    {
+        /* Parsing in place writes into the page, so refill it. */
+        memcpy(page, head, len + 1);
+        client.recv.offset = 0;
+        client.state = 0;
+        server_http_parse(&ew, &client, page, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%zu-byte head: %.0f req/s (%zu handled)\n", len, reqs / secs, bench_handled);
+
+    free(page);
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * HTTP response builder (http_send() and the responses built on it).
+ *
+ *  Builds and "sends" `resps` responses of each kind to a keep-alive
+ *  client, sends are stubbed out (http_bench_stubs.c) and only count bytes:
+ *
+ *  200:      http_new_resp() with a 512 byte body, like a small API reply.
+ *  200 8K:   same with an 8 KiB body, too big to share a buffer with the head.
+ *  304:      server_http_resp_not_modified(), five headers, no body.
+ *  404:      server_http_resp_error().
+ *
+ *  Prints responses/s and bytes per response of each.
+ *
+ *  meson compile -C build http_resp_bench && ./build/http_resp_bench [resps]
+ *
+ *  Only public entry points are used, so it also builds against older
+ *  trees, e.g. with a checkout of the tree before the stack head builder
+ *  in old/:
+ *
+ *  cc -O2 -Iold/server/include tests/bench/http_resp_bench.c \
+ *     tests/bench/http_bench_stubs.c old/server/src/server_{http,log,crypt,util}.c \
+ *     $(pkg-config --cflags --libs openssl json-c libpq libmagic)
+ */
+
+#include "server.h"
+#include "server_http.h"
+#include "http_bench_stubs.h"
+#include <time.h>
+
+#define SMALL_BODY  512
+#define LARGE_BODY  (8 * KIB)
+
+enum bench_resp
+{
+    BENCH_OK_SMALL,
+    BENCH_OK_LARGE,
+    BENCH_NOT_MODIFIED,
+    BENCH_NOT_FOUND,
+
+    BENCH_COUNT
+};
+
+static const char* const bench_name[BENCH_COUNT] = {
+    [BENCH_OK_SMALL]     = "200",
+    [BENCH_OK_LARGE]     = "200 8K",
+    [BENCH_NOT_MODIFIED] = "304",
+    [BENCH_NOT_FOUND]    = "404",
+};
+
+static void
+bench_resp(client_t* client, enum bench_resp type, const char* body)
+{
+    const http_cache_t cache = {
+        .etag = "\"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\"",
+        .mtime = 1700000000,
+        .cache_control = HTTP_CACHE_REVALIDATE,
+        .vary = true,
+    };
+    http_t* http;
+
+    switch (type)
+    {
+        case BENCH_OK_SMALL:
+        case BENCH_OK_LARGE:
+            http = http_new_resp(HTTP_CODE_OK, "OK", body,
+                                 (type == BENCH_OK_SMALL) ? SMALL_BODY : LARGE_BODY);
+            http_send(client, http);
+            http_free(http);
+            break;
+        case BENCH_NOT_MODIFIED:
+            server_http_resp_not_modified(client, &cache);
+            break;
+        case BENCH_NOT_FOUND:
+            server_http_resp_error(client, HTTP_CODE_NOT_FOUND, "Not Found");
+            break;
+        default:
+            break;
+    }
+}
+
+int
+main(int argc, const char** argv)
+{
+    server_t server = {0};
+    eworker_t ew = {0};
+    client_t client = {0};
+    size_t resps = 1000000;
+    char* body;
+    struct timespec start;
+    struct timespec end;
+    f64 secs;
+
+    if (argc > 1)
+        resps = strtoul(argv[1], NULL, 10);
+    if (resps == 0)
+        resps = 1;
+
+    server_set_loglevel(SERVER_WARN);
+    server.conf.idle_timeout = CLIENT_IDLE_TIMEOUT;
+    ew.server = &server;
+    client.ew = &ew;
+    client.addr.sock = -1;
+    client.state = CLIENT_STATE_KEEP_ALIVE;
+
+    body = malloc(LARGE_BODY);
+    memset(body, 'b', LARGE_BODY);
+
+    for (i32 type = 0; type < BENCH_COUNT; type++)
+    {
+        bench_sent = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t i = 0; i < resps; i++)
+            bench_resp(&client, type, body);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-7s %10.0f resp/s, %zu bytes each\n",
+               bench_name[type], resps / secs, bench_sent / resps);
+    }
+
+    free(body);
+    return 0;
+}
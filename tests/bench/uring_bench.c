@@ -0,0 +1,288 @@
+/*
+ * Receive path of the io_uring event backend against epoll.
+ *
+ *  `conns` loopback TCP connections, a sender thread writes one MSG_SIZE
+ *  message to each of them per round and waits until the receiver got
+ *  them all. The receiver copies every message out once, like reading it
+ *  into a recv page (epoll) or the SSL memory BIO (io_uring):
+ *
+ *  epoll:    epoll_wait() + recv() until EAGAIN, accept4() until EAGAIN,
+ *            like an eworker with its own (reuseport) epoll.
+ *  io_uring: server_uring.c, multishot accept and multishot recv into
+ *            provided buffers, like an eworker with --io-uring.
+ *
+ *  Prints messages/s and the receiver's syscalls per message. For
+ *  io_uring every wait is counted as a syscall, an upper bound.
+ *
+ *  meson compile -C build uring_bench && ./build/uring_bench [conns] [rounds]
+ */
+
+#include "server.h"
+#include "server_uring.h"
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define MSG_SIZE    512
+#define BENCH_BATCH 16  /* EWORKER_MAX_EVENTS */
+#define MAX_CONNS   1024
+
+typedef struct
+{
+    bool        uring;
+    i32         listen_fd;
+    u16         port;
+    size_t      conns;
+    size_t      rounds;
+    size_t      accepted;
+    u64         syscalls;
+    u64         received;   /* Bytes, read by the sender */
+    server_uring_t* ring;
+    server_event_t  events[MAX_CONNS + 1];
+    u8          page[CLIENT_RECV_PAGE];
+} bench_t;
+
+static server_event_t* fd_events[MAX_CONNS * 2 + 64];
+
+/* server_uring_event() looks events up in the fd table. */
+server_event_t*
+server_get_event(UNUSED server_t* server, i32 fd)
+{
+    if (fd < 0 || fd >= (i32)(sizeof(fd_events) / sizeof(void*)))
+        return NULL;
+    return fd_events[fd];
+}
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_recv(server_event_t* se, const u8* buf, size_t len)
+{
+    bench_t* b = se->data;
+
+    memcpy(b->page, buf, (len > sizeof(b->page)) ? sizeof(b->page) : len);
+    __atomic_add_fetch(&b->received, len, __ATOMIC_RELEASE);
+}
+
+static server_event_t*
+bench_event(bench_t* b, i32 fd, enum uring_op op)
+{
+    server_event_t* se = &b->events[b->accepted];
+
+    memset(se, 0, sizeof(server_event_t));
+    se->fd = fd;
+    se->ring = b->ring;
+    se->uring_id = 1;
+    se->uring_op = op;
+    se->listen_events = DEFAULT_EPEV | EPOLLONESHOT;
+    se->data = b;
+    se->recv = bench_recv;
+    fd_events[fd] = se;
+    return se;
+}
+
+static void
+bench_uring_loop(bench_t* b)
+{
+    server_uring_cqe_t cqes[BENCH_BATCH];
+    server_event_t* se;
+    i32 n;
+
+    server_uring_set_owner(b->ring);
+    se = bench_event(b, b->listen_fd, URING_OP_ACCEPT);
+    if (server_uring_add(b->ring, se) == -1)
+        return;
+
+    while (__atomic_load_n(&b->received, __ATOMIC_ACQUIRE) < 
+           b->conns * b->rounds * MSG_SIZE)
+    {
+        n = server_uring_wait(b->ring, cqes, BENCH_BATCH, true);
+        b->syscalls++;
+        for (i32 i = 0; i < n; i++)
+        {
+            if ((se = server_uring_event(b->ring, NULL, cqes + i)) == NULL)
+                continue;
+            if (se->uring_op == URING_OP_ACCEPT)
+            {
+                b->accepted++;
+                server_uring_add(b->ring, bench_event(b, se->uring_res, URING_OP_RECV));
+            }
+        }
+    }
+}
+
+static void
+bench_epoll_loop(bench_t* b)
+{
+    struct epoll_event events[BENCH_BATCH];
+    struct epoll_event ev = {
+        .events = EPOLLIN
+    };
+    ssize_t ret;
+    i32 epfd;
+    i32 fd;
+    i32 n;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    ev.data.fd = b->listen_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, b->listen_fd, &ev);
+
+    while (__atomic_load_n(&b->received, __ATOMIC_ACQUIRE) < 
+           b->conns * b->rounds * MSG_SIZE)
+    {
+        n = epoll_wait(epfd, events, BENCH_BATCH, -1);
+        b->syscalls++;
+        for (i32 i = 0; i < n; i++)
+        {
+            if (events[i].data.fd == b->listen_fd)
+            {
+                while ((fd = accept4(b->listen_fd, NULL, NULL, 
+                                     SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+                {
+                    b->syscalls++;
+                    ev.data.fd = fd;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                    b->syscalls++;
+                    b->accepted++;
+                }
+                b->syscalls++;
+                continue;
+            }
+
+            do {
+                ret = recv(events[i].data.fd, b->page, sizeof(b->page), 0);
+                b->syscalls++;
+                if (ret > 0)
+                    __atomic_add_fetch(&b->received, ret, __ATOMIC_RELEASE);
+            } while (ret > 0);
+        }
+    }
+    close(epfd);
+}
+
+static void*
+bench_receiver(void* arg)
+{
+    bench_t* b = arg;
+
+    if (b->uring)
+        bench_uring_loop(b);
+    else
+        bench_epoll_loop(b);
+    return NULL;
+}
+
+static bool
+bench_listen(bench_t* b)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+
+    b->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (b->listen_fd == -1 || 
+        bind(b->listen_fd, (struct sockaddr*)&addr, len) == -1 ||
+        listen(b->listen_fd, MAX_CONNS) == -1 ||
+        getsockname(b->listen_fd, (struct sockaddr*)&addr, &len) == -1)
+    {
+        fprintf(stderr, "listen: %s\n", ERRSTR);
+        return false;
+    }
+    b->port = addr.sin_port;
+    return true;
+}
+
+static void
+bench_run(bench_t* b, const char* name)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    u8 msg[MSG_SIZE];
+    i32 fds[MAX_CONNS];
+    pthread_t pth;
+    double start;
+    double elapsed;
+    u64 want;
+    u64 msgs = b->conns * b->rounds;
+
+    if (bench_listen(b) == false)
+        return;
+    addr.sin_port = b->port;
+    memset(msg, 'm', MSG_SIZE);
+    pthread_create(&pth, NULL, bench_receiver, b);
+
+    for (size_t i = 0; i < b->conns; i++)
+    {
+        fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(fds[i], (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        {
+            fprintf(stderr, "connect: %s\n", ERRSTR);
+            exit(1);
+        }
+    }
+
+    start = now_sec();
+    for (size_t r = 0; r < b->rounds; r++)
+    {
+        for (size_t i = 0; i < b->conns; i++)
+            if (send(fds[i], msg, MSG_SIZE, 0) != MSG_SIZE)
+                exit(1);
+
+        want = (r + 1) * b->conns * MSG_SIZE;
+        while (__atomic_load_n(&b->received, __ATOMIC_ACQUIRE) < want)
+            sched_yield();
+    }
+    elapsed = now_sec() - start;
+    pthread_join(pth, NULL);
+
+    printf("%-9s %8.0f msgs/s  %5.2f syscalls/msg  (%zu conns accepted)\n",
+           name, msgs / elapsed, (double)b->syscalls / msgs, b->accepted);
+
+    for (size_t i = 0; i < b->conns; i++)
+        close(fds[i]);
+    close(b->listen_fd);
+    memset(fd_events, 0, sizeof(fd_events));
+}
+
+int
+main(int argc, char** argv)
+{
+    bench_t* b;
+    size_t conns = (argc > 1) ? strtoul(argv[1], NULL, 10) : 64;
+    size_t rounds = (argc > 2) ? strtoul(argv[2], NULL, 10) : 5000;
+
+    if (conns == 0 || conns > MAX_CONNS)
+        conns = 64;
+    server_set_loglevel(SERVER_WARN);
+
+    b = calloc(1, sizeof(bench_t));
+    b->conns = conns;
+    b->rounds = rounds;
+    bench_run(b, "epoll");
+
+    memset(b, 0, sizeof(bench_t));
+    b->uring = true;
+    b->conns = conns;
+    b->rounds = rounds;
+    if ((b->ring = server_uring_new()) == NULL || b->ring->multishot == false)
+    {
+        printf("io_uring: no multishot recv on this kernel.\n");
+        return 0;
+    }
+    bench_run(b, "io_uring");
+    server_uring_free(b->ring);
+    free(b);
+
+    return 0;
+}
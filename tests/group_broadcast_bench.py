@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+
+# Benchmark group message broadcast throughput.
+# Connects N members (bench0..benchN-1, registered if needed) to one group,
+# the first member sends messages and every member counts received ones.
+# Run the server with --reuseport to measure cross-worker sends.
+
+import sys
+import time
+import asyncio
+import websockets
+import json
+import ssl
+
+host = "127.0.0.1"
+port = "8080"
+uri = f"wss://{host}:{port}"
+password = "bench1234"
+
+ssl_context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+ssl_context.check_hostname = False
+ssl_context.verify_mode = ssl.CERT_NONE;
+
+async def recv_cmd(ws, cmd: str) -> dict:
+    while True:
+        packet = json.loads(await ws.recv())
+        if packet["cmd"] == cmd or packet["cmd"] == "error":
+            return packet
+
+async def connect(i: int):
+    ws = await websockets.connect(uri, ssl=ssl_context, max_queue=None)
+    username = f"bench{i}"
+    await ws.send(json.dumps({
+        "cmd": "register",
+        "username": username,
+        "displayname": username,
+        "password": password
+    }))
+    if (await recv_cmd(ws, "session"))["cmd"] != "session":
+        await ws.send(json.dumps({
+            "cmd": "login",
+            "username": username,
+            "password": password
+        }))
+        if (await recv_cmd(ws, "session"))["cmd"] != "session":
+            raise RuntimeError(f"{username}: login failed")
+    return ws
+
+async def count_msgs(ws, group_id: int, n_msgs: int):
+    n = 0
+    while n < n_msgs:
+        packet = json.loads(await ws.recv())
+        if packet["cmd"] == "group_msg" and packet["group_id"] == group_id:
+            n += 1
+
+async def main(n_members: int, n_msgs: int) -> int:
+    members = []
+    for i in range(n_members):
+        members.append(await connect(i))
+    print(f"{n_members} members connected")
+
+    owner = members[0]
+    await owner.send(json.dumps({"cmd": "group_create", "name": "bench", "public": True}))
+    group_id = (await recv_cmd(owner, "client_groups"))["groups"][0]["group_id"]
+
+    for ws in members[1:]:
+        await ws.send(json.dumps({"cmd": "join_group", "group_id": group_id}))
+    await asyncio.sleep(2)
+    for ws in members:
+        while True:
+            try:
+                await asyncio.wait_for(ws.recv(), 0.01)
+            except asyncio.TimeoutError:
+                break
+
+    receivers = [asyncio.create_task(count_msgs(ws, group_id, n_msgs)) for ws in members]
+    start = time.monotonic()
+    for i in range(n_msgs):
+        await owner.send(json.dumps({
+            "cmd": "group_msg",
+            "group_id": group_id,
+            "content": f"bench {i}",
+            "attachments": []
+        }))
+    await asyncio.gather(*receivers)
+    elapsed = time.monotonic() - start
+
+    frames = n_members * n_msgs
+    print(f"{n_msgs} msgs to {n_members} members in {elapsed:.3f}s: "
+          f"{n_msgs / elapsed:.1f} msgs/s, {frames / elapsed:.1f} frames/s")
+
+    owner_json = json.dumps({"cmd": "delete_group", "group_id": group_id})
+    await owner.send(owner_json)
+    for ws in members:
+        await ws.close()
+    return 0
+
+if __name__ == '__main__':
+    n_members = int(sys.argv[1]) if len(sys.argv) > 1 else 1000
+    n_msgs = int(sys.argv[2]) if len(sys.argv) > 2 else 100
+    sys.exit(asyncio.run(main(n_members, n_msgs)))
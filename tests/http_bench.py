@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+
+# Benchmark HTTP request parsing in requests/second.
+# N connections each send GET requests one after another on one
+# keep-alive connection. Run it against two builds to compare parsers.
+# Large heads (many headers) put the weight on parsing, not on sending.
+
+import sys
+import time
+import asyncio
+from http_common import host, port, ssl_context, read_response
+
+path = "/"
+
+def make_request(n_headers: int) -> bytes:
+    lines = [f"GET {path} HTTP/1.1", f"Host: {host}:{port}", "Connection: keep-alive"]
+    for i in range(n_headers):
+        lines.append(f"X-Bench-{i}: {'v' * 32}")
+    return ("\r\n".join(lines) + "\r\n\r\n").encode()
+
+async def client(request: bytes, n_reqs: int) -> int:
+    reader, writer = await asyncio.open_connection(host, port, ssl=ssl_context)
+    ok = 0
+    for _ in range(n_reqs):
+        writer.write(request)
+        if await read_response(reader) == 200:
+            ok += 1
+    writer.close()
+    return ok
+
+async def main(n_conns: int, n_reqs: int, n_headers: int) -> int:
+    request = make_request(n_headers)
+    start = time.monotonic()
+    results = await asyncio.gather(*[client(request, n_reqs) for _ in range(n_conns)])
+    elapsed = time.monotonic() - start
+
+    total = n_conns * n_reqs
+    print(f"{total} requests ({len(request)} byte heads) over {n_conns} connections "
+          f"in {elapsed:.3f}s: {total / elapsed:.1f} req/s, {sum(results)} OK")
+    return 0 if sum(results) == total else 1
+
+if __name__ == '__main__':
+    n_conns = int(sys.argv[1]) if len(sys.argv) > 1 else 50
+    n_reqs = int(sys.argv[2]) if len(sys.argv) > 2 else 200
+    n_headers = int(sys.argv[3]) if len(sys.argv) > 3 else 15
+    sys.exit(asyncio.run(main(n_conns, n_reqs, n_headers)))
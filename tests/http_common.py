@@ -0,0 +1,22 @@
+# Shared by the HTTP benchmarks: server address, TLS context and
+# reading one response off a keep-alive connection.
+
+import ssl
+
+host = "127.0.0.1"
+port = 8080
+
+ssl_context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+ssl_context.check_hostname = False
+ssl_context.verify_mode = ssl.CERT_NONE
+
+async def read_response(reader) -> int:
+    head = await reader.readuntil(b"\r\n\r\n")
+    status = int(head.split(b" ", 2)[1])
+    length = 0
+    for line in head.split(b"\r\n")[1:]:
+        name, _, val = line.partition(b":")
+        if name.strip().lower() == b"content-length":
+            length = int(val)
+    await reader.readexactly(length)
+    return status
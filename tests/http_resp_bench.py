@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+
+# Benchmark HTTP response building in responses/second.
+# 200: GET / and 404: GET /missing, N keep-alive connections each send
+# requests one after another. 101: one WebSocket upgrade per connection.
+# Small requests, so the weight is on building and sending responses.
+# tests/bench/http_resp_bench.c measures the builder alone, in-process.
+
+import sys
+import time
+import asyncio
+import base64
+import os
+from http_common import host, port, ssl_context, read_response
+
+def make_get(path: str) -> bytes:
+    return (f"GET {path} HTTP/1.1\r\nHost: {host}:{port}\r\n"
+            "Connection: keep-alive\r\n\r\n").encode()
+
+def make_upgrade() -> bytes:
+    key = base64.b64encode(os.urandom(16)).decode()
+    return (f"GET / HTTP/1.1\r\nHost: {host}:{port}\r\n"
+            "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+            f"Sec-WebSocket-Key: {key}\r\nSec-WebSocket-Version: 13\r\n\r\n").encode()
+
+async def client_get(request: bytes, n_reqs: int, expect: int) -> int:
+    reader, writer = await asyncio.open_connection(host, port, ssl=ssl_context)
+    ok = 0
+    for _ in range(n_reqs):
+        writer.write(request)
+        if await read_response(reader) == expect:
+            ok += 1
+    writer.close()
+    return ok
+
+async def client_upgrade(n_reqs: int) -> int:
+    ok = 0
+    for _ in range(n_reqs):
+        reader, writer = await asyncio.open_connection(host, port, ssl=ssl_context)
+        writer.write(make_upgrade())
+        if await read_response(reader) == 101:
+            ok += 1
+        writer.close()
+    return ok
+
+async def run(name: str, n_conns: int, n_reqs: int, clients) -> bool:
+    start = time.monotonic()
+    results = await asyncio.gather(*clients)
+    elapsed = time.monotonic() - start
+
+    total = n_conns * n_reqs
+    print(f"{name}: {total} responses over {n_conns} connections "
+          f"in {elapsed:.3f}s: {total / elapsed:.1f} resp/s, {sum(results)} OK")
+    return sum(results) == total
+
+async def main(n_conns: int, n_reqs: int, n_upgrades: int) -> int:
+    ok = await run("200", n_conns, n_reqs,
+                   [client_get(make_get("/"), n_reqs, 200) for _ in range(n_conns)])
+    ok &= await run("404", n_conns, n_reqs,
+                    [client_get(make_get("/missing"), n_reqs, 404) for _ in range(n_conns)])
+    ok &= await run("101", n_conns, n_upgrades,
+                    [client_upgrade(n_upgrades) for _ in range(n_conns)])
+    return 0 if ok else 1
+
+if __name__ == '__main__':
+    n_conns = int(sys.argv[1]) if len(sys.argv) > 1 else 50
+    n_reqs = int(sys.argv[2]) if len(sys.argv) > 2 else 1000
+    n_upgrades = int(sys.argv[3]) if len(sys.argv) > 3 else 20
+    sys.exit(asyncio.run(main(n_conns, n_reqs, n_upgrades)))